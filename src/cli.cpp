@@ -0,0 +1,121 @@
+// Headless front end: reads queries, one per line, and prints the recommendations as tab-separated rows, so the
+// engine can run on machines without a display or OpenGL.
+//
+//   MusicSuggestionsCli [--catalog songdata.csv] [--batch N] [--shared] [--stages FILE] [--trace FILE] [queries.txt]
+//
+// Query lines follow the text protocol described in recommender.h; blank lines and # comments are skipped.
+// Queries are evaluated --batch at a time (default 256, or 1 when typed at a terminal) so feature queries share one
+// pass over the catalog. --shared attaches to the host's shared catalog image instead of loading (publishing one
+// if there is none yet), so batch workers start without parsing or indexing. --stages writes the per-stage latency
+// percentiles (see StageTimer) to FILE on exit, and --trace the run's timeline as Chrome trace JSON (see TraceScope).
+#include "recommender.h"
+#ifdef _WIN32
+#include <io.h>
+#define isatty _isatty
+#define fileno _fileno
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+constexpr size_t CLI_DEFAULT_BATCH = 256;
+
+void printResults(const Catalog& catalog, const std::vector<size_t>& numbers, const std::vector<TextQuery>& queries, const std::vector<QueryOutput>& outputs) {
+    for (size_t i = 0; i < queries.size(); i++) writeTextResult(std::cout, catalog.songs, numbers[i], queries[i], outputs[i]);
+    std::cout.flush();
+}
+
+int main(int argc, char** argv) {
+    std::string catalogFile = "songdata.csv", queryFile, stagesFile, traceFile;
+    size_t batch = 0;
+    bool shared = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        int number = 0;
+        if (arg == "--catalog" && i + 1 < argc) {
+            catalogFile = argv[++i];
+        } else if (arg == "--batch" && i + 1 < argc && parseCount(argv[i + 1], number) && number > 0) {
+            batch = static_cast<size_t>(number);
+            i++;
+        } else if (arg == "--shared") {
+            shared = true;
+        } else if (arg == "--stages" && i + 1 < argc) {
+            stagesFile = argv[++i];
+        } else if (arg == "--trace" && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if (arg.rfind("--", 0) != 0 && queryFile.empty()) {
+            queryFile = arg;
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--catalog songdata.csv] [--batch N] [--shared] [--stages FILE] [--trace FILE] [queries.txt]\n";
+            return 2;
+        }
+    }
+    std::ifstream fileInput;
+    if (!queryFile.empty()) {
+        fileInput.open(queryFile);
+        if (!fileInput) {
+            std::cerr << "Could not open " << queryFile << "\n";
+            return 1;
+        }
+    }
+    std::istream& input = queryFile.empty() ? std::cin : fileInput;
+    if (!traceFile.empty()) {
+        nameTraceThread("cli");
+        startTrace();
+    }
+    // answers each line as it is typed, but batches piped or file input
+    if (batch == 0) batch = queryFile.empty() && isatty(fileno(stdin)) ? 1 : CLI_DEFAULT_BATCH;
+
+    // the loaders report progress on stdout, which is reserved for results here
+    std::streambuf* stdoutBuffer = std::cout.rdbuf(std::cerr.rdbuf());
+    std::unique_ptr<Catalog> catalog = shared ? loadCatalogShared(catalogFile) : loadCatalog(catalogFile);
+    std::cout.rdbuf(stdoutBuffer);
+    if (catalog->songs.empty()) {
+        std::cerr << "No songs loaded from " << catalogFile << "\n";
+        return 1;
+    }
+    CatalogView view = catalog->view();
+
+    std::vector<size_t> numbers;
+    std::vector<TextQuery> queries;
+    std::vector<QueryRequest> requests;
+    auto flush = [&]() {
+        if (queries.empty()) return;
+        // neighbor queries wait for the graph rather than silently falling back to features
+        bool needsNeighbors = std::any_of(requests.begin(), requests.end(), [](const QueryRequest& r) { return r.recommendMode == 3; });
+        if (needsNeighbors) catalog->waitForNeighborGraph();
+        printResults(*catalog, numbers, queries, runQueries(view, requests));
+        numbers.clear();
+        queries.clear();
+        requests.clear();
+    };
+    std::string line;
+    size_t lineNumber = 0, queryNumber = 0;
+    while (std::getline(input, line)) {
+        lineNumber++;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        size_t first = line.find_first_not_of(" \t");
+        if (first == std::string::npos || line[first] == '#') continue;
+        TextQuery query;
+        std::string error;
+        if (!parseTextQuery(line, catalog->songs.size(), query, error)) {
+            std::cerr << "line " << lineNumber << ": " << error << "\n";
+            continue;
+        }
+        numbers.push_back(++queryNumber);
+        requests.push_back(query.request);
+        queries.push_back(std::move(query));
+        if (queries.size() >= batch) flush();
+    }
+    flush();
+    if (!traceFile.empty() && !stopTrace(traceFile)) {
+        std::cerr << "Could not write " << traceFile << "\n";
+        return 1;
+    }
+    if (!stagesFile.empty() && !(std::ofstream(stagesFile) << stageReport())) {
+        std::cerr << "Could not write " << stagesFile << "\n";
+        return 1;
+    }
+    return 0;
+}
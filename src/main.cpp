@@ -1,19 +1,7 @@
 // We ran into trouble coordinating with Git and a experienced few issues, so some code was emailed.
 // or passed in the group chat. We all did our fair share of work and apologize for the poor Git competency.
 // We should have learned proper use of it a little earlier than when we started. Thank you.
-#include <iostream>
-#include <fstream>
-#include <sstream>
-#include <vector>
-#include <string>
-#include <algorithm>
-#include <random>
-#include <chrono>
-#include <filesystem>
-#include <cmath>
-#include <cctype>
-#include <cstdlib>
-#include <ctime>
+#include "recommender.h"
 #include "imgui.h"
 #include "backends/imgui_impl_glfw.h"
 #include "backends/imgui_impl_opengl3.h"
@@ -21,169 +9,34 @@
 
 using namespace std;
 
-struct Song {
-    // song structure: artist, title of track, and three recommendation variables
-    std::string artist;
-    std::string title;
-    int energy;
-    int danceability;
-    int acousticness;
-};
+// The render loop only draws while something changes: a short burst of frames after each input, since ImGui needs a
+// couple to settle, then it blocks until the next event or IDLE_WAIT_SECONDS (which keeps the text cursor blinking).
+// Background work wakes it with glfwPostEmptyEvent.
+constexpr int ACTIVE_FRAMES = 3;
+constexpr double IDLE_WAIT_SECONDS = 0.5;
+constexpr int FRAME_HISTORY = 120;
+constexpr const char* TRACE_FILE = "music-suggestions-trace.json"; // where "Record Trace" writes, in the working directory
 
-string normalize(const string &s) {
-    // function used for sorting algorithm components
-    string out;
-    for (char c: s) {
-        if (isalnum(static_cast<unsigned char>(c)) || c == ' ') {
-            out += tolower(static_cast<unsigned char>(c));
-        }
-    }
-    size_t firstAlpha = out.find_first_of("abcdefghijklmnopqrstuvwxyz");
-    if (firstAlpha != string::npos) {
-        out = out.substr(firstAlpha);
-    } else {
-        out = "zzz" + out;
-    }
-    return out;
-}
-
-std::vector<Song> loadSongs(const std::string& filename) {
-    // parse and load songs into csv file for pulling recommendations
-    std::vector<Song> songs;
-    std::filesystem::path current = std::filesystem::current_path();
-    while (!std::filesystem::exists(current / "resources") && current.has_parent_path()) {
-        current = current.parent_path();
-    }
-    std::filesystem::path csvPath = current / "resources" / filename;
-    std::ifstream file(csvPath);
-    if (!file.is_open()) {
-        std::cerr << "Failed to open CSV file\n";
-        return songs;
-    }
-
-    std::mt19937 rng(std::random_device{}());
-    std::uniform_int_distribution<int> dist(0, 100);
-
-    std::string line;
-    while (std::getline(file, line)) {
-        size_t commaPos = line.find(',');
-        if (commaPos != std::string::npos) {
-            std::string artist = line.substr(0, commaPos);
-            std::string title = line.substr(commaPos + 1);
-            
-            // Trim whitespace and remove quotes
-            auto trim = [](std::string& s) {
-                s.erase(0, s.find_first_not_of(" \t\r\n\""));
-                s.erase(s.find_last_not_of(" \t\r\n\"") + 1);
-            };
-            
-            trim(artist);
-            trim(title);
-            
-            if (!artist.empty() && !title.empty()) {
-                Song s;
-                s.artist = artist;
-                s.title = title;
-                s.energy = dist(rng);
-                s.danceability = dist(rng);
-                s.acousticness = dist(rng);
-                songs.push_back(s);
-            }
-        }
-    }
-
-    std::cout << "CSV loaded from: \"" << csvPath.string() << "\"\n";
-    return songs;
-}
-
-std::vector<Song> recommendSongs(const std::vector<Song>& songs, const Song& seed, int margin, bool useEnergy, bool useDance, bool useAcoustic, bool prioritizeSearch, const std::string& term) {
-    // create song recommendation vector, utilizes seed song
-    std::vector<Song> recommendations;
-    for (const auto& s : songs) {
-        if (prioritizeSearch && term.size() > 0) {
-            if (s.title.find(term) == std::string::npos && s.artist.find(term) == std::string::npos) continue;
-        }
-
-        bool match = true;
-        if (useEnergy && (s.energy < seed.energy - margin || s.energy > seed.energy + margin)) match = false;
-        if (useDance && (s.danceability < seed.danceability - margin || s.danceability > seed.danceability + margin)) match = false;
-        if (useAcoustic && (s.acousticness < seed.acousticness - margin || s.acousticness > seed.acousticness + margin)) match = false;
-        if (match) recommendations.push_back(s);
-    }
-    return recommendations;
+double threadCpuMs() {
+    // CPU time consumed by the calling thread
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user);
+    auto ticks = [](const FILETIME& t) { return (static_cast<uint64_t>(t.dwHighDateTime) << 32) | t.dwLowDateTime; };
+    return (ticks(kernel) + ticks(user)) / 1e4; // 100 ns units
+#else
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+#endif
 }
 
-double similarityScore(const Song& a, const Song& seed, bool useEnergy, bool useDance, bool useAcoustic) {
-    // used for sorting the recommendations based on their composite similarity
-    double score = 0;
-    if (useEnergy) score += std::abs(a.energy - seed.energy);
-    if (useDance) score += std::abs(a.danceability - seed.danceability);
-    if (useAcoustic) score += std::abs(a.acousticness - seed.acousticness);
-    return score;
-}
-
-int partition(vector<Song> &songs, int low, int high, bool byTitle) {
-    // partition function for quick sort
-    int randomIndex = low + rand() % (high - low + 1);
-    swap(songs[randomIndex], songs[high]);
-    string pivot = byTitle ? normalize(songs[high].title) : normalize(songs[high].artist);
-    int i = low - 1;
-    for (int j = low; j < high; j++) {
-        string val = byTitle ? normalize(songs[j].title) : normalize(songs[j].artist);
-        if (val <= pivot) {
-            i++;
-            swap(songs[i], songs[j]);
-        }
-    }
-    swap(songs[i + 1], songs[high]);
-    return i + 1;
-}
-
-void quickSort(vector<Song> &songs, int low, int high, bool byTitle) {
-    // quick sort algorithm
-    while (low < high) {
-        int pi = partition(songs, low, high, byTitle);
-        if (pi - low < high - pi) {
-            quickSort(songs, low, pi - 1, byTitle);
-            low = pi + 1;
-        } else {
-            quickSort(songs, pi + 1, high, byTitle);
-            high = pi - 1;
-        }
-    }
-}
-
-void merge(vector<Song> &songs, int l, int m, int r, bool byTitle) {
-    // merge function for merge sort
-    int n1 = m - l + 1, n2 = r - m;
-    vector<Song> L(n1), R(n2);
-    for (int i = 0; i < n1; i++) L[i] = songs[l + i];
-    for (int j = 0; j < n2; j++) R[j] = songs[m + 1 + j];
-    int i = 0, j = 0, k = l;
-    while (i < n1 && j < n2) {
-        string leftVal = byTitle ? normalize(L[i].title) : normalize(L[i].artist);
-        string rightVal = byTitle ? normalize(R[j].title) : normalize(R[j].artist);
-        if (leftVal <= rightVal) songs[k++] = L[i++];
-        else songs[k++] = R[j++];
-    }
-    while (i < n1) songs[k++] = L[i++];
-    while (j < n2) songs[k++] = R[j++];
-}
-
-void mergeSort(vector<Song> &songs, int l, int r, bool byTitle) {
-    // merge sort algorithm
-    if (l < r) {
-        int m = l + (r - l) / 2;
-        mergeSort(songs, l, m, byTitle);
-        mergeSort(songs, m + 1, r, byTitle);
-        merge(songs, l, m, r, byTitle);
-    }
-}
-
-int main() {
+int main(int argc, char** argv) {
     srand(static_cast<unsigned>(time(0)));
+    // --shared attaches to the catalog image other instances on this host published, or publishes one
+    bool shared = argc > 1 && std::string(argv[1]) == "--shared";
     //call load function and load songs into vector
-    std::vector<Song> songs = loadSongs("songdata.csv");
+    std::unique_ptr<Catalog> initialCatalog = shared ? loadCatalogShared("songdata.csv") : loadCatalog("songdata.csv");
 
     // sets up ImGui and GLFW
     if (!glfwInit()) return 1;
@@ -196,6 +49,9 @@ int main() {
     io.FontGlobalScale = 2.5f;
     ImGui_ImplGlfw_InitForOpenGL(window, true);
     ImGui_ImplOpenGL3_Init("#version 130");
+    initialCatalog->whenNeighborGraphReady([]() { glfwPostEmptyEvent(); }); // wakes the render loop to enable Neighbors
+    // queries and frames read whichever catalog is current; "Reload Catalog" publishes a new one without stopping either
+    CatalogStore catalogStore(std::move(initialCatalog));
 
     // creates variables used by GUI and logic
     static char searchBuf[128] = "";
@@ -203,122 +59,381 @@ int main() {
     static bool useEnergy = false, useDance = false, useAcoustic = false, prioritize = false;
     static int margin = 10;
     static int sortChoice = 0; // 0 = Artist, 1 = Title, 2 = Most Similar
+    static bool sortDescending = false; // the table shows the engine's ascending order back to front
+    static int recommendMode = 0; // 0 = Features, 1 = Lyrics, 2 = Embeddings, 3 = Neighbors (precomputed), 4 = Listeners Also Played
+    static int embeddingMetric = 0; // 0 = Dot, 1 = L2
+    static int hnswEf = 64; // HNSW search width, trades latency for recall
     static bool recommendClicked = false;
-    static std::vector<Song> recommendations;
+    static std::unique_ptr<QueryOutput> shown; // latest results from the query worker
     static Song seed;
+    static uint32_t shownLyricsId = std::numeric_limits<uint32_t>::max();
+    static uint64_t shownLyricsVersion = 0;
+    static std::string shownLink, shownLyrics; // cold columns for the seed, read on demand
+    static int sortAlgorithm = 0; // 0 = Quick Sort, 1 = Merge Sort
+    static std::vector<uint32_t> playlist; // seed ids for playlist queries
+    static int playlistMode = 0; // 0 = Union, 1 = Intersection, 2 = Centroid
+    static bool liveUpdates = true; // re-query on every control change instead of only on button presses
+    static bool queryActive = false; // a query has been started, so control changes have something to update
+    static QueryRequest::Kind queryKind = QueryRequest::Kind::Search;
+    static uint32_t pinnedSeed = std::numeric_limits<uint32_t>::max();
+    static QueryRequest lastPosted;
+    static uint64_t postedGeneration = 0;
+    static bool showFrameStats = false;
+    static bool showStageLatency = false;
+    static bool recordTrace = false;
+    static std::string traceStatus;
+    static float frameHistory[FRAME_HISTORY] = {};
+    static int frameHistoryAt = 0;
+    static double frameMs = 0.0, frameCpuMs = 0.0, waitMs = 0.0;
+    static uint64_t catalogVersion = 0; // the catalog the playlist and pinned seed ids refer to
+    static const CatalogSegment* catalogMain = nullptr; // ids stay valid across deltas over the same main segment
+    static std::atomic<bool> reloading{false};
+    static std::thread reloader;
+    auto queryWorker = std::make_unique<QueryWorker>(catalogStore);
+    queryWorker->onPublish = []() { glfwPostEmptyEvent(); };
+    // rows appended to resources/songdata.csv show up without a reload
+    auto catalogWatcher = std::make_unique<CatalogWatcher>(catalogStore, "songdata.csv", []() { glfwPostEmptyEvent(); }, shared);
+
+    nameTraceThread("render loop");
     // open GUI until closed
+    int activeFrames = ACTIVE_FRAMES;
     while (!glfwWindowShouldClose(window)) {
-        glfwPollEvents();
+        // draws a few frames after each wake-up, then sleeps until input, a finished query or the idle timeout
+        auto waitStart = std::chrono::steady_clock::now();
+        if (activeFrames > 0) {
+            glfwPollEvents();
+            activeFrames--;
+        } else {
+            glfwWaitEventsTimeout(IDLE_WAIT_SECONDS);
+            waitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - waitStart).count();
+            // a timeout only needs the one frame; an event gets the full burst
+            if (waitMs < IDLE_WAIT_SECONDS * 1e3) activeFrames = ACTIVE_FRAMES - 1;
+        }
+        auto frameStart = std::chrono::steady_clock::now();
+        TraceScope frameTrace("frame");
+        double cpuStart = threadCpuMs();
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
-        static int sortAlgorithm = 0; // 0 = Quick Sort, 1 = Merge Sort
-        static double sortTimeMs = 0.0;
+        // the catalog for this frame; shown results keep a reference to the one they were computed against
+        std::shared_ptr<const Catalog> catalog = catalogStore.acquire();
+        if (catalog->version != catalogVersion) {
+            // ids from a rebuilt catalog mean nothing in this one; a delta only drops the songs it replaced or deleted.
+            // Either way live updates should re-run against it
+            if (catalog->main.get() != catalogMain) {
+                playlist.clear();
+                pinnedSeed = std::numeric_limits<uint32_t>::max();
+            } else {
+                std::erase_if(playlist, [&](uint32_t id) { return catalog->tombstones[id]; });
+                if (pinnedSeed < catalog->songs.size() && catalog->tombstones[pinnedSeed]) pinnedSeed = std::numeric_limits<uint32_t>::max();
+            }
+            lastPosted = QueryRequest();
+            catalogVersion = catalog->version;
+            catalogMain = catalog->main.get();
+        }
+        const std::vector<Song>& songs = catalog->songs;
+        const EmbeddingTable& embeddings = catalog->main->embeddings;
+        const HNSWIndex& embeddingGraph = catalog->main->embeddingGraph;
+        const NeighborGraph& coPlayGraph = catalog->main->coPlayGraph;
+        bool neighborsReady = catalog->main->neighborGraphReady.load(std::memory_order_acquire);
+        // picks up whatever the query worker finished since the last frame
+        if (std::unique_ptr<QueryOutput> output = queryWorker->take()) {
+            shown = std::move(output);
+            seed = shown->seed;
+            recommendClicked = true;
+        }
 
         ImGui::Begin("Music Recommendations");
 
-        ImGui::InputText("Search", searchBuf, IM_ARRAYSIZE(searchBuf));
+        // editing the search releases a "More like this" seed
+        if (ImGui::InputText("Search", searchBuf, IM_ARRAYSIZE(searchBuf))) pinnedSeed = std::numeric_limits<uint32_t>::max();
         ImGui::RadioButton("Search by Title", &searchMode, 0); ImGui::SameLine();
         ImGui::RadioButton("Search by Artist", &searchMode, 1);
         // create checkboxes for variables
         ImGui::Checkbox("Use Energy", &useEnergy);
         ImGui::Checkbox("Use Danceability", &useDance);
         ImGui::Checkbox("Use Acousticness", &useAcoustic);
-        // margin of error slider
-        ImGui::SliderInt("Margin of Error", &margin, 0, 50);
+        // margin of error slider; a shown feature query follows it even without live updates
+        bool marginChanged = ImGui::SliderInt("Margin of Error", &margin, 0, 50);
         // prioritize search checkbox
         ImGui::Checkbox("Prioritize Search Term", &prioritize);
+        ImGui::Text("Recommend by:");
+        ImGui::RadioButton("Features", &recommendMode, 0); ImGui::SameLine();
+        ImGui::RadioButton("Lyrics", &recommendMode, 1);
+        // embedding mode needs resources/embeddings.tsv
+        if (embeddings.dim == 0) ImGui::BeginDisabled();
+        ImGui::SameLine();
+        ImGui::RadioButton("Embeddings", &recommendMode, 2);
+        if (recommendMode == 2) {
+            ImGui::RadioButton("Dot Product", &embeddingMetric, 0); ImGui::SameLine();
+            ImGui::RadioButton("Euclidean", &embeddingMetric, 1);
+            if (embeddingMetric == 1 && embeddingGraph.entry != HNSW_NONE) ImGui::SliderInt("Search Width (ef)", &hnswEf, 10, 500);
+        }
+        if (embeddings.dim == 0) ImGui::EndDisabled();
+        // neighbor mode is available once the background build finishes
+        if (!neighborsReady) ImGui::BeginDisabled();
+        ImGui::SameLine();
+        ImGui::RadioButton(neighborsReady ? "Neighbors" : "Neighbors (building...)", &recommendMode, 3);
+        if (!neighborsReady) ImGui::EndDisabled();
+        // co-play mode needs listening logs in resources/logs
+        if (coPlayGraph.neighbors.empty()) ImGui::BeginDisabled();
+        ImGui::SameLine();
+        ImGui::RadioButton("Listeners Also Played", &recommendMode, 4);
+        if (coPlayGraph.neighbors.empty()) ImGui::EndDisabled();
 
         ImGui::Separator();
-        ImGui::Text("Sort recommendations by:");
-        ImGui::RadioButton("Artist", &sortChoice, 0); ImGui::SameLine();
-        ImGui::RadioButton("Title", &sortChoice, 1); ImGui::SameLine();
-        ImGui::RadioButton("Most Similar", &sortChoice, 2);
-        // radio buttons for sorting algorithms
+        // the sort key comes from the results table headers, the algorithm from here
+        bool sortChanged = false;
         ImGui::Text("Sort algorithm:");
-        ImGui::RadioButton("Quick Sort", &sortAlgorithm, 0); ImGui::SameLine();
-        ImGui::RadioButton("Merge Sort", &sortAlgorithm, 1);
+        sortChanged |= ImGui::RadioButton("Quick Sort", &sortAlgorithm, 0); ImGui::SameLine();
+        sortChanged |= ImGui::RadioButton("Merge Sort", &sortAlgorithm, 1);
+        ImGui::Checkbox("Live Updates", &liveUpdates); ImGui::SameLine();
+        ImGui::Checkbox("Show Frame Stats", &showFrameStats); ImGui::SameLine();
+        ImGui::Checkbox("Show Stage Latency", &showStageLatency); ImGui::SameLine();
+        // a timeline of the frames, queries, loads and scheduler tasks, for chrome://tracing or ui.perfetto.dev
+        if (ImGui::Checkbox("Record Trace", &recordTrace)) {
+            if (recordTrace) {
+                startTrace();
+                traceStatus = "Recording trace...";
+            } else {
+                traceStatus = stopTrace(TRACE_FILE) ? std::string("Trace written to ") + TRACE_FILE : std::string("Could not write ") + TRACE_FILE;
+            }
+        }
+        ImGui::SameLine();
+        // reloads resources/songdata.csv in the background; the old catalog keeps serving until the new one is ready
+        bool reloadRunning = reloading.load();
+        if (reloadRunning) ImGui::BeginDisabled();
+        if (ImGui::Button(reloadRunning ? "Reloading..." : "Reload Catalog")) {
+            if (reloader.joinable()) reloader.join();
+            reloading.store(true);
+            reloader = std::thread([&catalogStore, watcher = catalogWatcher.get(), shared]() {
+                TaskPriorityScope background(TaskPriority::Background); // the UI's queries run first
+                std::unique_ptr<Catalog> next = loadCatalog("songdata.csv");
+                if (!next->songs.empty()) {
+                    if (shared) {
+                        next->waitForNeighborGraph();
+                        saveCatalogImage(*next, catalogImagePath("songdata.csv"));
+                    }
+                    next->whenNeighborGraphReady([]() { glfwPostEmptyEvent(); });
+                    std::lock_guard<std::mutex> lock(watcher->refreshMutex); // a delta must not land on the old catalog after this
+                    catalogStore.publish(std::move(next));
+                }
+                reloading.store(false);
+                glfwPostEmptyEvent();
+            });
+        }
+        if (reloadRunning) ImGui::EndDisabled();
+        if (!traceStatus.empty()) ImGui::TextUnformatted(traceStatus.c_str());
         bool searchNotEmpty = strlen(searchBuf) > 0;
         // disables search button if search bar is empty
         if (!searchNotEmpty) {
             ImGui::BeginDisabled();
         }
         // if get recommendations button is clicked
+        bool explicitQuery = false;
         if (ImGui::Button("Get Recommendations")) {
-            std::string search(searchBuf);
-            std::vector<Song> matches;
-            for (const auto& s : songs) {
-                if (searchMode == 0) {
-                    if (s.title.find(search) != std::string::npos) matches.push_back(s);
-                } else {
-                    if (s.artist.find(search) != std::string::npos) matches.push_back(s);
-                }
-            }
-            if (!matches.empty()) {
-                seed = matches[0];
-            } else if (!songs.empty()) {
-                seed = songs[rand() % songs.size()];
-            }
-            // calls recommendation function based on seed and user input
-            recommendations = recommendSongs(
-                songs, seed, margin,
-                useEnergy, useDance, useAcoustic,
-                prioritize, search
-            );
-
-            // times algorithms
-            auto start = std::chrono::high_resolution_clock::now();
-            if (sortAlgorithm == 0) { // Quick Sort
-                if (sortChoice == 0)
-                    quickSort(recommendations, 0, recommendations.size() - 1, false); // by artist
-                else if (sortChoice == 1)
-                    quickSort(recommendations, 0, recommendations.size() - 1, true);  // by title
-                else
-                    std::sort(recommendations.begin(), recommendations.end(), [&](const Song& a, const Song& b){
-                        return similarityScore(a, seed, useEnergy, useDance, useAcoustic)
-                            < similarityScore(b, seed, useEnergy, useDance, useAcoustic);
-                    });
-            } else { // Merge Sort
-                if (sortChoice == 0)
-                    mergeSort(recommendations, 0, recommendations.size() - 1, false); // by artist
-                else if (sortChoice == 1)
-                    mergeSort(recommendations, 0, recommendations.size() - 1, true);  // by title
-                else
-                    std::sort(recommendations.begin(), recommendations.end(), [&](const Song& a, const Song& b){
-                        return similarityScore(a, seed, useEnergy, useDance, useAcoustic)
-                            < similarityScore(b, seed, useEnergy, useDance, useAcoustic);
-                    });
-            }
-            auto end = std::chrono::high_resolution_clock::now();
-            sortTimeMs = std::chrono::duration<double, std::milli>(end - start).count();
-
-            recommendClicked = true;
+            queryKind = QueryRequest::Kind::Search;
+            pinnedSeed = std::numeric_limits<uint32_t>::max();
+            explicitQuery = true;
         }
         if (!searchNotEmpty) {
             ImGui::EndDisabled();
         }
+        // playlist queries use the feature checkboxes and margin for every seed at once
+        bool shownCurrent = recommendClicked && shown->catalog == catalog; // results and controls share ids
+        if (shownCurrent && seed.id < songs.size()) {
+            ImGui::SameLine();
+            if (ImGui::Button("Add Seed to Playlist") && std::find(playlist.begin(), playlist.end(), seed.id) == playlist.end()) playlist.push_back(seed.id);
+        }
+        if (!playlist.empty() && ImGui::CollapsingHeader("Playlist", ImGuiTreeNodeFlags_DefaultOpen)) {
+            int removeAt = -1;
+            for (int i = 0; i < (int)playlist.size(); i++) {
+                ImGui::PushID(i);
+                if (ImGui::SmallButton("Remove")) removeAt = i;
+                ImGui::PopID();
+                ImGui::SameLine();
+                ImGui::Text("%s - %s", songs[playlist[i]].artist.c_str(), songs[playlist[i]].title.c_str());
+            }
+            if (removeAt >= 0) playlist.erase(playlist.begin() + removeAt);
+            ImGui::RadioButton("Near Any", &playlistMode, 0); ImGui::SameLine();
+            ImGui::RadioButton("Near All", &playlistMode, 1); ImGui::SameLine();
+            ImGui::RadioButton("Near Average", &playlistMode, 2);
+            if (ImGui::Button("Recommend for Playlist") && !playlist.empty()) {
+                queryKind = QueryRequest::Kind::Playlist;
+                recommendMode = 0;
+                explicitQuery = true;
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Clear Playlist")) playlist.clear();
+        }
+        // a playlist query has nothing left to run on once the playlist empties
+        if (queryKind == QueryRequest::Kind::Playlist && playlist.empty()) {
+            queryKind = QueryRequest::Kind::Search;
+            queryActive = false;
+        }
         // ouput for clicking recommendations button
+        uint32_t pivotTo = std::numeric_limits<uint32_t>::max();
         if (recommendClicked) {
+            const Catalog& results = *shown->catalog;
+            const std::vector<uint32_t>& recommendations = shown->ids;
             ImGui::Separator();
-            ImGui::Text("Sort Time: %.3f ms", sortTimeMs);
+            if (shown->generation != postedGeneration) ImGui::Text("Updating...");
+            ImGui::Text("Query Time: %.3f ms", shown->latencyMs);
+            ImGui::Text("Sort Time: %.3f ms%s", shown->sortMs, shown->sortCached ? " (cached)" : "");
+            if (shown->pivotUs >= 0.0) ImGui::Text("Neighbor Lookup: %.2f us", shown->pivotUs);
             ImGui::Text("Total Recommendations: %d", (int)recommendations.size()); // <-- Add this line
             ImGui::Separator();
             ImGui::Text("Seed Song: %s - %s [E:%d D:%d A:%d]", seed.artist.c_str(), seed.title.c_str(), seed.energy, seed.danceability, seed.acousticness);
-            ImGui::Text("Top 10 Recommendations:");
-            int show = std::min(10, (int)recommendations.size());
-            for (int i = 0; i < show; i++) {
-                ImGui::BulletText("%s - %s [E:%d D:%d A:%d]",
-                    recommendations[i].artist.c_str(),
-                    recommendations[i].title.c_str(),
-                    recommendations[i].energy,
-                    recommendations[i].danceability,
-                    recommendations[i].acousticness
-                );
+            auto dupes = results.main->duplicates.find(seed.id);
+            if (dupes != results.main->duplicates.end()) {
+                ImGui::Text("Also listed as:");
+                for (const Song& d : dupes->second) ImGui::BulletText("%s - %s", d.artist.c_str(), d.title.c_str());
+            }
+            if (ImGui::CollapsingHeader("Seed Lyrics")) {
+                if (shownLyricsId != seed.id || shownLyricsVersion != results.version) {
+                    shownLink = results.cold.read(seed.link);
+                    shownLyrics = results.cold.read(seed.lyrics);
+                    shownLyricsId = seed.id;
+                    shownLyricsVersion = results.version;
+                }
+                ImGui::Text("Link: %s", shownLink.c_str());
+                ImGui::TextWrapped("%s", shownLyrics.c_str());
+            }
+            // every result in a scrollable table; the clipper formats only the rows in view, so cost per frame
+            // does not grow with the result count
+            ImGuiTableFlags flags = ImGuiTableFlags_Sortable | ImGuiTableFlags_ScrollY | ImGuiTableFlags_RowBg | ImGuiTableFlags_Borders | ImGuiTableFlags_Resizable;
+            if (ImGui::BeginTable("Recommendations", 7, flags, ImVec2(0.0f, ImGui::GetTextLineHeightWithSpacing() * 16))) {
+                ImGui::TableSetupScrollFreeze(0, 1);
+                ImGui::TableSetupColumn("Artist", ImGuiTableColumnFlags_DefaultSort | ImGuiTableColumnFlags_WidthStretch, 0.0f, 0);
+                ImGui::TableSetupColumn("Title", ImGuiTableColumnFlags_WidthStretch, 0.0f, 1);
+                ImGui::TableSetupColumn("E", ImGuiTableColumnFlags_NoSort | ImGuiTableColumnFlags_WidthFixed);
+                ImGui::TableSetupColumn("D", ImGuiTableColumnFlags_NoSort | ImGuiTableColumnFlags_WidthFixed);
+                ImGui::TableSetupColumn("A", ImGuiTableColumnFlags_NoSort | ImGuiTableColumnFlags_WidthFixed);
+                ImGui::TableSetupColumn("Similarity", ImGuiTableColumnFlags_WidthFixed, 0.0f, 2);
+                ImGui::TableSetupColumn("", ImGuiTableColumnFlags_NoSort | ImGuiTableColumnFlags_WidthFixed);
+                ImGui::TableHeadersRow();
+                // header clicks pick the engine sort; the column user id is the sortChoice it maps to
+                if (ImGuiTableSortSpecs* specs = ImGui::TableGetSortSpecs()) {
+                    if (specs->SpecsDirty && specs->SpecsCount > 0) {
+                        int choice = static_cast<int>(specs->Specs[0].ColumnUserID);
+                        sortDescending = specs->Specs[0].SortDirection == ImGuiSortDirection_Descending;
+                        if (choice != sortChoice) {
+                            sortChoice = choice;
+                            sortChanged = true;
+                        }
+                        specs->SpecsDirty = false;
+                    }
+                }
+                bool featureScores = shown->recommendMode == 0;
+                const QueryRequest& shownRequest = shown->request;
+                int rows = static_cast<int>(recommendations.size());
+                ImGuiListClipper clipper;
+                clipper.Begin(rows);
+                while (clipper.Step()) {
+                    for (int row = clipper.DisplayStart; row < clipper.DisplayEnd; row++) {
+                        const Song& r = results.songs[recommendations[sortDescending ? rows - 1 - row : row]];
+                        ImGui::TableNextRow();
+                        ImGui::TableNextColumn();
+                        ImGui::TextUnformatted(r.artist.c_str());
+                        ImGui::TableNextColumn();
+                        ImGui::TextUnformatted(r.title.c_str());
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%d", r.energy);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%d", r.danceability);
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%d", r.acousticness);
+                        ImGui::TableNextColumn();
+                        // feature results show their distance to the seed over the features their query used, not the
+                        // current checkboxes; model-ranked modes arrive already ordered
+                        if (featureScores) ImGui::Text("%.0f", similarityScore(r, seed, shownRequest.useEnergy, shownRequest.useDance, shownRequest.useAcoustic));
+                        else ImGui::TextDisabled("-");
+                        ImGui::TableNextColumn();
+                        // pivot to this song's precomputed neighbors
+                        if (neighborsReady && shownCurrent) {
+                            ImGui::PushID(row);
+                            if (ImGui::SmallButton("More like this")) pivotTo = r.id;
+                            ImGui::PopID();
+                        }
+                    }
+                }
+                clipper.End();
+                ImGui::EndTable();
             }
         }
+        if (pivotTo != std::numeric_limits<uint32_t>::max()) {
+            // "More like this" pins the seed and switches to its neighbors
+            queryKind = QueryRequest::Kind::Search;
+            pinnedSeed = pivotTo;
+            recommendMode = 3;
+            explicitQuery = true;
+        }
+
+        // hands the current controls to the query worker: always on an explicit action, on any change with live
+        // updates, and otherwise only for margin and sort changes to the shown results
+        QueryRequest request;
+        request.kind = queryKind;
+        request.search = searchBuf;
+        request.searchMode = searchMode;
+        request.pinnedSeed = pinnedSeed;
+        request.useEnergy = useEnergy;
+        request.useDance = useDance;
+        request.useAcoustic = useAcoustic;
+        request.prioritize = prioritize;
+        request.margin = margin;
+        request.recommendMode = recommendMode;
+        request.embeddingMetric = embeddingMetric;
+        request.hnswEf = hnswEf;
+        request.sortChoice = sortChoice;
+        request.sortAlgorithm = sortAlgorithm;
+        if (queryKind == QueryRequest::Kind::Playlist) {
+            request.playlist = playlist;
+            request.playlistMode = playlistMode;
+        }
+        bool runnable = queryKind == QueryRequest::Kind::Playlist || pinnedSeed != std::numeric_limits<uint32_t>::max() || searchNotEmpty;
+        if (explicitQuery || (liveUpdates && searchNotEmpty)) queryActive = true;
+        bool changed = liveUpdates ? !(request == lastPosted) : (marginChanged || sortChanged);
+        if (runnable && (explicitQuery || (queryActive && changed))) {
+            lastPosted = request;
+            request.reseed = explicitQuery;
+            postedGeneration = queryWorker->post(std::move(request));
+        }
 
         ImGui::End();
-        // renders gui continuously until while loop finishes
+        if (showFrameStats) {
+            ImGui::SetNextWindowPos(ImVec2(10.0f, 10.0f), ImGuiCond_FirstUseEver);
+            ImGui::SetNextWindowBgAlpha(0.6f);
+            ImGui::Begin("Frame Stats", &showFrameStats, ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoSavedSettings | ImGuiWindowFlags_NoFocusOnAppearing | ImGuiWindowFlags_NoNav);
+            ImGui::Text("Frame: %.2f ms (CPU %.2f ms)", frameMs, frameCpuMs);
+            ImGui::Text("Last Idle Wait: %.0f ms", waitMs);
+            if (shown) ImGui::Text("Query Latency: %.2f ms", shown->latencyMs);
+            ImGui::PlotLines("##frames", frameHistory, FRAME_HISTORY, frameHistoryAt, "frame ms", 0.0f, FLT_MAX, ImVec2(0.0f, ImGui::GetTextLineHeightWithSpacing() * 3));
+            ImGui::End();
+        }
+        if (showStageLatency) {
+            // where interactive latency goes, stage by stage, since startup or the last reset
+            ImGui::Begin("Stage Latency", &showStageLatency, ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoFocusOnAppearing | ImGuiWindowFlags_NoNav);
+            if (ImGui::BeginTable("Stages", 6, ImGuiTableFlags_RowBg | ImGuiTableFlags_Borders)) {
+                for (const char* label : {"Stage", "Count", "p50 us", "p95 us", "p99 us", "Max us"}) ImGui::TableSetupColumn(label);
+                ImGui::TableHeadersRow();
+                for (size_t i = 0; i < STAGE_COUNT; i++) {
+                    StageSummary stage = summarizeStage(static_cast<Stage>(i));
+                    ImGui::TableNextRow();
+                    ImGui::TableNextColumn();
+                    ImGui::TextUnformatted(STAGE_NAMES[i]);
+                    ImGui::TableNextColumn();
+                    ImGui::Text("%llu", static_cast<unsigned long long>(stage.count));
+                    for (double us : {stage.p50, stage.p95, stage.p99, stage.max}) {
+                        ImGui::TableNextColumn();
+                        ImGui::Text("%.1f", us);
+                    }
+                }
+                ImGui::EndTable();
+            }
+            if (ImGui::Button("Reset")) resetStageHistograms();
+            ImGui::End();
+        }
+        // renders the frame
         ImGui::Render();
         int display_w, display_h;
         glfwGetFramebufferSize(window, &display_w, &display_h);
@@ -327,8 +442,20 @@ int main() {
         glClear(GL_COLOR_BUFFER_BIT);
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
         glfwSwapBuffers(window);
+        frameMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count();
+        stageHistogram(Stage::Render).record(static_cast<uint64_t>(frameMs * 1e6));
+        frameCpuMs = threadCpuMs() - cpuStart;
+        frameHistory[frameHistoryAt] = static_cast<float>(frameMs);
+        frameHistoryAt = (frameHistoryAt + 1) % FRAME_HISTORY;
     }
-    // winds down the GUI
+    if (recordTrace) stopTrace(TRACE_FILE);
+    // winds down the GUI; every thread that posts GLFW events is stopped first, since none may call into GLFW once it
+    // terminates
+    if (reloader.joinable()) reloader.join();
+    queryWorker.reset();
+    catalogWatcher.reset();
+    catalogStore.acquire()->waitForNeighborGraph();
+    if (shown) shown->catalog->waitForNeighborGraph();
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
@@ -0,0 +1,3692 @@
+#include "recommender.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MUSIC_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+using namespace std;
+
+thread_local TaskPriority taskPriority = TaskPriority::Interactive;
+thread_local size_t taskWorker = std::numeric_limits<size_t>::max(); // index of the scheduler worker running this thread
+
+TaskScheduler& TaskScheduler::instance() {
+    // never destroyed: catalogs in static storage may still wait on their builds while the process exits
+    static TaskScheduler* scheduler = new TaskScheduler(std::max(1u, std::thread::hardware_concurrency()));
+    return *scheduler;
+}
+
+TaskScheduler::TaskScheduler(size_t hardwareThreads) : hardwareThreads(hardwareThreads) {
+    // a worker per hardware thread besides the caller's, and at least one, so background tasks progress even on a
+    // single core while every other thread is busy
+    size_t workerCount = std::max<size_t>(1, hardwareThreads - 1);
+    for (size_t i = 0; i < workerCount; i++) workers.push_back(std::make_unique<Worker>());
+    for (size_t i = 0; i < workerCount; i++) threads.emplace_back([this, i]() { work(i); });
+    for (auto& thread : threads) thread.detach();
+}
+
+void TaskScheduler::submit(Task task, TaskPriority priority) {
+    // a worker keeps its own tasks, where it will pop them newest first; other threads spread theirs round robin
+    size_t target = taskWorker < workers.size() ? taskWorker : nextWorker.fetch_add(1) % workers.size();
+    {
+        std::lock_guard<std::mutex> lock(workers[target]->mutex);
+        workers[target]->tasks[static_cast<size_t>(priority)].push_back(std::move(task));
+    }
+    queued.fetch_add(1);
+    { std::lock_guard<std::mutex> lock(sleepMutex); } // a worker between checking queued and sleeping sees the task
+    wake.notify_one();
+}
+
+bool TaskScheduler::runOne(TaskPriority lowest) {
+    Task task;
+    size_t ran = 0;
+    for (size_t p = 0; p <= static_cast<size_t>(lowest) && !task; p++) {
+        // the own deque from the back, then the others' from the front
+        size_t own = taskWorker < workers.size() ? taskWorker : 0;
+        for (size_t k = 0; k < workers.size() && !task; k++) {
+            Worker& worker = *workers[(own + k) % workers.size()];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            std::deque<Task>& tasks = worker.tasks[p];
+            if (tasks.empty()) continue;
+            bool mine = k == 0 && own == taskWorker;
+            task = std::move(mine ? tasks.back() : tasks.front());
+            if (mine) tasks.pop_back();
+            else tasks.pop_front();
+            ran = p;
+        }
+    }
+    if (!task) return false;
+    queued.fetch_sub(1);
+    TaskPriorityScope scope(static_cast<TaskPriority>(ran));
+    TraceScope trace(ran == 0 ? "task" : "background task");
+    task();
+    return true;
+}
+
+void TaskScheduler::work(size_t index) {
+    taskWorker = index;
+    nameTraceThread("scheduler worker " + std::to_string(index));
+    while (true) {
+        if (runOne(TaskPriority::Background)) continue;
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wake.wait(lock, [this]() { return queued.load() > 0; });
+    }
+}
+
+TaskPriority currentTaskPriority() {
+    return taskPriority;
+}
+
+TaskPriorityScope::TaskPriorityScope(TaskPriority priority) : previous(taskPriority) {
+    taskPriority = priority;
+}
+
+TaskPriorityScope::~TaskPriorityScope() {
+    taskPriority = previous;
+}
+
+void TaskGroup::run(std::function<void()> task) {
+    pending.fetch_add(1);
+    TaskScheduler::instance().submit([this, task = std::move(task)]() {
+        task();
+        // decremented under the mutex, so wait() cannot return and destroy the group while this still touches it
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pending.fetch_sub(1) == 1) done.notify_all();
+    }, priority);
+}
+
+void TaskGroup::wait() {
+    // helps with queued tasks at least as urgent as the group's; a query waiting on its chunks never picks up a long
+    // background task
+    TaskScheduler& scheduler = TaskScheduler::instance();
+    while (pending.load() > 0) {
+        if (scheduler.runOne(priority)) continue;
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait_for(lock, std::chrono::milliseconds(1), [this]() { return pending.load() == 0; });
+    }
+    std::lock_guard<std::mutex> lock(mutex); // the last task has left its critical section
+}
+
+size_t stageBucket(uint64_t ns) {
+    // exact below 2^STAGE_SUB_BUCKET_BITS, then the top STAGE_SUB_BUCKET_BITS bits of the value
+    constexpr uint64_t linear = uint64_t(1) << STAGE_SUB_BUCKET_BITS;
+    ns = min(ns, (uint64_t(1) << STAGE_MAX_BITS) - 1);
+    if (ns < linear) return ns;
+    int shift = bit_width(ns) - STAGE_SUB_BUCKET_BITS;
+    return (size_t(shift) << (STAGE_SUB_BUCKET_BITS - 1)) + (ns >> shift);
+}
+
+uint64_t stageBucketHighNs(size_t bucket) {
+    // the largest value the bucket holds
+    constexpr size_t linear = size_t(1) << STAGE_SUB_BUCKET_BITS;
+    if (bucket < linear) return bucket;
+    int shift = static_cast<int>(bucket >> (STAGE_SUB_BUCKET_BITS - 1)) - 1;
+    uint64_t low = uint64_t(bucket - (size_t(shift) << (STAGE_SUB_BUCKET_BITS - 1))) << shift;
+    return low + (uint64_t(1) << shift) - 1;
+}
+
+void StageHistogram::record(uint64_t ns) {
+    counts[stageBucket(ns)].fetch_add(1, memory_order_relaxed);
+    sumNs.fetch_add(ns, memory_order_relaxed);
+    uint64_t seen = maxNs.load(memory_order_relaxed);
+    while (ns > seen && !maxNs.compare_exchange_weak(seen, ns, memory_order_relaxed)) {}
+}
+
+void StageHistogram::reset() {
+    for (atomic<uint64_t>& count : counts) count.store(0, memory_order_relaxed);
+    sumNs.store(0, memory_order_relaxed);
+    maxNs.store(0, memory_order_relaxed);
+}
+
+array<StageHistogram, STAGE_COUNT> stageHistograms;
+
+StageHistogram& stageHistogram(Stage stage) {
+    return stageHistograms[static_cast<size_t>(stage)];
+}
+
+StageSummary summarizeStage(Stage stage) {
+    // percentiles from a copy of the counts, so a recording that lands midway cannot skew the ranks; each is the top
+    // of its bucket, capped at the largest value recorded
+    const StageHistogram& h = stageHistogram(stage);
+    vector<uint64_t> counts(STAGE_BUCKETS);
+    StageSummary summary;
+    for (size_t b = 0; b < STAGE_BUCKETS; b++) summary.count += counts[b] = h.counts[b].load(memory_order_relaxed);
+    if (summary.count == 0) return summary;
+    summary.max = h.maxNs.load(memory_order_relaxed) / 1e3;
+    summary.mean = h.sumNs.load(memory_order_relaxed) / 1e3 / summary.count;
+    auto percentile = [&](double p) {
+        uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(ceil(p * summary.count))), seen = 0;
+        for (size_t b = 0; b < STAGE_BUCKETS; b++) {
+            seen += counts[b];
+            if (seen >= rank) return min(stageBucketHighNs(b) / 1e3, summary.max);
+        }
+        return summary.max;
+    };
+    summary.p50 = percentile(0.50);
+    summary.p95 = percentile(0.95);
+    summary.p99 = percentile(0.99);
+    return summary;
+}
+
+string stageReport() {
+    ostringstream out;
+    out << fixed;
+    out.precision(1);
+    for (size_t i = 0; i < STAGE_COUNT; i++) {
+        StageSummary s = summarizeStage(static_cast<Stage>(i));
+        out << "stage=" << STAGE_NAMES[i] << " count=" << s.count << " p50_us=" << s.p50 << " p95_us=" << s.p95
+            << " p99_us=" << s.p99 << " max_us=" << s.max << " mean_us=" << s.mean << "\n";
+    }
+    return out.str();
+}
+
+void resetStageHistograms() {
+    for (StageHistogram& h : stageHistograms) h.reset();
+}
+
+StageTimer::~StageTimer() {
+    auto end = chrono::steady_clock::now();
+    stageHistogram(stage).record(chrono::duration_cast<chrono::nanoseconds>(end - start).count());
+    if (traceEnabled.load(memory_order_relaxed)) traceComplete(STAGE_NAMES[static_cast<size_t>(stage)], start, end);
+}
+
+atomic<bool> traceEnabled{false};
+
+struct TraceEvent {
+    // fields are atomics so stopTrace() may read a slot while its thread overwrites it; it discards such slots
+    atomic<const char*> name{nullptr};
+    atomic<int64_t> startNs{0};
+    atomic<int64_t> durationNs{0};
+};
+
+struct TraceBuffer {
+    array<TraceEvent, TRACE_RING_EVENTS> events;
+    atomic<uint64_t> written{0};
+    size_t tid = 0;
+    string name; // guarded by traceMutex
+};
+
+mutex traceMutex;
+vector<shared_ptr<TraceBuffer>> traceBuffers; // kept after their threads exit, so short-lived threads still show
+atomic<int64_t> traceStartNs{0};
+thread_local shared_ptr<TraceBuffer> traceBuffer;
+thread_local string traceThreadName;
+
+int64_t steadyNs(chrono::steady_clock::time_point t) {
+    return chrono::duration_cast<chrono::nanoseconds>(t.time_since_epoch()).count();
+}
+
+void startTrace() {
+    // events recorded before this are left in the rings but not written
+    traceStartNs.store(steadyNs(chrono::steady_clock::now()));
+    traceEnabled.store(true);
+}
+
+void nameTraceThread(string name) {
+    traceThreadName = std::move(name);
+    lock_guard<mutex> lock(traceMutex);
+    if (traceBuffer) traceBuffer->name = traceThreadName;
+}
+
+void traceComplete(const char* name, chrono::steady_clock::time_point start, chrono::steady_clock::time_point end) {
+    if (!traceBuffer) {
+        // a thread's first event allocates its ring
+        auto buffer = make_shared<TraceBuffer>();
+        lock_guard<mutex> lock(traceMutex);
+        buffer->tid = traceBuffers.size();
+        buffer->name = traceThreadName.empty() ? "thread " + to_string(buffer->tid) : traceThreadName;
+        traceBuffers.push_back(buffer);
+        traceBuffer = std::move(buffer);
+    }
+    TraceBuffer& buffer = *traceBuffer;
+    uint64_t at = buffer.written.load(memory_order_relaxed);
+    TraceEvent& event = buffer.events[at % TRACE_RING_EVENTS];
+    // pairs with the fence in stopTrace(): a reader that sees any of these stores also sees the count up to at
+    atomic_thread_fence(memory_order_release);
+    event.name.store(name, memory_order_relaxed);
+    event.startNs.store(steadyNs(start), memory_order_relaxed);
+    event.durationNs.store(chrono::duration_cast<chrono::nanoseconds>(end - start).count(), memory_order_relaxed);
+    buffer.written.store(at + 1, memory_order_release);
+}
+
+string jsonString(string_view s) {
+    // s as a quoted JSON string: quotes, backslashes and control characters escaped, other bytes passed through
+    string out = "\"";
+    for (char c : s) {
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char code[8];
+                snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned char>(c));
+                out += code;
+            } else {
+                out += c;
+            }
+        }
+    }
+    return out + "\"";
+}
+
+bool stopTrace(const filesystem::path& path) {
+    traceEnabled.store(false);
+    int64_t sessionStart = traceStartNs.load();
+    vector<shared_ptr<TraceBuffer>> buffers;
+    vector<string> names;
+    {
+        lock_guard<mutex> lock(traceMutex);
+        buffers = traceBuffers;
+        for (const auto& buffer : buffers) names.push_back(buffer->name);
+    }
+    ofstream out(path);
+    out << fixed;
+    out.precision(3);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    auto separator = [&]() -> ofstream& {
+        if (!first) out << ",";
+        first = false;
+        out << "\n";
+        return out;
+    };
+    for (size_t b = 0; b < buffers.size(); b++) {
+        TraceBuffer& buffer = *buffers[b];
+        separator() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer.tid << ",\"args\":{\"name\":" << jsonString(names[b]) << "}}";
+        uint64_t end = buffer.written.load(memory_order_acquire);
+        uint64_t begin = end > TRACE_RING_EVENTS ? end - TRACE_RING_EVENTS : 0;
+        struct Copy { const char* name; int64_t startNs, durationNs; };
+        vector<Copy> copies;
+        copies.reserve(end - begin);
+        for (uint64_t i = begin; i < end; i++) {
+            const TraceEvent& event = buffer.events[i % TRACE_RING_EVENTS];
+            copies.push_back({event.name.load(memory_order_relaxed), event.startNs.load(memory_order_relaxed), event.durationNs.load(memory_order_relaxed)});
+        }
+        // the writer fills slot written % TRACE_RING_EVENTS before counting it, so a slot is intact only while its
+        // index is more than a ring behind the count read now
+        atomic_thread_fence(memory_order_acquire);
+        uint64_t after = buffer.written.load(memory_order_relaxed);
+        for (uint64_t i = begin; i < end; i++) {
+            const Copy& copy = copies[i - begin];
+            if (i + TRACE_RING_EVENTS <= after || copy.startNs < sessionStart) continue;
+            separator() << "{\"name\":" << jsonString(copy.name) << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer.tid
+                        << ",\"ts\":" << (copy.startNs - sessionStart) / 1e3 << ",\"dur\":" << copy.durationNs / 1e3 << "}";
+        }
+    }
+    out << "\n]}\n";
+    return static_cast<bool>(out);
+}
+
+string_view normalizeInto(string_view s, char* out) {
+    // normalize() into out, which holds at least s.size() + 3 chars; returns the normalized text inside it
+    char* filtered = out + 3;
+    size_t n = 0;
+    for (char c: s) {
+        if (isalnum(static_cast<unsigned char>(c)) || c == ' ') {
+            filtered[n++] = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+        }
+    }
+    string_view text(filtered, n);
+    size_t firstAlpha = text.find_first_of("abcdefghijklmnopqrstuvwxyz");
+    if (firstAlpha != string_view::npos) return text.substr(firstAlpha);
+    memcpy(out, "zzz", 3);
+    return string_view(out, n + 3);
+}
+
+string normalize(const string &s) {
+    // function used for sorting algorithm components
+    string buffer(s.size() + 3, '\0');
+    return string(normalizeInto(s, buffer.data()));
+}
+
+string_view sortKey(string_view s, pmr::memory_resource* arena) {
+    // normalize() into the query arena
+    return normalizeInto(s, static_cast<char*>(arena->allocate(s.size() + 3, 1)));
+}
+
+thread_local QueryArena threadArena;
+
+void* QueryArena::Upstream::do_allocate(size_t bytes, size_t alignment) {
+    spilled += bytes;
+    return pmr::new_delete_resource()->allocate(bytes, alignment);
+}
+
+void QueryArena::Upstream::do_deallocate(void* p, size_t bytes, size_t alignment) {
+    pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+}
+
+pmr::memory_resource* QueryArena::memory() {
+    if (!resource) {
+        capacity = QUERY_ARENA_BYTES;
+        buffer = make_unique_for_overwrite<byte[]>(capacity);
+        resource.emplace(buffer.get(), capacity, &upstream);
+    }
+    return &*resource;
+}
+
+void QueryArena::release() {
+    // rewinds to the start of the buffer; a query that spilled past it grows the buffer so the next one fits
+    if (!resource) return;
+    if (upstream.spilled == 0) {
+        resource->release();
+        return;
+    }
+    size_t wanted = min(capacity + upstream.spilled, QUERY_ARENA_MAX_BYTES);
+    resource.reset();
+    upstream.spilled = 0;
+    if (wanted > capacity) {
+        capacity = wanted;
+        buffer = make_unique_for_overwrite<byte[]>(capacity);
+    }
+    resource.emplace(buffer.get(), capacity, &upstream);
+}
+
+pmr::memory_resource* queryMemory() {
+    return threadArena.memory();
+}
+
+QueryArenaScope::QueryArenaScope() {
+    threadArena.depth++;
+}
+
+QueryArenaScope::~QueryArenaScope() {
+    if (--threadArena.depth == 0) threadArena.release();
+}
+
+bool MappedFile::open(const std::filesystem::path& path) {
+    close();
+#ifdef _WIN32
+    fileHandle = CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (fileHandle == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(fileHandle, &fileSize)) return false;
+    size = static_cast<size_t>(fileSize.QuadPart);
+    if (size == 0) return true;
+    mappingHandle = CreateFileMappingW(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mappingHandle) return false;
+    data = static_cast<const char*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+    return data != nullptr;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    size = static_cast<size_t>(st.st_size);
+    if (size == 0) {
+        ::close(fd);
+        return true;
+    }
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        size = 0;
+        return false;
+    }
+    data = static_cast<const char*>(mapped);
+    return true;
+#endif
+}
+
+void MappedFile::close() {
+#ifdef _WIN32
+    if (data) UnmapViewOfFile(data);
+    if (mappingHandle) CloseHandle(mappingHandle);
+    if (fileHandle != INVALID_HANDLE_VALUE) CloseHandle(fileHandle);
+    mappingHandle = nullptr;
+    fileHandle = INVALID_HANDLE_VALUE;
+#else
+    if (data) munmap(const_cast<char*>(data), size);
+#endif
+    data = nullptr;
+    size = 0;
+}
+
+void MappedFile::adviseSequential() const {
+    // hint that the next pass reads the whole file front to back
+#ifndef _WIN32
+    if (data) madvise(const_cast<char*>(data), size, MADV_SEQUENTIAL);
+#endif
+}
+
+void MappedFile::evict() {
+    // drops resident pages after a full pass so memory goes back to tracking only what is displayed
+#ifdef _WIN32
+    if (data) {
+        UnmapViewOfFile(data);
+        data = static_cast<const char*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+    }
+#else
+    if (data) {
+        madvise(const_cast<char*>(data), size, MADV_DONTNEED);
+        madvise(const_cast<char*>(data), size, MADV_RANDOM);
+    }
+#endif
+}
+
+struct CsvField {
+    // byte range of one field within the record, excluding any surrounding quotes
+    size_t begin = 0;
+    size_t end = 0;
+    bool escaped = false;
+};
+
+bool readCsvRecord(std::string_view data, size_t& pos, std::vector<CsvField>& fields) {
+    // reads one RFC 4180 record starting at pos; quoted fields may contain commas, newlines and "" escapes
+    fields.clear();
+    if (pos >= data.size()) return false;
+    while (true) {
+        CsvField field;
+        if (pos < data.size() && data[pos] == '"') {
+            field.begin = ++pos;
+            while (pos < data.size()) {
+                if (data[pos] == '"') {
+                    if (pos + 1 < data.size() && data[pos + 1] == '"') {
+                        field.escaped = true;
+                        pos += 2;
+                        continue;
+                    }
+                    break;
+                }
+                pos++;
+            }
+            field.end = pos;
+            // skip the closing quote and anything stray before the delimiter
+            while (pos < data.size() && data[pos] != ',' && data[pos] != '\n') pos++;
+        } else {
+            field.begin = pos;
+            while (pos < data.size() && data[pos] != ',' && data[pos] != '\n') pos++;
+            field.end = pos;
+            if (field.end > field.begin && data[field.end - 1] == '\r') field.end--;
+        }
+        fields.push_back(field);
+        if (pos >= data.size()) return true;
+        if (data[pos++] == '\n') return true;
+    }
+}
+
+std::string csvFieldText(std::string_view data, const CsvField& field) {
+    // copies a field out of the record with "" escapes collapsed
+    std::string out(data.substr(field.begin, field.end - field.begin));
+    if (field.escaped) {
+        size_t w = 0;
+        for (size_t r = 0; r < out.size(); r++, w++) {
+            out[w] = out[r];
+            if (out[r] == '"' && r + 1 < out.size() && out[r + 1] == '"') r++;
+        }
+        out.resize(w);
+    }
+    return out;
+}
+
+std::filesystem::path resourcePath(const std::string& filename) {
+    // walks up from the working directory to the first folder containing resources/
+    std::filesystem::path current = std::filesystem::current_path();
+    while (!std::filesystem::exists(current / "resources") && current.has_parent_path()) {
+        current = current.parent_path();
+    }
+    return current / "resources" / filename;
+}
+
+struct CsvLayout {
+    // which columns hold what; songdata.csv columns are artist,song,link,text
+    size_t artistCol = 0, titleCol = 1, linkCol = 2, textCol = 3;
+    size_t firstRecord = 0; // byte offset of the first data record
+};
+
+CsvLayout readCsvLayout(std::string_view data) {
+    // uses the header when present to locate the columns
+    CsvLayout layout;
+    size_t pos = 0;
+    std::vector<CsvField> fields;
+    if (readCsvRecord(data, pos, fields) && normalize(csvFieldText(data, fields[0])) == "artist") {
+        for (size_t i = 0; i < fields.size(); i++) {
+            std::string name = normalize(csvFieldText(data, fields[i]));
+            if (name == "artist") layout.artistCol = i;
+            else if (name == "song" || name == "title") layout.titleCol = i;
+            else if (name == "link") layout.linkCol = i;
+            else if (name == "text" || name == "lyrics") layout.textCol = i;
+        }
+        layout.firstRecord = pos;
+    }
+    return layout;
+}
+
+bool songFromRecord(std::string_view data, const std::vector<CsvField>& fields, const CsvLayout& layout, Song& s, CatalogRow& kind) {
+    // fills artist, title and the cold refs, and tells an update or delete row from a plain one; false for rows
+    // without both an artist and a title
+    if (fields.size() <= std::max(layout.artistCol, layout.titleCol)) return false;
+    // Trim whitespace and remove quotes
+    auto trim = [](std::string& text) {
+        text.erase(0, text.find_first_not_of(" \t\r\n\""));
+        text.erase(text.find_last_not_of(" \t\r\n\"") + 1);
+    };
+    auto coldRef = [](const CsvField& field) {
+        ColdRef ref;
+        ref.offset = field.begin;
+        ref.length = static_cast<uint32_t>(field.end - field.begin);
+        ref.escaped = field.escaped;
+        return ref;
+    };
+    s.artist = csvFieldText(data, fields[layout.artistCol]);
+    s.title = csvFieldText(data, fields[layout.titleCol]);
+    trim(s.artist);
+    trim(s.title);
+    if (s.artist.empty() || s.title.empty()) return false;
+    s.link = layout.linkCol < fields.size() ? coldRef(fields[layout.linkCol]) : ColdRef();
+    s.lyrics = layout.textCol < fields.size() ? coldRef(fields[layout.textCol]) : ColdRef();
+    kind = CatalogRow::Add;
+    if (layout.textCol >= fields.size()) return true;
+    const CsvField& text = fields[layout.textCol];
+    if (text.end - text.begin <= CATALOG_DELETE_MARKER.size() + 4) {
+        std::string value = csvFieldText(data, text);
+        trim(value);
+        if (value == CATALOG_DELETE_MARKER) kind = CatalogRow::Delete;
+    }
+    std::string_view raw = data.substr(text.begin, text.end - text.begin);
+    size_t start = raw.find_first_not_of(" \t\r\n");
+    if (start != std::string_view::npos && raw.substr(start, CATALOG_UPDATE_MARKER.size()) == CATALOG_UPDATE_MARKER) {
+        // the lyrics are what follows the marker
+        size_t lyrics = raw.find_first_not_of(" \t\r\n", start + CATALOG_UPDATE_MARKER.size());
+        if (lyrics == std::string_view::npos) lyrics = raw.size();
+        s.lyrics.offset += lyrics;
+        s.lyrics.length -= static_cast<uint32_t>(lyrics);
+        kind = CatalogRow::Update;
+    }
+    return true;
+}
+
+std::vector<size_t> csvSliceBounds(std::string_view data, size_t begin, size_t parts) {
+    // parts + 1 record boundaries near equal slices of [begin, end of data). A newline ends a record when an even
+    // number of quotes precedes it, which holds for well-formed CSV since "" escapes come in pairs
+    std::vector<size_t> cut(parts + 1);
+    for (size_t i = 0; i <= parts; i++) cut[i] = begin + (data.size() - begin) * i / parts;
+    std::vector<uint8_t> oddQuotes(parts);
+    parallelFor(parts, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; i++) oddQuotes[i] = std::count(data.begin() + cut[i], data.begin() + cut[i + 1], '"') & 1;
+    }, 1);
+    std::vector<size_t> bounds(parts + 1, data.size());
+    bounds[0] = begin;
+    bool quoted = false;
+    for (size_t i = 1; i < parts; i++) {
+        quoted ^= oddQuotes[i - 1];
+        size_t pos = cut[i];
+        for (bool inQuotes = quoted; pos < data.size() && (data[pos] != '\n' || inQuotes); pos++) {
+            if (data[pos] == '"') inQuotes = !inQuotes;
+        }
+        bounds[i] = std::max(bounds[i - 1], std::min(data.size(), pos + 1));
+    }
+    return bounds;
+}
+
+struct CsvSlice {
+    std::vector<Song> songs;
+    std::vector<CatalogRow> kinds;
+    bool aligned = true;
+};
+
+size_t parseCsvSlice(std::string_view data, const CsvLayout& layout, const CatalogShard& shard, size_t pos, size_t end, unsigned seed, CsvSlice& slice) {
+    // appends the songs of the records starting in [pos, end); returns where the last record ended
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> dist(0, 100);
+    std::vector<CsvField> fields;
+    while (pos < end && readCsvRecord(data, pos, fields)) {
+        Song s;
+        CatalogRow kind;
+        if (!songFromRecord(data, fields, layout, s, kind) || !shard.owns(s.artist)) continue;
+        s.energy = dist(rng);
+        s.danceability = dist(rng);
+        s.acousticness = dist(rng);
+        slice.songs.push_back(std::move(s));
+        slice.kinds.push_back(kind);
+    }
+    return pos;
+}
+
+std::vector<Song> loadSongs(const std::string& filename, ColdColumns& cold, const CatalogShard& shard) {
+    // parse and load songs into csv file for pulling recommendations
+    StageTimer timer(Stage::Parse);
+    TraceScope trace("loadSongs");
+    std::vector<Song> songs;
+    std::filesystem::path csvPath = resourcePath(filename);
+    if (!cold.file.open(csvPath)) {
+        std::cerr << "Failed to open CSV file\n";
+        return songs;
+    }
+    cold.file.adviseSequential();
+    std::string_view data = cold.file.view();
+
+    // slices of the file are parsed in parallel from guessed record boundaries; if any slice's records do not end
+    // exactly on the next boundary (stray quotes threw the guess off) the file is parsed serially instead
+    CsvLayout layout = readCsvLayout(data);
+    size_t parts = std::min(TaskScheduler::instance().concurrency() * INTERACTIVE_CHUNKS_PER_THREAD, (data.size() - layout.firstRecord) / CSV_SLICE_MIN_BYTES + 1);
+    std::vector<size_t> bounds = csvSliceBounds(data, layout.firstRecord, parts);
+    std::vector<CsvSlice> slices(parts);
+    unsigned seed = std::random_device{}();
+    parallelFor(parts, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) slices[i].aligned = parseCsvSlice(data, layout, shard, bounds[i], bounds[i + 1], seed + i, slices[i]) == bounds[i + 1];
+    }, 1);
+    if (!std::all_of(slices.begin(), slices.end(), [](const CsvSlice& slice) { return slice.aligned; })) {
+        slices.assign(1, CsvSlice());
+        parseCsvSlice(data, layout, shard, layout.firstRecord, data.size(), seed, slices[0]);
+    }
+    std::vector<CatalogRow> kinds;
+    for (CsvSlice& slice : slices) {
+        for (Song& s : slice.songs) {
+            s.id = static_cast<uint32_t>(songs.size());
+            songs.push_back(std::move(s));
+        }
+        kinds.insert(kinds.end(), slice.kinds.begin(), slice.kinds.end());
+    }
+
+    // resolves the log: an update row takes the place of the first row for its artist and title (the one dedupeSongs
+    // keeps), so ids keep their order, and a delete row drops every earlier row for them. Rows for the same song are
+    // chained newest first
+    constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
+    std::unordered_map<uint64_t, std::pair<uint32_t, uint32_t>> live; // key -> (first, latest) row
+    std::vector<uint32_t> earlier(songs.size(), NONE);
+    std::vector<uint8_t> keep(songs.size(), 1);
+    for (uint32_t i = 0; i < songs.size(); i++) {
+        uint64_t key = songKeyHash(songs[i].artist, songs[i].title);
+        auto found = live.find(key);
+        if (kinds[i] == CatalogRow::Delete) {
+            keep[i] = 0;
+            if (found == live.end()) continue;
+            for (uint32_t row = found->second.second; row != NONE; row = earlier[row]) keep[row] = 0;
+            live.erase(found);
+        } else if (kinds[i] == CatalogRow::Update && found != live.end()) {
+            songs[found->second.first] = std::move(songs[i]);
+            keep[i] = 0;
+        } else if (found != live.end()) {
+            earlier[i] = found->second.second;
+            found->second.second = i;
+        } else {
+            live.emplace(key, std::make_pair(i, i));
+        }
+    }
+    size_t kept = 0;
+    for (uint32_t i = 0; i < songs.size(); i++) {
+        if (!keep[i]) continue;
+        if (kept != i) songs[kept] = std::move(songs[i]);
+        songs[kept].id = static_cast<uint32_t>(kept);
+        kept++;
+    }
+    songs.resize(kept);
+
+    std::cout << "CSV loaded from: \"" << csvPath.string() << "\"\n";
+    return songs;
+}
+
+uint64_t mix64(uint64_t x) {
+    // splitmix64 finalizer, used to derive independent hash functions from one base hash
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+uint64_t hashBytes(const char* p, size_t n, uint64_t h) {
+    // FNV-1a over a byte range
+    for (size_t i = 0; i < n; i++) {
+        h ^= static_cast<unsigned char>(p[i]);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+bool CatalogShard::owns(const std::string& artist) const {
+    if (count <= 1) return true;
+    std::string key = normalize(artist);
+    return mix64(hashBytes(key.data(), key.size())) % count == index;
+}
+
+uint64_t songKeyHash(const std::string& artist, const std::string& title) {
+    // identity of a song across files: hash of the normalized artist and title
+    std::string a = normalize(artist);
+    std::string t = normalize(title);
+    return hashBytes(t.data(), t.size(), mix64(hashBytes(a.data(), a.size())));
+}
+
+bool isStopWord(const std::string& w) {
+    // words too short or too common to say anything about what a song is about
+    static const char* const stopWords[] = {
+        "the", "and", "you", "your", "that", "for", "with", "this", "but", "are", "not", "all", "was", "what",
+        "can", "just", "get", "got", "dont", "its", "one", "have", "she", "his", "her", "they", "them", "from",
+        "out", "will", "there", "then", "how", "too", "who", "were", "would", "could", "into", "our", "some",
+        "when", "now", "yeah", "know", "like", "ill", "ive", "youre", "cant", "aint", "ooh"
+    };
+    if (w.size() < 3) return true;
+    for (const char* stop : stopWords) {
+        if (w == stop) return true;
+    }
+    return false;
+}
+
+void lyricSignature(std::string_view lyrics, uint32_t* sig) {
+    // MinHash over the set of lowercase content words in the lyrics; sig is left all-max when there are none.
+    // "" escapes only ever surround words, so the raw mapped bytes can be hashed without unescaping.
+    std::fill(sig, sig + LYRIC_HASHES, std::numeric_limits<uint32_t>::max());
+    std::string word;
+    auto endWord = [&]() {
+        if (!isStopWord(word)) {
+            uint64_t w = hashBytes(word.data(), word.size());
+            for (int i = 0; i < LYRIC_HASHES; i++) {
+                uint32_t h = static_cast<uint32_t>(mix64(w + 0x632be59bd9b4e019ULL * (i + 1)));
+                if (h < sig[i]) sig[i] = h;
+            }
+        }
+        word.clear();
+    };
+    for (char c : lyrics) {
+        if (isalnum(static_cast<unsigned char>(c))) word += static_cast<char>(tolower(static_cast<unsigned char>(c)));
+        else if (c != '\'') endWord();
+    }
+    endWord();
+}
+
+uint64_t bandKey(const uint32_t* sig, int band) {
+    // hash of the LYRIC_ROWS signature values that make up one band
+    return hashBytes(reinterpret_cast<const char*>(sig + band * LYRIC_ROWS), sizeof(uint32_t) * LYRIC_ROWS, 0x84222325cbf29ce4ULL + band);
+}
+
+LyricIndex computeLyricSignatures(const std::vector<Song>& songs, const ColdColumns& cold) {
+    // computes one MinHash signature per song in parallel; bands are built separately so the catalog can be compacted first
+    LyricIndex index;
+    index.signatures.resize(songs.size() * LYRIC_HASHES);
+    index.hasLyrics.assign(songs.size(), 0);
+    parallelFor(songs.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            uint32_t* sig = &index.signatures[i * LYRIC_HASHES];
+            lyricSignature(cold.raw(songs[i].lyrics), sig);
+            index.hasLyrics[i] = sig[0] != std::numeric_limits<uint32_t>::max();
+        }
+    });
+    return index;
+}
+
+void buildLyricBands(LyricIndex& index) {
+    // builds and sorts each band table in parallel from the signatures already in the index
+    size_t count = index.hasLyrics.size();
+    index.bands.assign(LYRIC_BANDS, {});
+    parallelFor(LYRIC_BANDS, [&](size_t begin, size_t end) {
+        for (size_t b = begin; b < end; b++) {
+            auto& table = index.bands[b];
+            table.reserve(count);
+            for (size_t i = 0; i < count; i++) {
+                if (index.hasLyrics[i]) table.emplace_back(bandKey(&index.signatures[i * LYRIC_HASHES], static_cast<int>(b)), static_cast<uint32_t>(i));
+            }
+            std::sort(table.begin(), table.end());
+        }
+    }, 1);
+}
+
+LyricIndex buildLyricIndex(const std::vector<Song>& songs, const ColdColumns& cold) {
+    // signatures and bands in one step, for catalogs that skip deduplication
+    LyricIndex index = computeLyricSignatures(songs, cold);
+    buildLyricBands(index);
+    return index;
+}
+
+double signatureSimilarity(const LyricIndex& index, uint32_t a, uint32_t b) {
+    // fraction of matching MinHash slots, an unbiased estimate of the lyrics' Jaccard similarity
+    const uint32_t* sigA = &index.signatures[static_cast<size_t>(a) * LYRIC_HASHES];
+    const uint32_t* sigB = &index.signatures[static_cast<size_t>(b) * LYRIC_HASHES];
+    int same = 0;
+    for (int i = 0; i < LYRIC_HASHES; i++) same += sigA[i] == sigB[i];
+    return static_cast<double>(same) / LYRIC_HASHES;
+}
+
+DuplicateGroups dedupeSongs(std::vector<Song>& songs, LyricIndex& index) {
+    // folds exact (normalized artist + title) and near (same artist, MinHash lyrics) duplicates into the first
+    // occurrence, compacting songs and signatures in place and renumbering ids
+    size_t count = songs.size();
+    std::vector<uint64_t> artistKey(count), songKey(count);
+    parallelFor(count, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            std::string artist = normalize(songs[i].artist);
+            artistKey[i] = hashBytes(artist.data(), artist.size());
+            songKey[i] = songKeyHash(songs[i].artist, songs[i].title);
+        }
+    });
+
+    std::vector<uint32_t> parent(count);
+    for (size_t i = 0; i < count; i++) parent[i] = static_cast<uint32_t>(i);
+    auto find = [&](uint32_t x) {
+        while (parent[x] != x) x = parent[x] = parent[parent[x]];
+        return x;
+    };
+    auto unite = [&](uint32_t a, uint32_t b) {
+        a = find(a);
+        b = find(b);
+        if (a != b) parent[std::max(a, b)] = std::min(a, b);
+    };
+    auto groupBy = [count](const std::vector<uint64_t>& keys) {
+        std::vector<std::pair<uint64_t, uint32_t>> order(count);
+        for (size_t i = 0; i < count; i++) order[i] = {keys[i], static_cast<uint32_t>(i)};
+        std::sort(order.begin(), order.end());
+        return order;
+    };
+
+    // exact duplicates are adjacent once sorted by song key
+    auto bySong = groupBy(songKey);
+    for (size_t i = 1; i < count; i++) {
+        if (bySong[i].first == bySong[i - 1].first) unite(bySong[i - 1].second, bySong[i].second);
+    }
+
+    // near duplicates are only looked for within one artist, one artist range per task
+    auto byArtist = groupBy(artistKey);
+    std::vector<std::pair<size_t, size_t>> ranges;
+    for (size_t begin = 0, end; begin < count; begin = end) {
+        for (end = begin + 1; end < count && byArtist[end].first == byArtist[begin].first; end++) {}
+        if (end - begin > 1) ranges.emplace_back(begin, end);
+    }
+    std::vector<std::pair<uint32_t, uint32_t>> nearPairs;
+    std::mutex nearMutex;
+    parallelFor(ranges.size(), [&](size_t begin, size_t end) {
+        std::vector<std::pair<uint32_t, uint32_t>> local;
+        for (size_t r = begin; r < end; r++) {
+            for (size_t i = ranges[r].first; i < ranges[r].second; i++) {
+                uint32_t a = byArtist[i].second;
+                if (!index.hasLyrics[a]) continue;
+                for (size_t j = i + 1; j < ranges[r].second; j++) {
+                    uint32_t b = byArtist[j].second;
+                    if (index.hasLyrics[b] && signatureSimilarity(index, a, b) >= NEAR_DUPLICATE_JACCARD) local.emplace_back(a, b);
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock(nearMutex);
+        nearPairs.insert(nearPairs.end(), local.begin(), local.end());
+    }, 16);
+    for (const auto& [a, b] : nearPairs) unite(a, b);
+
+    // number the canonical rows first and pull duplicates out before compaction overwrites their slots
+    std::vector<uint32_t> newId(count);
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (find(static_cast<uint32_t>(i)) == i) newId[i] = static_cast<uint32_t>(kept++);
+    }
+    DuplicateGroups groups;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t root = find(static_cast<uint32_t>(i));
+        if (root != i) groups[newId[root]].push_back(std::move(songs[i]));
+    }
+    // canonical rows keep their relative order
+    for (size_t i = 0; i < count; i++) {
+        if (parent[i] != i) continue;
+        size_t to = newId[i];
+        if (to != i) {
+            songs[to] = std::move(songs[i]);
+            std::copy_n(&index.signatures[i * LYRIC_HASHES], LYRIC_HASHES, &index.signatures[to * LYRIC_HASHES]);
+            index.hasLyrics[to] = index.hasLyrics[i];
+        }
+        songs[to].id = static_cast<uint32_t>(to);
+    }
+    songs.resize(kept);
+    index.signatures.resize(kept * LYRIC_HASHES);
+    index.hasLyrics.resize(kept);
+    return groups;
+}
+
+std::vector<std::pair<uint32_t, double>> similarLyrics(const LyricIndex& index, uint32_t seedId, size_t k) {
+    // returns up to k (song id, estimated Jaccard) pairs whose lyrics collide with the seed in at least one band
+    std::vector<std::pair<uint32_t, double>> result;
+    if (seedId >= index.hasLyrics.size() || !index.hasLyrics[seedId]) return result;
+    const uint32_t* seedSig = &index.signatures[static_cast<size_t>(seedId) * LYRIC_HASHES];
+    std::vector<uint32_t> candidates;
+    for (int b = 0; b < LYRIC_BANDS; b++) {
+        const auto& table = index.bands[b];
+        uint64_t key = bandKey(seedSig, b);
+        auto lo = std::lower_bound(table.begin(), table.end(), std::make_pair(key, uint32_t(0)));
+        auto hi = std::upper_bound(lo, table.end(), std::make_pair(key, std::numeric_limits<uint32_t>::max()));
+        if (static_cast<size_t>(hi - lo) > LYRIC_MAX_BUCKET) continue;
+        for (auto it = lo; it != hi; ++it) {
+            if (it->second != seedId) candidates.push_back(it->second);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+    for (uint32_t id : candidates) result.emplace_back(id, signatureSimilarity(index, seedId, id));
+    size_t keep = std::min(k, result.size());
+    std::partial_sort(result.begin(), result.begin() + keep, result.end(), [](const auto& a, const auto& b) {
+        return a.second > b.second || (a.second == b.second && a.first < b.first);
+    });
+    result.resize(keep);
+    return result;
+}
+
+std::unordered_map<uint64_t, uint32_t> songIdsByKey(const std::vector<Song>& songs, const DuplicateGroups& duplicates) {
+    // songKeyHash -> catalog id for every song, with folded duplicates pointing at their canonical song
+    std::unordered_map<uint64_t, uint32_t> idByKey;
+    idByKey.reserve(songs.size() * 2);
+    for (const Song& s : songs) idByKey.emplace(songKeyHash(s.artist, s.title), s.id);
+    for (const auto& [id, group] : duplicates) {
+        for (const Song& d : group) idByKey.emplace(songKeyHash(d.artist, d.title), id);
+    }
+    return idByKey;
+}
+
+bool parseEmbeddingLine(std::string_view line, std::string& artist, std::string& title, std::vector<float>& values) {
+    // splits "artist<TAB>title<TAB>v0 v1 ..." (values separated by spaces or commas); false for comments and malformed lines
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    if (line.empty() || line[0] == '#') return false;
+    size_t tab1 = line.find('\t');
+    size_t tab2 = tab1 == std::string_view::npos ? tab1 : line.find('\t', tab1 + 1);
+    if (tab2 == std::string_view::npos) return false;
+    artist.assign(line.substr(0, tab1));
+    title.assign(line.substr(tab1 + 1, tab2 - tab1 - 1));
+    values.clear();
+    const char* p = line.data() + tab2 + 1;
+    const char* end = line.data() + line.size();
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ',' || *p == '\t')) p++;
+        if (p == end) break;
+        float v;
+        auto [next, ec] = std::from_chars(p, end, v);
+        if (ec != std::errc()) return false;
+        values.push_back(v);
+        p = next;
+    }
+    return !values.empty();
+}
+
+bool EmbeddingTable::exactRow(uint32_t id, float* out) const {
+    // copies the full-precision vector (stride floats) from memory, or parses it back out of the side file
+    if (id >= hasEmbedding.size() || !hasEmbedding[id]) return false;
+    if (!data.empty()) {
+        std::copy_n(row(id), stride, out);
+        return true;
+    }
+    std::string_view text = file.view();
+    size_t begin = lineOffset[id];
+    size_t end = std::min(text.find('\n', begin), text.size());
+    std::string artist, title;
+    std::vector<float> values;
+    if (!parseEmbeddingLine(text.substr(begin, end - begin), artist, title, values) || values.size() != dim) return false;
+    std::copy(values.begin(), values.end(), out);
+    std::fill(out + dim, out + stride, 0.0f);
+    return true;
+}
+
+EmbeddingTable loadEmbeddings(const std::string& filename, const std::vector<Song>& songs, const DuplicateGroups& duplicates) {
+    // side file lines are "artist<TAB>title<TAB>v0 v1 ...", matched to songs by normalized artist and title;
+    // chunks of lines are parsed in parallel and the first line fixes the dimension
+    EmbeddingTable table;
+    if (!table.file.open(resourcePath(filename)) || table.file.size == 0) return table;
+    std::string_view data = table.file.view();
+
+    std::unordered_map<uint64_t, uint32_t> idByKey = songIdsByKey(songs, duplicates);
+
+    std::string artist, title;
+    std::vector<float> values;
+    for (size_t pos = 0; pos < data.size() && table.dim == 0;) {
+        size_t eol = std::min(data.find('\n', pos), data.size());
+        if (parseEmbeddingLine(data.substr(pos, eol - pos), artist, title, values)) table.dim = values.size();
+        pos = eol + 1;
+    }
+    if (table.dim == 0) return table;
+    table.stride = (table.dim + 7) / 8 * 8;
+    table.data.assign(songs.size() * table.stride, 0.0f);
+    table.hasEmbedding.assign(songs.size(), 0);
+    table.lineOffset.assign(songs.size(), 0);
+
+    // a chunk owns every line that starts inside it; the earliest line for a song wins, however the chunks interleave
+    std::vector<std::atomic<uint64_t>> firstLine(songs.size());
+    for (auto& line : firstLine) line.store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+    std::atomic<size_t> skipped{0};
+    size_t chunks = std::max<size_t>(1, std::min<size_t>(256, data.size() / (1 << 16)));
+    auto chunkStart = [&](size_t c) {
+        if (c == 0) return size_t(0);
+        if (c >= chunks) return data.size();
+        size_t nl = data.find('\n', c * (data.size() / chunks) - 1);
+        return nl == std::string_view::npos ? data.size() : nl + 1;
+    };
+    parallelFor(chunks, [&](size_t begin, size_t end) {
+        std::string artist, title;
+        std::vector<float> values;
+        for (size_t c = begin; c < end; c++) {
+            for (size_t pos = chunkStart(c), stop = chunkStart(c + 1); pos < stop;) {
+                size_t lineStart = pos;
+                size_t eol = std::min(data.find('\n', pos), data.size());
+                std::string_view line = data.substr(pos, eol - pos);
+                pos = eol + 1;
+                if (!parseEmbeddingLine(line, artist, title, values)) continue;
+                auto it = idByKey.find(songKeyHash(artist, title));
+                if (values.size() != table.dim || it == idByKey.end()) {
+                    skipped++;
+                    continue;
+                }
+                uint64_t seen = firstLine[it->second].load();
+                while (lineStart < seen && !firstLine[it->second].compare_exchange_weak(seen, lineStart)) {}
+            }
+        }
+    }, 1);
+    parallelFor(songs.size(), [&](size_t begin, size_t end) {
+        std::string artist, title;
+        std::vector<float> values;
+        for (size_t i = begin; i < end; i++) {
+            uint64_t lineStart = firstLine[i].load(std::memory_order_relaxed);
+            if (lineStart == std::numeric_limits<uint64_t>::max()) continue;
+            size_t eol = std::min(data.find('\n', lineStart), data.size());
+            parseEmbeddingLine(data.substr(lineStart, eol - lineStart), artist, title, values);
+            std::copy(values.begin(), values.end(), table.data.begin() + i * table.stride);
+            table.hasEmbedding[i] = 1;
+            table.lineOffset[i] = lineStart;
+        }
+    });
+    table.file.evict();
+
+    size_t loaded = std::count(table.hasEmbedding.begin(), table.hasEmbedding.end(), 1);
+    std::cout << "Embeddings: " << loaded << " songs, " << table.dim << " dimensions (" << skipped << " lines skipped)\n";
+    return table;
+}
+
+void scoreRowsScalar(const float* query, const float* rows, size_t stride, size_t count, EmbeddingMetric metric, float* out) {
+    // portable kernel: dot product, or negated squared L2 so that higher is always better
+    for (size_t r = 0; r < count; r++) {
+        const float* v = rows + r * stride;
+        float acc = 0.0f;
+        if (metric == EmbeddingMetric::Dot) {
+            for (size_t d = 0; d < stride; d++) acc += v[d] * query[d];
+            out[r] = acc;
+        } else {
+            for (size_t d = 0; d < stride; d++) acc += (v[d] - query[d]) * (v[d] - query[d]);
+            out[r] = -acc;
+        }
+    }
+}
+
+#ifdef MUSIC_X86_KERNELS
+__attribute__((target("avx2,fma"))) inline float horizontalSum(__m256 v) {
+    // adds the eight lanes of v
+    __m128 lo = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    lo = _mm_hadd_ps(lo, lo);
+    lo = _mm_hadd_ps(lo, lo);
+    return _mm_cvtss_f32(lo);
+}
+
+__attribute__((target("avx2,fma"))) void scoreRowsAvx2(const float* query, const float* rows, size_t stride, size_t count, EmbeddingMetric metric, float* out) {
+    // AVX2/FMA kernel: four rows per pass so each query chunk is loaded once for four accumulators
+    bool dot = metric == EmbeddingMetric::Dot;
+    size_t r = 0;
+    for (; r + 4 <= count; r += 4) {
+        const float* v0 = rows + r * stride;
+        const float* v1 = v0 + stride;
+        const float* v2 = v1 + stride;
+        const float* v3 = v2 + stride;
+        __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+        for (size_t d = 0; d < stride; d += 8) {
+            __m256 q = _mm256_loadu_ps(query + d);
+            __m256 x0 = _mm256_loadu_ps(v0 + d), x1 = _mm256_loadu_ps(v1 + d), x2 = _mm256_loadu_ps(v2 + d), x3 = _mm256_loadu_ps(v3 + d);
+            if (dot) {
+                a0 = _mm256_fmadd_ps(x0, q, a0);
+                a1 = _mm256_fmadd_ps(x1, q, a1);
+                a2 = _mm256_fmadd_ps(x2, q, a2);
+                a3 = _mm256_fmadd_ps(x3, q, a3);
+            } else {
+                x0 = _mm256_sub_ps(x0, q); x1 = _mm256_sub_ps(x1, q); x2 = _mm256_sub_ps(x2, q); x3 = _mm256_sub_ps(x3, q);
+                a0 = _mm256_fmadd_ps(x0, x0, a0);
+                a1 = _mm256_fmadd_ps(x1, x1, a1);
+                a2 = _mm256_fmadd_ps(x2, x2, a2);
+                a3 = _mm256_fmadd_ps(x3, x3, a3);
+            }
+        }
+        float sign = dot ? 1.0f : -1.0f;
+        out[r] = sign * horizontalSum(a0);
+        out[r + 1] = sign * horizontalSum(a1);
+        out[r + 2] = sign * horizontalSum(a2);
+        out[r + 3] = sign * horizontalSum(a3);
+    }
+    for (; r < count; r++) {
+        const float* v = rows + r * stride;
+        __m256 acc = _mm256_setzero_ps();
+        for (size_t d = 0; d < stride; d += 8) {
+            __m256 x = _mm256_loadu_ps(v + d), q = _mm256_loadu_ps(query + d);
+            if (dot) {
+                acc = _mm256_fmadd_ps(x, q, acc);
+            } else {
+                x = _mm256_sub_ps(x, q);
+                acc = _mm256_fmadd_ps(x, x, acc);
+            }
+        }
+        out[r] = dot ? horizontalSum(acc) : -horizontalSum(acc);
+    }
+}
+#endif
+
+using ScoreRowsKernel = void (*)(const float*, const float*, size_t, size_t, EmbeddingMetric, float*);
+
+ScoreRowsKernel scoreRowsKernel() {
+    // picks the widest kernel the running CPU supports, once
+    static const ScoreRowsKernel kernel = []() -> ScoreRowsKernel {
+#ifdef MUSIC_X86_KERNELS
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return scoreRowsAvx2;
+#endif
+        return scoreRowsScalar;
+    }();
+    return kernel;
+}
+
+std::vector<std::pair<uint32_t, float>> nearestEmbeddings(const EmbeddingTable& table, const float* query, size_t k, EmbeddingMetric metric, uint32_t exclude) {
+    // exact top-k scan: each thread scores EMBEDDING_BLOCK rows at a time and feeds a private min-heap, then the heaps are merged.
+    // Scores are dot products or negated squared distances, best first.
+    std::vector<std::pair<uint32_t, float>> result;
+    size_t count = table.hasEmbedding.size();
+    if (table.dim == 0 || k == 0 || count == 0) return result;
+    std::vector<float> padded(query, query + table.stride);
+    ScoreRowsKernel kernel = scoreRowsKernel();
+    auto better = [](const std::pair<uint32_t, float>& a, const std::pair<uint32_t, float>& b) {
+        return a.second > b.second || (a.second == b.second && a.first < b.first);
+    };
+    std::mutex resultMutex;
+    parallelFor((count + EMBEDDING_BLOCK - 1) / EMBEDDING_BLOCK, [&](size_t beginBlock, size_t endBlock) {
+        std::vector<std::pair<uint32_t, float>> heap;
+        heap.reserve(k + 1);
+        float scores[EMBEDDING_BLOCK];
+        for (size_t block = beginBlock; block < endBlock; block++) {
+            size_t first = block * EMBEDDING_BLOCK;
+            size_t rows = std::min(EMBEDDING_BLOCK, count - first);
+            kernel(padded.data(), table.row(static_cast<uint32_t>(first)), table.stride, rows, metric, scores);
+            for (size_t r = 0; r < rows; r++) {
+                uint32_t id = static_cast<uint32_t>(first + r);
+                if (!table.hasEmbedding[id] || id == exclude) continue;
+                if (heap.size() == k) {
+                    if (scores[r] <= heap.front().second) continue;
+                    std::pop_heap(heap.begin(), heap.end(), better);
+                    heap.pop_back();
+                }
+                heap.emplace_back(id, scores[r]);
+                std::push_heap(heap.begin(), heap.end(), better);
+            }
+        }
+        std::lock_guard<std::mutex> lock(resultMutex);
+        result.insert(result.end(), heap.begin(), heap.end());
+    }, 16);
+    size_t keep = std::min(k, result.size());
+    std::partial_sort(result.begin(), result.begin() + keep, result.end(), better);
+    result.resize(keep);
+    return result;
+}
+
+float squaredDistance(const float* a, const float* b, size_t dim) {
+    // plain squared L2 distance
+    float acc = 0.0f;
+    for (size_t d = 0; d < dim; d++) acc += (a[d] - b[d]) * (a[d] - b[d]);
+    return acc;
+}
+
+float dotProduct(const float* a, const float* b, size_t dim) {
+    // plain inner product
+    float acc = 0.0f;
+    for (size_t d = 0; d < dim; d++) acc += a[d] * b[d];
+    return acc;
+}
+
+size_t nearestCentroid(const float* point, const float* centroids, size_t k, size_t dim) {
+    // index of the closest centroid by squared L2
+    size_t best = 0;
+    float bestDist = std::numeric_limits<float>::max();
+    for (size_t c = 0; c < k; c++) {
+        float dist = squaredDistance(point, centroids + c * dim, dim);
+        if (dist < bestDist) {
+            bestDist = dist;
+            best = c;
+        }
+    }
+    return best;
+}
+
+std::vector<float> kmeans(const std::vector<float>& points, size_t dim, size_t k, int iterations, uint64_t seed) {
+    // Lloyd's k-means over row-major points with a parallel assignment step; empty clusters are re-seeded
+    size_t n = points.size() / dim;
+    std::vector<float> centroids(k * dim, 0.0f);
+    if (n == 0) return centroids;
+    std::mt19937_64 rng(seed);
+    for (size_t c = 0; c < k; c++) {
+        size_t pick = n >= k ? (c * n) / k + rng() % std::max<size_t>(1, n / k) : rng() % n;
+        std::copy_n(&points[std::min(pick, n - 1) * dim], dim, &centroids[c * dim]);
+    }
+    std::vector<uint32_t> assign(n);
+    for (int it = 0; it < iterations; it++) {
+        parallelFor(n, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) assign[i] = static_cast<uint32_t>(nearestCentroid(&points[i * dim], centroids.data(), k, dim));
+        });
+        std::vector<float> sums(k * dim, 0.0f);
+        std::vector<size_t> counts(k, 0);
+        for (size_t i = 0; i < n; i++) {
+            counts[assign[i]]++;
+            for (size_t d = 0; d < dim; d++) sums[assign[i] * dim + d] += points[i * dim + d];
+        }
+        for (size_t c = 0; c < k; c++) {
+            if (counts[c] == 0) {
+                std::copy_n(&points[(rng() % n) * dim], dim, &centroids[c * dim]);
+                continue;
+            }
+            for (size_t d = 0; d < dim; d++) centroids[c * dim + d] = sums[c * dim + d] / counts[c];
+        }
+    }
+    return centroids;
+}
+
+PQIndex buildPQIndex(const EmbeddingTable& table, size_t subspaces, size_t lists) {
+    // trains the coarse quantizer and per-subspace codebooks on a sample, then encodes every song's residual in parallel
+    PQIndex index;
+    size_t count = table.hasEmbedding.size();
+    std::vector<uint32_t> members;
+    for (uint32_t i = 0; i < count; i++) {
+        if (table.hasEmbedding[i]) members.push_back(i);
+    }
+    if (table.dim == 0 || members.empty()) return index;
+    index.subspaces = std::max<size_t>(2, subspaces / 2 * 2);
+    index.dim = (table.dim + index.subspaces - 1) / index.subspaces * index.subspaces;
+    index.subDim = index.dim / index.subspaces;
+    index.lists = std::max<size_t>(1, std::min(lists, members.size() / PQ_BLOCK));
+    size_t dim = index.dim;
+
+    auto padded = [&](uint32_t id, float* out) {
+        std::fill(out, out + dim, 0.0f);
+        std::copy_n(table.row(id), table.dim, out);
+    };
+
+    // training sample, spread evenly over the catalog
+    size_t sampleCount = std::min(members.size(), PQ_TRAIN_SAMPLES);
+    std::vector<float> sample(sampleCount * dim);
+    for (size_t i = 0; i < sampleCount; i++) padded(members[i * members.size() / sampleCount], &sample[i * dim]);
+
+    if (index.lists > 1) index.coarse = kmeans(sample, dim, index.lists, 10, 1);
+    else index.coarse.assign(dim, 0.0f);
+    for (size_t i = 0; i < sampleCount; i++) {
+        const float* c = &index.coarse[nearestCentroid(&sample[i * dim], index.coarse.data(), index.lists, dim) * dim];
+        for (size_t d = 0; d < dim; d++) sample[i * dim + d] -= c[d];
+    }
+    index.codebooks.resize(index.subspaces * PQ_CENTROIDS * index.subDim);
+    parallelFor(index.subspaces, [&](size_t begin, size_t end) {
+        for (size_t m = begin; m < end; m++) {
+            std::vector<float> sub(sampleCount * index.subDim);
+            for (size_t i = 0; i < sampleCount; i++) std::copy_n(&sample[i * dim + m * index.subDim], index.subDim, &sub[i * index.subDim]);
+            std::vector<float> book = kmeans(sub, index.subDim, PQ_CENTROIDS, 12, 100 + m);
+            std::copy(book.begin(), book.end(), index.codebooks.begin() + m * PQ_CENTROIDS * index.subDim);
+        }
+    }, 1);
+
+    // encode: list assignment and one 4-bit code per subspace for every song
+    std::vector<uint32_t> listOf(members.size());
+    std::vector<uint8_t> flatCodes(members.size() * index.subspaces);
+    parallelFor(members.size(), [&](size_t begin, size_t end) {
+        std::vector<float> v(dim);
+        for (size_t i = begin; i < end; i++) {
+            padded(members[i], v.data());
+            listOf[i] = static_cast<uint32_t>(nearestCentroid(v.data(), index.coarse.data(), index.lists, dim));
+            const float* c = &index.coarse[listOf[i] * dim];
+            for (size_t d = 0; d < dim; d++) v[d] -= c[d];
+            for (size_t m = 0; m < index.subspaces; m++) {
+                flatCodes[i * index.subspaces + m] = static_cast<uint8_t>(nearestCentroid(&v[m * index.subDim], &index.codebooks[m * PQ_CENTROIDS * index.subDim], PQ_CENTROIDS, index.subDim));
+            }
+        }
+    });
+
+    // pack each list into 32-song blocks, transposed by subspace for the shuffle kernel
+    std::vector<std::vector<uint32_t>> byList(index.lists);
+    for (size_t i = 0; i < members.size(); i++) byList[listOf[i]].push_back(static_cast<uint32_t>(i));
+    index.listBlocks.assign(index.lists + 1, 0);
+    for (size_t l = 0; l < index.lists; l++) index.listBlocks[l + 1] = index.listBlocks[l] + static_cast<uint32_t>((byList[l].size() + PQ_BLOCK - 1) / PQ_BLOCK);
+    size_t blocks = index.listBlocks[index.lists];
+    index.codes.assign(blocks * index.subspaces * 16, 0);
+    index.ids.assign(blocks * PQ_BLOCK, std::numeric_limits<uint32_t>::max());
+    for (size_t l = 0; l < index.lists; l++) {
+        for (size_t j = 0; j < byList[l].size(); j++) {
+            size_t block = index.listBlocks[l] + j / PQ_BLOCK, lane = j % PQ_BLOCK;
+            uint32_t member = byList[l][j];
+            index.ids[block * PQ_BLOCK + lane] = members[member];
+            uint8_t* out = &index.codes[block * index.subspaces * 16];
+            for (size_t m = 0; m < index.subspaces; m++) {
+                uint8_t code = flatCodes[static_cast<size_t>(member) * index.subspaces + m];
+                out[m * 16 + lane % 16] |= lane < 16 ? code : static_cast<uint8_t>(code << 4);
+            }
+        }
+    }
+    return index;
+}
+
+void scanPQBlockScalar(const uint8_t* codes, const uint8_t* lut, size_t subspaces, uint16_t* out) {
+    // portable fast-scan: sums the quantized table entries of all subspaces for 32 songs
+    for (size_t j = 0; j < PQ_BLOCK; j++) {
+        uint16_t sum = 0;
+        for (size_t m = 0; m < subspaces; m++) {
+            uint8_t packed = codes[m * 16 + j % 16];
+            sum += lut[m * 16 + (j < 16 ? packed & 15 : packed >> 4)];
+        }
+        out[j] = sum;
+    }
+}
+
+#ifdef MUSIC_X86_KERNELS
+__attribute__((target("avx2"))) void scanPQBlockAvx2(const uint8_t* codes, const uint8_t* lut, size_t subspaces, uint16_t* out) {
+    // AVX2 fast-scan: the low lane shuffles songs 0-15 and the high lane songs 16-31 through the same 16-byte table
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero;
+    for (size_t m = 0; m < subspaces; m++) {
+        __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>(codes + m * 16));
+        __m256i index = _mm256_set_m128i(_mm_and_si128(_mm_srli_epi16(packed, 4), nibble), _mm_and_si128(packed, nibble));
+        __m128i table = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lut + m * 16));
+        __m256i dist = _mm256_shuffle_epi8(_mm256_set_m128i(table, table), index);
+        acc0 = _mm256_add_epi16(acc0, _mm256_unpacklo_epi8(dist, zero));
+        acc1 = _mm256_add_epi16(acc1, _mm256_unpackhi_epi8(dist, zero));
+    }
+    // unpacklo/hi work within 128-bit lanes: acc0 holds songs 0-7 and 16-23, acc1 holds 8-15 and 24-31
+    alignas(32) uint16_t lo[16], hi[16];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lo), acc0);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(hi), acc1);
+    for (int j = 0; j < 8; j++) {
+        out[j] = lo[j];
+        out[j + 8] = hi[j];
+        out[j + 16] = lo[j + 8];
+        out[j + 24] = hi[j + 8];
+    }
+}
+#endif
+
+using ScanPQBlockKernel = void (*)(const uint8_t*, const uint8_t*, size_t, uint16_t*);
+
+ScanPQBlockKernel scanPQBlockKernel() {
+    // picks the shuffle kernel when the running CPU has AVX2, once
+    static const ScanPQBlockKernel kernel = []() -> ScanPQBlockKernel {
+#ifdef MUSIC_X86_KERNELS
+        if (__builtin_cpu_supports("avx2")) return scanPQBlockAvx2;
+#endif
+        return scanPQBlockScalar;
+    }();
+    return kernel;
+}
+
+std::vector<std::pair<uint32_t, float>> searchPQ(const PQIndex& index, const EmbeddingTable& table, const float* query, size_t k, EmbeddingMetric metric, uint32_t exclude) {
+    // visits the nprobe closest lists with quantized asymmetric-distance tables, keeps a k * rerank shortlist and
+    // re-scores it with exact vectors. Scores follow nearestEmbeddings: higher is better.
+    std::vector<std::pair<uint32_t, float>> result;
+    if (index.subspaces == 0 || k == 0) return result;
+    size_t dim = index.dim, subDim = index.subDim;
+    std::vector<float> q(dim, 0.0f);
+    std::copy_n(query, table.dim, q.begin());
+    bool dot = metric == EmbeddingMetric::Dot;
+
+    // coarse step: lower is better for both metrics
+    std::vector<std::pair<float, uint32_t>> order(index.lists);
+    for (size_t l = 0; l < index.lists; l++) {
+        const float* c = &index.coarse[l * dim];
+        order[l] = {dot ? -dotProduct(q.data(), c, dim) : squaredDistance(q.data(), c, dim), static_cast<uint32_t>(l)};
+    }
+    size_t probes = std::min(index.nprobe, index.lists);
+    std::partial_sort(order.begin(), order.begin() + probes, order.end());
+
+    size_t shortlistSize = k * std::max<size_t>(1, index.rerank);
+    std::vector<std::pair<float, uint32_t>> shortlist; // max-heap on approximate distance
+    std::vector<float> lut(index.subspaces * PQ_CENTROIDS), residual(dim);
+    std::vector<uint8_t> quantized(index.subspaces * 16);
+    ScanPQBlockKernel kernel = scanPQBlockKernel();
+    uint16_t sums[PQ_BLOCK];
+    for (size_t p = 0; p < probes; p++) {
+        uint32_t list = order[p].second;
+        const float* c = &index.coarse[static_cast<size_t>(list) * dim];
+        // L2 compares the residual query against residual codebooks; dot splits <q, x> into <q, c> + <q, residual>
+        float base = 0.0f;
+        if (dot) {
+            base = -dotProduct(q.data(), c, dim);
+            residual = q;
+        } else {
+            for (size_t d = 0; d < dim; d++) residual[d] = q[d] - c[d];
+        }
+        float lowest = 0.0f, widest = 0.0f;
+        std::vector<float> minimum(index.subspaces);
+        for (size_t m = 0; m < index.subspaces; m++) {
+            float lo = std::numeric_limits<float>::max(), hi = std::numeric_limits<float>::lowest();
+            for (size_t j = 0; j < PQ_CENTROIDS; j++) {
+                const float* centroid = &index.codebooks[(m * PQ_CENTROIDS + j) * subDim];
+                float v = dot ? -dotProduct(&residual[m * subDim], centroid, subDim) : squaredDistance(&residual[m * subDim], centroid, subDim);
+                lut[m * PQ_CENTROIDS + j] = v;
+                lo = std::min(lo, v);
+                hi = std::max(hi, v);
+            }
+            minimum[m] = lo;
+            lowest += lo;
+            widest = std::max(widest, hi - lo);
+        }
+        // one shared scale keeps the per-subspace entries additive once quantized to bytes
+        float scale = widest > 0.0f ? 255.0f / widest : 0.0f;
+        for (size_t m = 0; m < index.subspaces; m++) {
+            for (size_t j = 0; j < PQ_CENTROIDS; j++) {
+                quantized[m * 16 + j] = static_cast<uint8_t>(std::lround((lut[m * PQ_CENTROIDS + j] - minimum[m]) * scale));
+            }
+        }
+        for (uint32_t block = index.listBlocks[list]; block < index.listBlocks[list + 1]; block++) {
+            kernel(&index.codes[static_cast<size_t>(block) * index.subspaces * 16], quantized.data(), index.subspaces, sums);
+            for (size_t j = 0; j < PQ_BLOCK; j++) {
+                uint32_t id = index.ids[static_cast<size_t>(block) * PQ_BLOCK + j];
+                if (id == std::numeric_limits<uint32_t>::max() || id == exclude) continue;
+                float approx = base + lowest + (scale > 0.0f ? sums[j] / scale : 0.0f);
+                if (shortlist.size() == shortlistSize) {
+                    if (approx >= shortlist.front().first) continue;
+                    std::pop_heap(shortlist.begin(), shortlist.end());
+                    shortlist.pop_back();
+                }
+                shortlist.emplace_back(approx, id);
+                std::push_heap(shortlist.begin(), shortlist.end());
+            }
+        }
+    }
+
+    // exact re-rank of the shortlist
+    std::vector<float> exact(table.stride), padded(table.stride, 0.0f);
+    std::copy_n(query, table.dim, padded.begin());
+    for (const auto& [approx, id] : shortlist) {
+        if (!table.exactRow(id, exact.data())) continue;
+        float score = dot ? dotProduct(exact.data(), padded.data(), table.stride) : -squaredDistance(exact.data(), padded.data(), table.stride);
+        result.emplace_back(id, score);
+    }
+    size_t keep = std::min(k, result.size());
+    std::partial_sort(result.begin(), result.begin() + keep, result.end(), [](const auto& a, const auto& b) {
+        return a.second > b.second || (a.second == b.second && a.first < b.first);
+    });
+    result.resize(keep);
+    return result;
+}
+
+double tunePQ(PQIndex& index, const EmbeddingTable& table, EmbeddingMetric metric, double targetRecall) {
+    // raises nprobe, then the re-rank factor, until recall@10 on sample queries meets targetRecall against the exact scan;
+    // needs the in-memory vectors, so call it before releaseVectors()
+    const size_t k = 10, queries = 50;
+    std::vector<uint32_t> sampleIds;
+    size_t count = table.hasEmbedding.size();
+    for (size_t i = 0; i < count && sampleIds.size() < queries; i += std::max<size_t>(1, count / queries)) {
+        if (table.hasEmbedding[i]) sampleIds.push_back(static_cast<uint32_t>(i));
+    }
+    if (sampleIds.empty() || index.subspaces == 0) return 0.0;
+    std::vector<std::vector<uint32_t>> truth;
+    for (uint32_t id : sampleIds) {
+        std::vector<uint32_t> ids;
+        for (const auto& [n, score] : nearestEmbeddings(table, table.row(id), k, metric, id)) ids.push_back(n);
+        std::sort(ids.begin(), ids.end());
+        truth.push_back(std::move(ids));
+    }
+    auto measure = [&]() {
+        size_t hits = 0, total = 0;
+        for (size_t q = 0; q < sampleIds.size(); q++) {
+            for (const auto& [n, score] : searchPQ(index, table, table.row(sampleIds[q]), k, metric, sampleIds[q])) {
+                hits += std::binary_search(truth[q].begin(), truth[q].end(), n);
+            }
+            total += truth[q].size();
+        }
+        return total ? static_cast<double>(hits) / total : 1.0;
+    };
+    double recall = 0.0;
+    for (index.rerank = 4; index.rerank <= 64; index.rerank *= 2) {
+        for (index.nprobe = 1; ; index.nprobe = std::min(index.lists, index.nprobe * 2)) {
+            recall = measure();
+            if (recall >= targetRecall || index.nprobe == index.lists) break;
+        }
+        if (recall >= targetRecall) break;
+    }
+    index.rerank = std::min<size_t>(index.rerank, 64);
+    return recall;
+}
+
+uint64_t embeddingFingerprint(const std::vector<Song>& songs, const EmbeddingTable& table) {
+    // changes whenever the catalog order, membership or embedding dimension changes
+    uint64_t h = mix64(table.dim);
+    for (const Song& s : songs) h = mix64(h ^ songKeyHash(s.artist, s.title) ^ (table.hasEmbedding[s.id] ? 1 : 0));
+    return h;
+}
+
+struct HNSWVisited {
+    // per-thread visited marks; bumping the generation clears them in O(1)
+    std::vector<uint32_t> marks;
+    uint32_t generation = 0;
+
+    void reset(size_t count) {
+        if (marks.size() != count || ++generation == 0) {
+            marks.assign(count, 0);
+            generation = 1;
+        }
+    }
+    bool visit(uint32_t id) {
+        if (marks[id] == generation) return false;
+        marks[id] = generation;
+        return true;
+    }
+};
+
+template <typename Links>
+std::vector<std::pair<float, uint32_t>> hnswSearchLayer(const EmbeddingTable& table, const float* query, uint32_t start, size_t ef, int level, Links&& neighborsOf) {
+    // best-first search on one level; returns up to ef (distance, id) pairs, nearest first.
+    // neighborsOf(id, level, out) copies a song's links so the build can read them under a lock.
+    thread_local HNSWVisited visited;
+    visited.reset(table.hasEmbedding.size());
+    std::priority_queue<std::pair<float, uint32_t>, std::vector<std::pair<float, uint32_t>>, std::greater<>> candidates;
+    std::priority_queue<std::pair<float, uint32_t>> found;
+    float startDist = squaredDistance(query, table.row(start), table.stride);
+    candidates.emplace(startDist, start);
+    found.emplace(startDist, start);
+    visited.visit(start);
+    std::vector<uint32_t> neighbors;
+    while (!candidates.empty()) {
+        auto [dist, id] = candidates.top();
+        if (dist > found.top().first && found.size() >= ef) break;
+        candidates.pop();
+        neighborsOf(id, level, neighbors);
+        for (uint32_t n : neighbors) {
+            if (!visited.visit(n)) continue;
+            float d = squaredDistance(query, table.row(n), table.stride);
+            if (found.size() < ef || d < found.top().first) {
+                candidates.emplace(d, n);
+                found.emplace(d, n);
+                if (found.size() > ef) found.pop();
+            }
+        }
+    }
+    std::vector<std::pair<float, uint32_t>> result(found.size());
+    for (size_t i = result.size(); i-- > 0; found.pop()) result[i] = found.top();
+    return result;
+}
+
+std::vector<uint32_t> hnswSelectNeighbors(const EmbeddingTable& table, const std::vector<std::pair<float, uint32_t>>& candidates, size_t limit) {
+    // HNSW heuristic: keep a candidate only if it is closer to the new song than to every neighbor kept so far,
+    // then top up with the nearest rejected ones so sparse regions stay connected
+    std::vector<uint32_t> selected, rejected;
+    for (const auto& [dist, id] : candidates) {
+        if (selected.size() >= limit) break;
+        bool keep = true;
+        for (uint32_t s : selected) {
+            if (squaredDistance(table.row(id), table.row(s), table.stride) < dist) {
+                keep = false;
+                break;
+            }
+        }
+        (keep ? selected : rejected).push_back(id);
+    }
+    for (size_t i = 0; i < rejected.size() && selected.size() < limit; i++) selected.push_back(rejected[i]);
+    return selected;
+}
+
+HNSWIndex buildHNSW(const EmbeddingTable& table, uint64_t fingerprint) {
+    // inserts songs in parallel; links of each song are guarded by a striped lock, the entry point by a global one
+    HNSWIndex index;
+    index.count = table.hasEmbedding.size();
+    index.dim = table.dim;
+    index.fingerprint = fingerprint;
+    index.levels.assign(index.count, -1);
+    index.links0.assign(index.count * 2 * HNSW_M, HNSW_NONE);
+    index.upperLinks.resize(index.count);
+    std::vector<uint32_t> order;
+    std::mt19937_64 rng(42);
+    double levelMult = 1.0 / std::log(static_cast<double>(HNSW_M));
+    std::uniform_real_distribution<double> uniform(std::numeric_limits<double>::min(), 1.0);
+    for (uint32_t i = 0; i < index.count; i++) {
+        if (!table.hasEmbedding[i]) continue;
+        int level = std::min(30, static_cast<int>(-std::log(uniform(rng)) * levelMult));
+        index.levels[i] = static_cast<int8_t>(level);
+        index.upperLinks[i].assign(static_cast<size_t>(level) * HNSW_M, HNSW_NONE);
+        order.push_back(i);
+    }
+    if (order.empty()) return index;
+
+    std::vector<std::mutex> stripes(HNSW_LOCK_STRIPES);
+    std::mutex entryMutex;
+    auto neighborsOf = [&](uint32_t id, int level, std::vector<uint32_t>& out) {
+        std::lock_guard<std::mutex> lock(stripes[id % HNSW_LOCK_STRIPES]);
+        const uint32_t* l = index.links(id, level);
+        out.clear();
+        for (size_t i = 0; i < HNSWIndex::capacity(level) && l[i] != HNSW_NONE; i++) out.push_back(l[i]);
+    };
+    auto insert = [&](uint32_t id) {
+        int level = index.levels[id];
+        uint32_t entry;
+        int top;
+        {
+            std::lock_guard<std::mutex> lock(entryMutex);
+            entry = index.entry;
+            top = index.maxLevel;
+            if (entry == HNSW_NONE) {
+                index.entry = id;
+                index.maxLevel = level;
+                return;
+            }
+        }
+        const float* q = table.row(id);
+        for (int lc = top; lc > level; lc--) entry = hnswSearchLayer(table, q, entry, 1, lc, neighborsOf)[0].second;
+        for (int lc = std::min(level, top); lc >= 0; lc--) {
+            auto found = hnswSearchLayer(table, q, entry, HNSW_EF_CONSTRUCTION, lc, neighborsOf);
+            entry = found[0].second;
+            std::vector<uint32_t> chosen = hnswSelectNeighbors(table, found, HNSW_M);
+            {
+                std::lock_guard<std::mutex> lock(stripes[id % HNSW_LOCK_STRIPES]);
+                std::copy(chosen.begin(), chosen.end(), index.links(id, lc));
+            }
+            // back-links, shrinking the neighbor's list with the same heuristic when it overflows
+            for (uint32_t n : chosen) {
+                std::lock_guard<std::mutex> lock(stripes[n % HNSW_LOCK_STRIPES]);
+                uint32_t* l = index.links(n, lc);
+                size_t cap = HNSWIndex::capacity(lc), used = 0;
+                while (used < cap && l[used] != HNSW_NONE) used++;
+                if (used < cap) {
+                    l[used] = id;
+                    continue;
+                }
+                std::vector<std::pair<float, uint32_t>> pool;
+                for (size_t i = 0; i < cap; i++) pool.emplace_back(squaredDistance(table.row(n), table.row(l[i]), table.stride), l[i]);
+                pool.emplace_back(squaredDistance(table.row(n), q, table.stride), id);
+                std::sort(pool.begin(), pool.end());
+                std::vector<uint32_t> kept = hnswSelectNeighbors(table, pool, cap);
+                std::fill(l, l + cap, HNSW_NONE);
+                std::copy(kept.begin(), kept.end(), l);
+            }
+        }
+        if (level > top) {
+            std::lock_guard<std::mutex> lock(entryMutex);
+            if (level > index.maxLevel) {
+                index.maxLevel = level;
+                index.entry = id;
+            }
+        }
+    };
+    // a small serial prefix gives the parallel inserts a connected graph to start from
+    size_t serial = std::min<size_t>(order.size(), 256);
+    for (size_t i = 0; i < serial; i++) insert(order[i]);
+    parallelFor(order.size() - serial, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) insert(order[serial + i]);
+    }, 64);
+    return index;
+}
+
+std::vector<std::pair<uint32_t, float>> searchHNSW(const HNSWIndex& index, const EmbeddingTable& table, const float* query, size_t k, size_t ef, uint32_t exclude) {
+    // greedy descent through the upper levels, then an ef-wide search on level 0; scores are negated squared
+    // distances so results line up with nearestEmbeddings(..., EmbeddingMetric::L2, ...)
+    std::vector<std::pair<uint32_t, float>> result;
+    if (index.entry == HNSW_NONE || k == 0) return result;
+    std::vector<float> q(table.stride, 0.0f);
+    std::copy_n(query, table.dim, q.begin());
+    auto neighborsOf = [&](uint32_t id, int level, std::vector<uint32_t>& out) {
+        const uint32_t* l = index.links(id, level);
+        out.clear();
+        for (size_t i = 0; i < HNSWIndex::capacity(level) && l[i] != HNSW_NONE; i++) out.push_back(l[i]);
+    };
+    uint32_t entry = index.entry;
+    for (int lc = index.maxLevel; lc > 0; lc--) entry = hnswSearchLayer(table, q.data(), entry, 1, lc, neighborsOf)[0].second;
+    for (const auto& [dist, id] : hnswSearchLayer(table, q.data(), entry, std::max(ef, k + 1), 0, neighborsOf)) {
+        if (id == exclude) continue;
+        result.emplace_back(id, -dist);
+        if (result.size() == k) break;
+    }
+    return result;
+}
+
+double measureHNSWRecall(const HNSWIndex& index, const EmbeddingTable& table, size_t ef) {
+    // recall@10 of searchHNSW against the exact L2 scan over up to 50 evenly spaced songs
+    const size_t k = 10, queries = 50;
+    size_t hits = 0, total = 0;
+    for (size_t i = 0; i < index.count; i += std::max<size_t>(1, index.count / queries)) {
+        if (!table.hasEmbedding[i]) continue;
+        uint32_t id = static_cast<uint32_t>(i);
+        std::vector<uint32_t> truth;
+        for (const auto& [n, score] : nearestEmbeddings(table, table.row(id), k, EmbeddingMetric::L2, id)) truth.push_back(n);
+        std::sort(truth.begin(), truth.end());
+        for (const auto& [n, score] : searchHNSW(index, table, table.row(id), k, ef, id)) hits += std::binary_search(truth.begin(), truth.end(), n);
+        total += truth.size();
+    }
+    return total ? static_cast<double>(hits) / total : 1.0;
+}
+
+bool saveHNSW(const HNSWIndex& index, const std::filesystem::path& path) {
+    // binary layout: magic, header fields, levels, level-0 links, then each song's upper links
+    std::ofstream out(path, std::ios::binary);
+    if (!out) return false;
+    auto put = [&](const void* p, size_t n) { out.write(static_cast<const char*>(p), static_cast<std::streamsize>(n)); };
+    const char magic[8] = {'H', 'N', 'S', 'W', '0', '0', '0', '1'};
+    uint64_t header[5] = {index.count, index.dim, HNSW_M, index.fingerprint, index.entry};
+    int32_t maxLevel = index.maxLevel;
+    put(magic, sizeof(magic));
+    put(header, sizeof(header));
+    put(&maxLevel, sizeof(maxLevel));
+    put(index.levels.data(), index.levels.size());
+    put(index.links0.data(), index.links0.size() * sizeof(uint32_t));
+    for (const auto& upper : index.upperLinks) put(upper.data(), upper.size() * sizeof(uint32_t));
+    return static_cast<bool>(out);
+}
+
+bool loadHNSW(HNSWIndex& index, const std::filesystem::path& path, uint64_t fingerprint, size_t count, size_t dim) {
+    // reads a graph written by saveHNSW; rejects it when it was built for a different catalog or embedding file
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    auto get = [&](void* p, size_t n) { return static_cast<bool>(in.read(static_cast<char*>(p), static_cast<std::streamsize>(n))); };
+    char magic[8];
+    uint64_t header[5];
+    int32_t maxLevel;
+    if (!get(magic, sizeof(magic)) || std::string_view(magic, 8) != "HNSW0001" || !get(header, sizeof(header)) || !get(&maxLevel, sizeof(maxLevel))) return false;
+    if (header[0] != count || header[1] != dim || header[2] != HNSW_M || header[3] != fingerprint) return false;
+    HNSWIndex loaded;
+    loaded.count = count;
+    loaded.dim = dim;
+    loaded.fingerprint = fingerprint;
+    loaded.entry = static_cast<uint32_t>(header[4]);
+    loaded.maxLevel = maxLevel;
+    loaded.levels.resize(count);
+    loaded.links0.resize(count * 2 * HNSW_M);
+    loaded.upperLinks.resize(count);
+    if (!get(loaded.levels.data(), count) || !get(loaded.links0.data(), loaded.links0.size() * sizeof(uint32_t))) return false;
+    for (size_t i = 0; i < count; i++) {
+        loaded.upperLinks[i].resize(static_cast<size_t>(std::max<int>(0, loaded.levels[i])) * HNSW_M);
+        if (!get(loaded.upperLinks[i].data(), loaded.upperLinks[i].size() * sizeof(uint32_t))) return false;
+    }
+    index = std::move(loaded);
+    return true;
+}
+
+std::vector<Song> recommendSongs(const std::vector<Song>& songs, const Song& seed, int margin, bool useEnergy, bool useDance, bool useAcoustic, bool prioritizeSearch, const std::string& term) {
+    // create song recommendation vector, utilizes seed song; the scan itself is recommendBatch's, on the scheduler
+    TraceScope trace("recommendSongs");
+    std::vector<Song> recommendations;
+    for (uint32_t id : recommendBatch(songs, {BatchQuery{seed, margin, useEnergy, useDance, useAcoustic, prioritizeSearch, term}})[0]) recommendations.push_back(songs[id]);
+    return recommendations;
+}
+
+std::vector<std::vector<uint32_t>> recommendBatch(const std::vector<Song>& songs, const std::vector<BatchQuery>& queries, const std::function<bool()>& cancelled) {
+    // returns, per query, the ids recommendSongs() would have matched, in catalog order; once cancelled() turns
+    // true the remaining blocks are skipped and the partial result should be discarded
+    StageTimer timer(Stage::Filter);
+    TraceScope trace("recommendBatch");
+    struct Box { int lo[3]; int hi[3]; bool filterTerm; };
+    std::vector<Box> boxes(queries.size());
+    for (size_t q = 0; q < queries.size(); q++) {
+        const BatchQuery& query = queries[q];
+        const bool enabled[3] = {query.useEnergy, query.useDance, query.useAcoustic};
+        const int seed[3] = {query.seed.energy, query.seed.danceability, query.seed.acousticness};
+        for (int f = 0; f < 3; f++) {
+            boxes[q].lo[f] = enabled[f] ? seed[f] - query.margin : std::numeric_limits<int>::min();
+            boxes[q].hi[f] = enabled[f] ? seed[f] + query.margin : std::numeric_limits<int>::max();
+        }
+        boxes[q].filterTerm = query.prioritizeSearch && !query.term.empty();
+    }
+
+    size_t blocks = (songs.size() + BATCH_BLOCK - 1) / BATCH_BLOCK;
+    std::mutex partsMutex;
+    std::vector<std::pair<size_t, std::vector<std::vector<uint32_t>>>> parts; // (first block, per-query ids)
+    parallelFor(blocks, [&](size_t beginBlock, size_t endBlock) {
+        // the per-query id lists outlive the task; only the block scratch comes from the arena
+        std::vector<std::vector<uint32_t>> local(queries.size());
+        QueryArenaScope scope;
+        std::pmr::memory_resource* arena = queryMemory();
+        std::pmr::vector<int> energy(BATCH_BLOCK, arena), dance(BATCH_BLOCK, arena), acoustic(BATCH_BLOCK, arena);
+        std::pmr::vector<uint8_t> hit(BATCH_BLOCK, arena);
+        for (size_t block = beginBlock; block < endBlock; block++) {
+            if (cancelled && cancelled()) break;
+            size_t first = block * BATCH_BLOCK, count = std::min(BATCH_BLOCK, songs.size() - first);
+            for (size_t j = 0; j < count; j++) {
+                energy[j] = songs[first + j].energy;
+                dance[j] = songs[first + j].danceability;
+                acoustic[j] = songs[first + j].acousticness;
+            }
+            for (size_t q = 0; q < queries.size(); q++) {
+                const Box& box = boxes[q];
+                // branch-free compare pass the compiler can vectorize, then compact the hits
+                for (size_t j = 0; j < count; j++) {
+                    hit[j] = (energy[j] >= box.lo[0]) & (energy[j] <= box.hi[0]) & (dance[j] >= box.lo[1]) & (dance[j] <= box.hi[1])
+                           & (acoustic[j] >= box.lo[2]) & (acoustic[j] <= box.hi[2]);
+                }
+                for (size_t j = 0; j < count; j++) {
+                    if (!hit[j]) continue;
+                    const Song& s = songs[first + j];
+                    if (box.filterTerm && s.title.find(queries[q].term) == std::string::npos && s.artist.find(queries[q].term) == std::string::npos) continue;
+                    local[q].push_back(static_cast<uint32_t>(first + j));
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock(partsMutex);
+        parts.emplace_back(beginBlock, std::move(local));
+    }, 4);
+
+    std::sort(parts.begin(), parts.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    std::vector<std::vector<uint32_t>> results(queries.size());
+    for (size_t q = 0; q < queries.size(); q++) {
+        for (auto& part : parts) results[q].insert(results[q].end(), part.second[q].begin(), part.second[q].end());
+    }
+    return results;
+}
+
+Song playlistCentroid(const std::vector<Song>& songs, const std::vector<uint32_t>& seedIds) {
+    // average feature values of the playlist, as a stand-in seed for centroid queries and "Most Similar" sorting
+    Song centroid;
+    centroid.id = std::numeric_limits<uint32_t>::max();
+    centroid.artist = "Playlist";
+    centroid.title = std::to_string(seedIds.size()) + " songs";
+    long energy = 0, dance = 0, acoustic = 0;
+    for (uint32_t id : seedIds) {
+        energy += songs[id].energy;
+        dance += songs[id].danceability;
+        acoustic += songs[id].acousticness;
+    }
+    long n = std::max<long>(1, static_cast<long>(seedIds.size()));
+    centroid.energy = static_cast<int>(std::lround(static_cast<double>(energy) / n));
+    centroid.danceability = static_cast<int>(std::lround(static_cast<double>(dance) / n));
+    centroid.acousticness = static_cast<int>(std::lround(static_cast<double>(acoustic) / n));
+    return centroid;
+}
+
+std::vector<Song> recommendForPlaylist(const std::vector<Song>& songs, const std::vector<uint32_t>& seedIds, PlaylistMode mode, int margin, bool useEnergy, bool useDance, bool useAcoustic, bool prioritizeSearch, const std::string& term) {
+    // recommendations near any (union), all (intersection) or the average (centroid) of the seeds, in one catalog scan.
+    // Intersection and centroid reduce to a single box. Union marks every box in a coverage grid over the enabled
+    // features (difference array + prefix sum), so each song is one lookup however many seeds there are.
+    std::vector<Song> recommendations;
+    if (seedIds.empty()) return recommendations;
+    const bool enabled[3] = {useEnergy, useDance, useAcoustic};
+    auto features = [](const Song& s) { return std::array<int, 3>{s.energy, s.danceability, s.acousticness}; };
+    std::array<int, 3> lo{0, 0, 0}, hi{100, 100, 100};
+    std::vector<int32_t> coverage;
+    std::array<size_t, 3> extent{1, 1, 1}, step{0, 0, 0};
+    if (mode == PlaylistMode::Centroid) {
+        std::array<int, 3> c = features(playlistCentroid(songs, seedIds));
+        for (int f = 0; f < 3; f++) {
+            if (enabled[f]) lo[f] = c[f] - margin, hi[f] = c[f] + margin;
+        }
+    } else if (mode == PlaylistMode::Intersection) {
+        lo = {std::numeric_limits<int>::min(), std::numeric_limits<int>::min(), std::numeric_limits<int>::min()};
+        hi = {std::numeric_limits<int>::max(), std::numeric_limits<int>::max(), std::numeric_limits<int>::max()};
+        for (uint32_t id : seedIds) {
+            std::array<int, 3> v = features(songs[id]);
+            for (int f = 0; f < 3; f++) {
+                if (enabled[f]) lo[f] = std::max(lo[f], v[f] - margin), hi[f] = std::min(hi[f], v[f] + margin);
+            }
+        }
+    } else {
+        // disabled features collapse to a single cell; enabled ones get 102 (values 0-100 plus the difference spill-over)
+        size_t cells = 1;
+        for (int f = 2; f >= 0; f--) {
+            step[f] = cells;
+            extent[f] = enabled[f] ? 102 : 1;
+            cells *= extent[f];
+        }
+        coverage.assign(cells, 0);
+        for (uint32_t id : seedIds) {
+            std::array<int, 3> v = features(songs[id]);
+            std::array<int, 3> from{0, 0, 0}, to{0, 0, 0}; // half-open box in cell coordinates
+            bool empty = false;
+            for (int f = 0; f < 3; f++) {
+                if (!enabled[f]) {
+                    to[f] = 1;
+                    continue;
+                }
+                from[f] = std::max(0, v[f] - margin);
+                to[f] = std::min(100, v[f] + margin) + 1;
+                empty |= from[f] >= to[f];
+            }
+            if (empty) continue;
+            for (int corner = 0; corner < 8; corner++) {
+                size_t cell = 0;
+                int sign = 1;
+                bool skip = false;
+                for (int f = 0; f < 3; f++) {
+                    int c = (corner >> f) & 1 ? to[f] : from[f];
+                    if ((corner >> f) & 1) sign = -sign;
+                    if (static_cast<size_t>(c) >= extent[f]) skip = true;
+                    cell += c * step[f];
+                }
+                if (!skip) coverage[cell] += sign;
+            }
+        }
+        for (int f = 0; f < 3; f++) {
+            if (!enabled[f]) continue;
+            for (size_t cell = 0; cell < cells; cell++) {
+                if ((cell / step[f]) % extent[f] != 0) coverage[cell] += coverage[cell - step[f]];
+            }
+        }
+    }
+
+    std::vector<uint32_t> sortedSeeds(seedIds);
+    std::sort(sortedSeeds.begin(), sortedSeeds.end());
+    for (const auto& s : songs) {
+        if (prioritizeSearch && term.size() > 0) {
+            if (s.title.find(term) == std::string::npos && s.artist.find(term) == std::string::npos) continue;
+        }
+        std::array<int, 3> v = features(s);
+        bool match = true;
+        if (mode == PlaylistMode::Union) {
+            size_t cell = 0;
+            for (int f = 0; f < 3; f++) {
+                if (enabled[f]) cell += std::clamp(v[f], 0, 100) * step[f];
+            }
+            match = coverage[cell] > 0;
+        } else {
+            for (int f = 0; f < 3; f++) {
+                if (enabled[f] && (v[f] < lo[f] || v[f] > hi[f])) match = false;
+            }
+        }
+        // songs already on the playlist are not recommendations
+        if (match && !std::binary_search(sortedSeeds.begin(), sortedSeeds.end(), s.id)) recommendations.push_back(s);
+    }
+    return recommendations;
+}
+
+double similarityScore(const Song& a, const Song& seed, bool useEnergy, bool useDance, bool useAcoustic) {
+    // used for sorting the recommendations based on their composite similarity
+    double score = 0;
+    if (useEnergy) score += std::abs(a.energy - seed.energy);
+    if (useDance) score += std::abs(a.danceability - seed.danceability);
+    if (useAcoustic) score += std::abs(a.acousticness - seed.acousticness);
+    return score;
+}
+
+int featureValue(const Song& s, int feature) {
+    return feature == 0 ? s.energy : feature == 1 ? s.danceability : s.acousticness;
+}
+
+FeatureColumns buildFeatureColumns(const std::vector<Song>& songs, const std::vector<uint8_t>& tombstones) {
+    // counting sort per feature, leaving out tombstoned songs
+    FeatureColumns columns;
+    if (songs.empty()) return columns;
+    auto live = [&](uint32_t id) { return id >= tombstones.size() || !tombstones[id]; };
+    for (int f = 0; f < 3; f++) {
+        auto [minIt, maxIt] = std::minmax_element(songs.begin(), songs.end(), [f](const Song& a, const Song& b) { return featureValue(a, f) < featureValue(b, f); });
+        columns.lo[f] = featureValue(*minIt, f);
+        columns.hi[f] = featureValue(*maxIt, f);
+        Column<uint32_t>& offsets = columns.offsets[f];
+        offsets.assign(columns.hi[f] - columns.lo[f] + 2, 0);
+        for (const Song& s : songs) if (live(s.id)) offsets[featureValue(s, f) - columns.lo[f] + 1]++;
+        for (size_t v = 1; v < offsets.size(); v++) offsets[v] += offsets[v - 1];
+        columns.ids[f].resize(offsets.back());
+        std::vector<uint32_t> cursor(offsets.begin(), offsets.end() - 1);
+        for (uint32_t id = 0; id < songs.size(); id++) if (live(id)) columns.ids[f][cursor[featureValue(songs[id], f) - columns.lo[f]]++] = id;
+    }
+    return columns;
+}
+
+bool marginMatches(const MarginQuery& query, const Song& s) {
+    for (int f = 0; f < 3; f++) {
+        if (query.use[f] && std::abs(featureValue(s, f) - featureValue(query.seed, f)) > query.margin) return false;
+    }
+    return !query.filterTerm || s.title.find(query.term) != std::string::npos || s.artist.find(query.term) != std::string::npos;
+}
+
+std::vector<uint32_t> updateMargin(const std::vector<Song>& songs, const FeatureColumns& columns, MarginQuery& query, int margin) {
+    // moves query to the new margin in place; returns the ids that entered the result, in catalog order
+    std::vector<uint32_t> added;
+    int old = query.margin;
+    query.margin = margin;
+    if (margin == old || !(query.use[0] || query.use[1] || query.use[2])) return added;
+    if (margin < old) {
+        // the new box sits inside the old one, so results only leave
+        std::erase_if(query.ids, [&](uint32_t id) { return !marginMatches(query, songs[id]); });
+        return added;
+    }
+    // a song in the shell is outside the old margin on at least one feature; it is collected under the first such
+    // feature so songs in corners of the shell are not added twice
+    for (int f = 0; f < 3; f++) {
+        if (!query.use[f] || columns.offsets[f].empty()) continue;
+        int center = featureValue(query.seed, f);
+        for (int d = old + 1; d <= margin; d++) {
+            for (int v : {center - d, center + d}) {
+                if (v < columns.lo[f] || v > columns.hi[f]) continue;
+                const uint32_t* first = columns.ids[f].data() + columns.offsets[f][v - columns.lo[f]];
+                const uint32_t* last = columns.ids[f].data() + columns.offsets[f][v - columns.lo[f] + 1];
+                for (const uint32_t* id = first; id != last; ++id) {
+                    const Song& s = songs[*id];
+                    bool earlier = false;
+                    for (int g = 0; g < f && !earlier; g++) earlier = query.use[g] && std::abs(featureValue(s, g) - featureValue(query.seed, g)) > old;
+                    if (!earlier && marginMatches(query, s)) added.push_back(*id);
+                }
+            }
+        }
+    }
+    std::sort(added.begin(), added.end());
+    size_t kept = query.ids.size();
+    query.ids.insert(query.ids.end(), added.begin(), added.end());
+    std::inplace_merge(query.ids.begin(), query.ids.begin() + kept, query.ids.end());
+    return added;
+}
+
+NeighborGraph buildFeatureNeighborGraph(const std::vector<Song>& songs, size_t k) {
+    // buckets songs into grid cells, then searches each song's surrounding cells in growing rings in parallel,
+    // skipping cells that cannot beat the current k-th neighbor and stopping once a whole ring cannot
+    int width = std::clamp(static_cast<int>(std::lround(101.0 / std::cbrt(std::max(1.0, songs.size() / FEATURE_CELL_SONGS)))), 1, 101);
+    int grid = 100 / width + 1;
+    auto cellOf = [width](int v) { return std::clamp(v, 0, 100) / width; };
+    auto cellIndex = [grid](int e, int d, int a) { return (static_cast<size_t>(e) * grid + d) * grid + a; };
+    // L1 distance from a feature value to the nearest value inside cell c on one axis
+    auto gap = [width](int v, int c) { return std::max({0, c * width - v, v - (c * width + width - 1)}); };
+    size_t cells = static_cast<size_t>(grid) * grid * grid;
+    std::vector<uint32_t> cellStart(cells + 1, 0), cellSongs(songs.size());
+    for (const Song& s : songs) cellStart[cellIndex(cellOf(s.energy), cellOf(s.danceability), cellOf(s.acousticness)) + 1]++;
+    for (size_t c = 0; c < cells; c++) cellStart[c + 1] += cellStart[c];
+    std::vector<uint32_t> fill(cellStart.begin(), cellStart.end() - 1);
+    for (const Song& s : songs) cellSongs[fill[cellIndex(cellOf(s.energy), cellOf(s.danceability), cellOf(s.acousticness))]++] = s.id;
+
+    NeighborGraph graph;
+    size_t perSong = std::min(k, songs.empty() ? 0 : songs.size() - 1);
+    graph.offsets.resize(songs.size() + 1);
+    for (size_t i = 0; i <= songs.size(); i++) graph.offsets[i] = static_cast<uint32_t>(i * perSong);
+    if (perSong == 0) return graph; // a single song (a shard can own just one) or k == 0: every row is empty
+    graph.neighbors.resize(songs.size() * perSong);
+    parallelFor(songs.size(), [&](size_t begin, size_t end) {
+        std::vector<std::pair<int, uint32_t>> heap; // max-heap on (distance, id)
+        for (size_t i = begin; i < end; i++) {
+            const Song& seed = songs[i];
+            int ce = cellOf(seed.energy), cd = cellOf(seed.danceability), ca = cellOf(seed.acousticness);
+            heap.clear();
+            auto worst = [&]() { return heap.size() == perSong ? heap.front().first : std::numeric_limits<int>::max(); };
+            for (int ring = 0; ring < grid; ring++) {
+                // every song in ring r differs by at least (r - 1) * width + 1 on some feature
+                if (ring > 0 && worst() < (ring - 1) * width + 1) break;
+                for (int e = std::max(0, ce - ring); e <= std::min(grid - 1, ce + ring); e++) {
+                    for (int d = std::max(0, cd - ring); d <= std::min(grid - 1, cd + ring); d++) {
+                        for (int a = std::max(0, ca - ring); a <= std::min(grid - 1, ca + ring); a++) {
+                            if (std::max({std::abs(e - ce), std::abs(d - cd), std::abs(a - ca)}) != ring) continue;
+                            if (gap(seed.energy, e) + gap(seed.danceability, d) + gap(seed.acousticness, a) > worst()) continue;
+                            size_t c = cellIndex(e, d, a);
+                            for (uint32_t j = cellStart[c]; j < cellStart[c + 1]; j++) {
+                                uint32_t id = cellSongs[j];
+                                if (id == seed.id) continue;
+                                const Song& s = songs[id];
+                                int dist = std::abs(s.energy - seed.energy) + std::abs(s.danceability - seed.danceability) + std::abs(s.acousticness - seed.acousticness);
+                                std::pair<int, uint32_t> entry(dist, id);
+                                if (heap.size() == perSong) {
+                                    if (!(entry < heap.front())) continue;
+                                    std::pop_heap(heap.begin(), heap.end());
+                                    heap.pop_back();
+                                }
+                                heap.push_back(entry);
+                                std::push_heap(heap.begin(), heap.end());
+                            }
+                        }
+                    }
+                }
+            }
+            std::sort_heap(heap.begin(), heap.end());
+            for (size_t n = 0; n < heap.size(); n++) graph.neighbors[graph.offsets[i] + n] = heap[n].second;
+        }
+    });
+    return graph;
+}
+
+struct LogChunk {
+    // session-aligned byte range of one mapped log file
+    const MappedFile* file;
+    size_t begin;
+    size_t end;
+};
+
+std::string_view logSession(std::string_view line) {
+    // session id column of a log line
+    return line.substr(0, line.find('\t'));
+}
+
+std::vector<LogChunk> splitLog(const MappedFile& file) {
+    // cuts a log into about CF_CHUNK_BYTES pieces, moving each cut forward to the next session boundary
+    std::vector<LogChunk> chunks;
+    std::string_view data = file.view();
+    size_t begin = 0;
+    while (begin < data.size()) {
+        size_t cut = begin + CF_CHUNK_BYTES;
+        if (cut >= data.size()) {
+            chunks.push_back({&file, begin, data.size()});
+            break;
+        }
+        size_t lineStart = data.find('\n', cut);
+        if (lineStart == std::string_view::npos) {
+            chunks.push_back({&file, begin, data.size()});
+            break;
+        }
+        lineStart++;
+        size_t prevStart = data.rfind('\n', lineStart - 2);
+        prevStart = prevStart == std::string_view::npos ? 0 : prevStart + 1;
+        std::string_view session = logSession(data.substr(prevStart, lineStart - prevStart));
+        while (lineStart < data.size() && logSession(data.substr(lineStart, data.find('\n', lineStart) - lineStart)) == session) {
+            size_t next = data.find('\n', lineStart);
+            lineStart = next == std::string_view::npos ? data.size() : next + 1;
+        }
+        chunks.push_back({&file, begin, lineStart});
+        begin = lineStart;
+    }
+    return chunks;
+}
+
+void evictRarePairs(std::unordered_map<uint64_t, uint32_t>& pairs, size_t target) {
+    // bounds a pair table to target entries by dropping the rarest co-plays, the long tail, first: the threshold is
+    // the count at the cut, and pairs at exactly that count go until the table fits. Halving the table each time keeps
+    // the cost amortized constant per insert
+    if (pairs.size() <= target) return;
+    std::vector<uint32_t> counts;
+    counts.reserve(pairs.size());
+    for (const auto& p : pairs) counts.push_back(p.second);
+    auto cut = counts.begin() + (pairs.size() - target - 1);
+    std::nth_element(counts.begin(), cut, counts.end());
+    uint32_t threshold = *cut;
+    size_t above = std::count_if(counts.begin(), counts.end(), [&](uint32_t n) { return n > threshold; });
+    size_t spare = target - std::min(target, above); // pairs at the threshold that still fit
+    std::erase_if(pairs, [&](const auto& p) {
+        if (p.second != threshold) return p.second < threshold;
+        if (spare == 0) return true;
+        spare--;
+        return false;
+    });
+}
+
+NeighborGraph buildCoPlayGraph(const std::vector<std::filesystem::path>& logs, const std::unordered_map<uint64_t, uint32_t>& idByKey, size_t songCount, size_t topN) {
+    // streams the logs in parallel into per-thread pair tables, merges them by key shard, scores each pair by cosine
+    // similarity of play counts and keeps the topN best per song as a weighted CSR graph
+    std::vector<MappedFile> files(logs.size());
+    std::vector<LogChunk> chunks;
+    for (size_t f = 0; f < logs.size(); f++) {
+        if (!files[f].open(logs[f])) continue;
+        files[f].adviseSequential();
+        for (const LogChunk& c : splitLog(files[f])) chunks.push_back(c);
+    }
+
+    // pair counts by key shard, each bounded to its share of CF_MAX_PAIRS
+    std::vector<std::unordered_map<uint64_t, uint32_t>> merged(CF_SHARDS);
+    std::vector<std::mutex> shardMutexes(CF_SHARDS);
+    std::mutex playsMutex;
+    std::vector<uint64_t> plays(songCount, 0);
+    std::atomic<uint64_t> events{0};
+    parallelFor(chunks.size(), [&](size_t begin, size_t end) {
+        std::unordered_map<uint64_t, uint32_t> pairs;
+        std::vector<uint64_t> localPlays(songCount, 0);
+        std::string artist, title;
+        uint64_t localEvents = 0;
+        for (size_t c = begin; c < end; c++) {
+            std::string_view data = chunks[c].file->view();
+            std::string_view session;
+            uint32_t window[CF_WINDOW];
+            size_t windowSize = 0, windowHead = 0;
+            for (size_t pos = chunks[c].begin; pos < chunks[c].end;) {
+                size_t eol = std::min(data.find('\n', pos), chunks[c].end);
+                std::string_view line = data.substr(pos, eol - pos);
+                pos = eol + 1;
+                if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+                size_t tab1 = line.find('\t');
+                size_t tab2 = tab1 == std::string_view::npos ? tab1 : line.find('\t', tab1 + 1);
+                if (tab2 == std::string_view::npos) continue;
+                if (line.substr(0, tab1) != session) {
+                    session = line.substr(0, tab1);
+                    windowSize = windowHead = 0;
+                }
+                artist.assign(line.substr(tab1 + 1, tab2 - tab1 - 1));
+                title.assign(line.substr(tab2 + 1, line.find('\t', tab2 + 1) - tab2 - 1));
+                auto it = idByKey.find(songKeyHash(artist, title));
+                if (it == idByKey.end()) continue;
+                uint32_t id = it->second;
+                localEvents++;
+                localPlays[id]++;
+                for (size_t w = 0; w < windowSize; w++) {
+                    // a song repeated within the window still co-occurs with this play once
+                    uint32_t other = window[w];
+                    if (other == id || std::find(window, window + w, other) != window + w) continue;
+                    pairs[(static_cast<uint64_t>(std::min(id, other)) << 32) | std::max(id, other)]++;
+                }
+                window[windowHead] = id;
+                windowHead = (windowHead + 1) % CF_WINDOW;
+                windowSize = std::min(windowSize + 1, CF_WINDOW);
+                if (pairs.size() > CF_MAX_LOCAL_PAIRS) evictRarePairs(pairs, CF_MAX_LOCAL_PAIRS / 2);
+            }
+        }
+        // folds the table into the shared shards as the task ends, so only running tasks hold a local table; a shard
+        // past its share of CF_MAX_PAIRS drops its rarest pairs the same way
+        std::vector<std::vector<std::pair<uint64_t, uint32_t>>> shards(CF_SHARDS);
+        for (const auto& p : pairs) shards[mix64(p.first) % CF_SHARDS].push_back(p);
+        std::unordered_map<uint64_t, uint32_t>().swap(pairs);
+        constexpr size_t shardLimit = CF_MAX_PAIRS / CF_SHARDS;
+        for (size_t shard = 0; shard < CF_SHARDS; shard++) {
+            std::lock_guard<std::mutex> lock(shardMutexes[shard]);
+            for (const auto& [key, count] : shards[shard]) merged[shard][key] += count;
+            if (merged[shard].size() > shardLimit) evictRarePairs(merged[shard], shardLimit / 2);
+            std::vector<std::pair<uint64_t, uint32_t>>().swap(shards[shard]);
+        }
+        std::lock_guard<std::mutex> lock(playsMutex);
+        for (size_t i = 0; i < songCount; i++) plays[i] += localPlays[i];
+        events += localEvents;
+    }, 1);
+
+    // expand each pair into both rows (at most 2 * CF_MAX_PAIRS links), then keep the topN per row
+    NeighborGraph all;
+    all.offsets.assign(songCount + 1, 0);
+    for (const auto& shard : merged) {
+        for (const auto& [key, count] : shard) {
+            all.offsets[(key >> 32) + 1]++;
+            all.offsets[(key & 0xffffffffu) + 1]++;
+        }
+    }
+    for (size_t i = 0; i < songCount; i++) all.offsets[i + 1] += all.offsets[i];
+    all.neighbors.resize(all.offsets[songCount]);
+    all.weights.resize(all.offsets[songCount]);
+    std::vector<uint32_t> fill(all.offsets.begin(), all.offsets.end() - 1);
+    for (auto& shard : merged) {
+        for (const auto& [key, count] : shard) {
+            uint32_t a = static_cast<uint32_t>(key >> 32), b = static_cast<uint32_t>(key & 0xffffffffu);
+            float score = static_cast<float>(count / std::sqrt(static_cast<double>(plays[a]) * plays[b]));
+            all.neighbors[fill[a]] = b;
+            all.weights[fill[a]++] = score;
+            all.neighbors[fill[b]] = a;
+            all.weights[fill[b]++] = score;
+        }
+        std::unordered_map<uint64_t, uint32_t>().swap(shard);
+    }
+
+    NeighborGraph graph;
+    graph.offsets.assign(songCount + 1, 0);
+    for (size_t i = 0; i < songCount; i++) graph.offsets[i + 1] = graph.offsets[i] + static_cast<uint32_t>(std::min<size_t>(topN, all.offsets[i + 1] - all.offsets[i]));
+    graph.neighbors.resize(graph.offsets[songCount]);
+    graph.weights.resize(graph.offsets[songCount]);
+    parallelFor(songCount, [&](size_t begin, size_t end) {
+        std::vector<std::pair<float, uint32_t>> row;
+        for (size_t i = begin; i < end; i++) {
+            row.clear();
+            for (uint32_t j = all.offsets[i]; j < all.offsets[i + 1]; j++) row.emplace_back(all.weights[j], all.neighbors[j]);
+            size_t keep = graph.offsets[i + 1] - graph.offsets[i];
+            std::partial_sort(row.begin(), row.begin() + keep, row.end(), [](const auto& x, const auto& y) {
+                return x.first > y.first || (x.first == y.first && x.second < y.second);
+            });
+            for (size_t n = 0; n < keep; n++) {
+                graph.neighbors[graph.offsets[i] + n] = row[n].second;
+                graph.weights[graph.offsets[i] + n] = row[n].first;
+            }
+        }
+    });
+    std::cout << "Listening logs: " << events << " plays from " << logs.size() << " files, " << graph.neighbors.size() << " co-play links kept\n";
+    return graph;
+}
+
+std::vector<std::filesystem::path> listeningLogs() {
+    // every regular file under resources/logs, in name order
+    std::vector<std::filesystem::path> logs;
+    std::filesystem::path dir = resourcePath("logs");
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+        if (entry.is_regular_file()) logs.push_back(entry.path());
+    }
+    std::sort(logs.begin(), logs.end());
+    return logs;
+}
+
+int partition(pmr::vector<SortRow> &rows, int low, int high) {
+    // partition function for quick sort; the pivot is the median of the first, middle and last keys, which needs no
+    // shared random state across concurrent sort tasks and keeps the order of ties reproducible
+    int mid = low + (high - low) / 2;
+    if (rows[mid].key < rows[low].key) swap(rows[mid], rows[low]);
+    if (rows[high].key < rows[low].key) swap(rows[high], rows[low]);
+    if (rows[high].key < rows[mid].key) swap(rows[high], rows[mid]);
+    swap(rows[mid], rows[high]);
+    string_view pivot = rows[high].key;
+    int i = low - 1;
+    for (int j = low; j < high; j++) {
+        if (rows[j].key <= pivot) {
+            i++;
+            swap(rows[i], rows[j]);
+        }
+    }
+    swap(rows[i + 1], rows[high]);
+    return i + 1;
+}
+
+void quickSort(pmr::vector<SortRow> &rows, int low, int high) {
+    // quick sort algorithm; the smaller side recurses (as a task when large) and the larger one loops
+    optional<TaskGroup> group; // only once a side is forked
+    while (low < high) {
+        int pi = partition(rows, low, high);
+        int l = pi + 1, h = high;
+        if (pi - low < high - pi) {
+            l = low;
+            h = pi - 1;
+            low = pi + 1;
+        } else {
+            high = pi - 1;
+        }
+        if (h - l >= SORT_FORK_MIN && TaskScheduler::instance().concurrency() > 1) {
+            if (!group) group.emplace();
+            group->run([&rows, l, h]() { quickSort(rows, l, h); });
+        } else {
+            quickSort(rows, l, h);
+        }
+    }
+    if (group) group->wait();
+}
+
+void merge(pmr::vector<SortRow> &rows, SortRow* scratch, int l, int m, int r) {
+    // merge function for merge sort; L and R are the two halves copied into scratch[l..r]
+    int n1 = m - l + 1, n2 = r - m;
+    copy(rows.begin() + l, rows.begin() + r + 1, scratch + l);
+    const SortRow* L = scratch + l;
+    const SortRow* R = scratch + m + 1;
+    int i = 0, j = 0, k = l;
+    while (i < n1 && j < n2) {
+        if (L[i].key <= R[j].key) rows[k++] = L[i++];
+        else rows[k++] = R[j++];
+    }
+    while (i < n1) rows[k++] = L[i++];
+    while (j < n2) rows[k++] = R[j++];
+}
+
+void mergeSortRange(pmr::vector<SortRow> &rows, SortRow* scratch, int l, int r) {
+    // merge sort algorithm
+    if (l < r) {
+        int m = l + (r - l) / 2;
+        if (r - l >= SORT_FORK_MIN && TaskScheduler::instance().concurrency() > 1) {
+            TaskGroup group;
+            group.run([&rows, scratch, l, m]() { mergeSortRange(rows, scratch, l, m); });
+            mergeSortRange(rows, scratch, m + 1, r);
+            group.wait();
+        } else {
+            mergeSortRange(rows, scratch, l, m);
+            mergeSortRange(rows, scratch, m + 1, r);
+        }
+        merge(rows, scratch, l, m, r);
+    }
+}
+
+void mergeSort(pmr::vector<SortRow> &rows, int l, int r) {
+    // one merge buffer for the whole sort, from the rows' arena; the halves only ever touch their own range of it
+    if (l >= r) return;
+    pmr::vector<SortRow> scratch(rows.size(), rows.get_allocator());
+    mergeSortRange(rows, scratch.data(), l, r);
+}
+
+QueryKey normalizeQueryKey(QueryKey key) {
+    // drops parameters the query ignores so equivalent queries share an entry
+    bool featureQuery = key.mode <= 0;
+    if (featureQuery) {
+        // feature boxes depend only on the seed's enabled features, not which song supplied them
+        if (key.mode == 0) key.seedId = std::numeric_limits<uint32_t>::max();
+        if (!(key.features & 1)) key.energy = 0;
+        if (!(key.features & 2)) key.danceability = 0;
+        if (!(key.features & 4)) key.acousticness = 0;
+        if (key.features == 0) key.margin = 0;
+    } else {
+        key.energy = key.danceability = key.acousticness = key.margin = key.features = 0;
+    }
+    if (key.mode != 2) key.metric = 0;
+    if (key.mode != 2 || key.metric != 1) key.ef = 0;
+    return key;
+}
+
+constexpr size_t CATALOG_TAIL_BYTES = 4096;
+
+uint64_t catalogTailHash(std::string_view data, size_t loadedBytes) {
+    size_t begin = loadedBytes > CATALOG_TAIL_BYTES ? loadedBytes - CATALOG_TAIL_BYTES : 0;
+    return hashBytes(data.data() + begin, loadedBytes - begin);
+}
+
+uint64_t nextCatalogVersion() {
+    static std::atomic<uint64_t> nextVersion{1};
+    return nextVersion.fetch_add(1);
+}
+
+std::unique_ptr<Catalog> loadCatalog(const std::string& filename, const CatalogShard& shard) {
+    // loads the catalog and builds every index; the feature neighbor graph keeps building after this returns
+    StageTimer timer(Stage::Load);
+    TraceScope trace("loadCatalog");
+    auto catalog = std::make_unique<Catalog>();
+    Catalog& c = *catalog;
+    c.main = std::make_shared<CatalogSegment>();
+    CatalogSegment& m = *c.main;
+    c.version = nextCatalogVersion();
+    c.shard = shard;
+    c.songs = loadSongs(filename, c.cold, shard);
+    m.lyricIndex = computeLyricSignatures(c.songs, c.cold);
+    m.duplicates = dedupeSongs(c.songs, m.lyricIndex);
+    m.songCount = c.songs.size();
+    buildLyricBands(m.lyricIndex);
+    m.idByKey = songIdsByKey(c.songs, m.duplicates);
+    m.embeddings = loadEmbeddings("embeddings.tsv", c.songs, m.duplicates);
+    // embeddings that fit the memory budget stay in RAM behind an HNSW graph (cached next to the catalog);
+    // larger ones are compressed to 8-32 bytes per song and the floats dropped, exact vectors are re-read from the side file
+    if (m.embeddings.dim > 0 && m.embeddings.data.size() * sizeof(float) <= EMBEDDING_MEMORY_BUDGET) {
+        uint64_t fingerprint = embeddingFingerprint(c.songs, m.embeddings);
+        std::filesystem::path graphPath = resourcePath("embeddings.hnsw");
+        if (!loadHNSW(m.embeddingGraph, graphPath, fingerprint, c.songs.size(), m.embeddings.dim)) {
+            m.embeddingGraph = buildHNSW(m.embeddings, fingerprint);
+            if (!saveHNSW(m.embeddingGraph, graphPath)) std::cerr << "Could not write " << graphPath.string() << "\n";
+        }
+        std::cout << "Embedding graph: recall@10 " << measureHNSWRecall(m.embeddingGraph, m.embeddings, 64) << " at ef 64\n";
+    } else if (m.embeddings.dim > 0) {
+        size_t subspaces = std::clamp<size_t>(m.embeddings.dim / 4, 16, 64);
+        m.embeddingIndex = buildPQIndex(m.embeddings, subspaces, static_cast<size_t>(std::sqrt(static_cast<double>(c.songs.size()))));
+        double recall = tunePQ(m.embeddingIndex, m.embeddings, EmbeddingMetric::L2, PQ_TARGET_RECALL);
+        size_t nprobe = m.embeddingIndex.nprobe, rerank = m.embeddingIndex.rerank;
+        recall = std::min(recall, tunePQ(m.embeddingIndex, m.embeddings, EmbeddingMetric::Dot, PQ_TARGET_RECALL));
+        m.embeddingIndex.nprobe = std::max(nprobe, m.embeddingIndex.nprobe);
+        m.embeddingIndex.rerank = std::max(rerank, m.embeddingIndex.rerank);
+        std::cout << "Embedding index: " << m.embeddingIndex.bytes() / 1024 << " KiB (was " << m.embeddings.data.size() * sizeof(float) / 1024
+                  << " KiB), recall@10 " << recall << "\n";
+        m.embeddings.releaseVectors();
+    }
+    std::vector<std::filesystem::path> logs = listeningLogs();
+    if (!logs.empty()) m.coPlayGraph = buildCoPlayGraph(logs, m.idByKey, c.songs.size(), CF_TOP_N);
+    // the neighbor graph is built as a background task and picked up once ready; the segment may outlive this
+    // snapshot, so the builder works from its own copy of the songs
+    m.neighborGraphBuild.run([&m, songs = c.songs]() {
+        NeighborGraph graph = buildFeatureNeighborGraph(songs, FEATURE_NEIGHBORS);
+        std::function<void()> callback;
+        {
+            std::lock_guard<std::mutex> lock(m.readyMutex);
+            m.neighborGraph = std::move(graph);
+            m.neighborGraphReady.store(true, std::memory_order_release);
+            callback = std::move(m.onNeighborGraphReady);
+        }
+        if (callback) callback();
+    });
+    std::cout << "Folded " << m.duplicates.size() << " duplicate groups, " << c.songs.size() << " songs remain\n";
+    c.tombstones.assign(c.songs.size(), 0);
+    c.featureColumns = buildFeatureColumns(c.songs);
+    // a trailing row without its newline may still be being written; it is read again, as an update, once complete
+    std::string_view data = c.cold.file.view();
+    c.loadedBytes = data.rfind('\n') == std::string_view::npos ? 0 : data.rfind('\n') + 1;
+    c.tailHash = catalogTailHash(data, c.loadedBytes);
+    c.cold.file.evict(); // lyrics are only paged back in for the song on screen
+    return catalog;
+}
+
+std::unique_ptr<Catalog> appendCatalogDelta(const Catalog& base, const std::string& filename, bool& rewritten) {
+    // applies the complete rows written after base.loadedBytes on top of base, sharing its main segment. Returns null
+    // if there are none, or if the file no longer starts with what base loaded (rewritten is set; reload it in full)
+    rewritten = false;
+    auto catalog = std::make_unique<Catalog>();
+    Catalog& c = *catalog;
+    if (!c.cold.file.open(resourcePath(filename))) return nullptr;
+    std::string_view data = c.cold.file.view();
+    if (data.size() < base.loadedBytes || catalogTailHash(data, base.loadedBytes) != base.tailHash) {
+        rewritten = true;
+        return nullptr;
+    }
+    CsvLayout layout = readCsvLayout(data);
+    size_t pos = std::max<size_t>(base.loadedBytes, layout.firstRecord), end = pos;
+    std::vector<CsvField> fields;
+    std::vector<std::pair<Song, CatalogRow>> rows;
+    std::mt19937 rng(std::random_device{}());
+    std::uniform_int_distribution<int> dist(0, 100);
+    while (readCsvRecord(data, pos, fields)) {
+        if (data[pos - 1] != '\n') break; // the writer is still mid-row
+        end = pos;
+        Song s;
+        CatalogRow kind;
+        if (!songFromRecord(data, fields, layout, s, kind) || !base.shard.owns(s.artist)) continue;
+        s.energy = dist(rng);
+        s.danceability = dist(rng);
+        s.acousticness = dist(rng);
+        rows.emplace_back(std::move(s), kind);
+    }
+    if (end == base.loadedBytes) return nullptr;
+
+    c.songs = base.songs;
+    c.tombstones = base.tombstones;
+    c.tombstoneCount = base.tombstoneCount;
+    c.updateCount = base.updateCount;
+    c.deltaIds = base.deltaIds;
+    c.main = base.main;
+    c.shard = base.shard;
+    auto bury = [&](uint32_t id) {
+        if (c.tombstones[id]) return;
+        c.tombstones[id] = 1;
+        c.tombstoneCount++;
+    };
+    size_t added = 0, updated = 0, removed = c.tombstoneCount;
+    for (auto& [s, kind] : rows) {
+        // updates and deletes act on the live songs with the row's artist and title; an update replaces the first of them
+        uint64_t key = songKeyHash(s.artist, s.title);
+        auto appended = c.deltaIds.find(key);
+        auto indexed = c.main->idByKey.find(key);
+        bool mainLive = indexed != c.main->idByKey.end() && !c.tombstones[indexed->second];
+        if (kind == CatalogRow::Delete) {
+            if (appended != c.deltaIds.end()) {
+                for (uint32_t id : appended->second) bury(id);
+                c.deltaIds.erase(appended);
+            }
+            if (mainLive) bury(indexed->second);
+            continue;
+        }
+        if (kind == CatalogRow::Update && (appended != c.deltaIds.end() || mainLive)) {
+            // in place, so the song keeps its id; a main segment song keeps its old index entries until the next merge
+            uint32_t id = mainLive ? indexed->second : appended->second.front();
+            s.id = id;
+            c.songs[id] = std::move(s);
+            c.updateCount++;
+            updated++;
+            continue;
+        }
+        s.id = static_cast<uint32_t>(c.songs.size());
+        c.deltaIds[key].push_back(s.id);
+        c.songs.push_back(std::move(s));
+        c.tombstones.push_back(0);
+        added++;
+    }
+    c.featureColumns = buildFeatureColumns(c.songs, c.tombstones);
+    c.version = nextCatalogVersion();
+    c.loadedBytes = end;
+    c.tailHash = catalogTailHash(data, end);
+    std::cout << "Catalog delta: " << added << " rows added, " << updated << " updated, " << c.tombstoneCount - removed << " deleted\n";
+    return catalog;
+}
+
+CatalogSegment::~CatalogSegment() {
+    waitForNeighborGraph();
+}
+
+void CatalogSegment::waitForNeighborGraph() const {
+    neighborGraphBuild.wait();
+}
+
+void CatalogSegment::whenNeighborGraphReady(std::function<void()> callback) {
+    // runs callback on the thread that finished the graph once it is ready; does nothing if it already is
+    std::lock_guard<std::mutex> lock(readyMutex);
+    if (!neighborGraphReady.load(std::memory_order_relaxed)) onNeighborGraphReady = std::move(callback);
+}
+
+CatalogView Catalog::view() const {
+    return CatalogView{songs, main->lyricIndex, main->embeddings, main->embeddingIndex, main->embeddingGraph, main->neighborGraph,
+                       main->neighborGraphReady, main->coPlayGraph, featureColumns, tombstones, version};
+}
+
+constexpr size_t CATALOG_IMAGE_ALIGN = 64;
+
+struct CatalogImageHeader {
+    char magic[8];
+    uint64_t loadedBytes, tailHash, sourcesStamp; // the catalog prefix and side files the image was built from
+    uint64_t shardIndex, shardCount;
+    uint64_t songCount, duplicateCount, lyricBands;
+    uint64_t embeddingDim, embeddingStride;
+    uint64_t pqDim, pqSubspaces, pqSubDim, pqLists, pqNprobe, pqRerank;
+    uint64_t hnswCount, hnswDim, hnswFingerprint, hnswEntry;
+    int64_t hnswMaxLevel;
+    int64_t featureLo[3], featureHi[3];
+    uint64_t sections, directory; // section count and the offset of their (offset, bytes) table
+};
+
+struct ImageSong {
+    // a Song with its strings moved to the image's string pool
+    uint64_t linkOffset, lyricsOffset;
+    uint32_t linkLength, lyricsLength;
+    uint32_t artist, artistLength, title, titleLength;
+    int32_t energy, danceability, acousticness;
+    uint32_t canonical; // duplicates: the song id they were folded into
+    uint8_t linkEscaped, lyricsEscaped, padding[6];
+};
+
+uint64_t catalogSourcesStamp() {
+    // identity of the side files the indexes are built from, by path, size and modification time
+    std::vector<std::filesystem::path> sources = listeningLogs();
+    sources.push_back(resourcePath("embeddings.tsv"));
+    uint64_t stamp = hashBytes(nullptr, 0);
+    for (const auto& path : sources) {
+        std::error_code error;
+        std::string name = path.string();
+        uint64_t fields[2] = {std::filesystem::file_size(path, error), static_cast<uint64_t>(std::filesystem::last_write_time(path, error).time_since_epoch().count())};
+        if (error) fields[0] = fields[1] = 0;
+        stamp = hashBytes(name.data(), name.size(), stamp);
+        stamp = hashBytes(reinterpret_cast<const char*>(fields), sizeof(fields), stamp);
+    }
+    return stamp;
+}
+
+std::filesystem::path catalogImagePath(const std::string& filename, const CatalogShard& shard) {
+    // one image per catalog file and shard, named after the file's absolute path
+    std::string source = std::filesystem::absolute(resourcePath(filename)).string();
+    char name[96];
+    if (shard.count <= 1) snprintf(name, sizeof(name), "music-suggestions-%016llx.catalog", static_cast<unsigned long long>(hashBytes(source.data(), source.size())));
+    else snprintf(name, sizeof(name), "music-suggestions-%016llx-%u-of-%u.catalog", static_cast<unsigned long long>(hashBytes(source.data(), source.size())), shard.index, shard.count);
+    std::error_code error;
+    if (std::filesystem::is_directory("/dev/shm", error)) return std::filesystem::path("/dev/shm") / name;
+    return std::filesystem::temp_directory_path(error) / name;
+}
+
+bool saveCatalogImage(const Catalog& catalog, const std::filesystem::path& path) {
+    // writes the main segment of catalog (its songs must all be indexed, i.e. no delta) and renames it into place,
+    // so attaching processes never see a partial image
+    const CatalogSegment& m = *catalog.main;
+    if (catalog.songs.size() != m.songCount || !m.neighborGraphReady.load(std::memory_order_acquire)) return false;
+    std::filesystem::path temporary = path;
+    temporary += "." + std::to_string(std::random_device{}()) + ".tmp";
+    std::ofstream out(temporary, std::ios::binary);
+    if (!out) return false;
+    uint64_t at = 0;
+    std::vector<std::array<uint64_t, 2>> sections;
+    auto put = [&](const void* p, size_t n) {
+        out.write(static_cast<const char*>(p), static_cast<std::streamsize>(n));
+        at += n;
+    };
+    auto section = [&](const void* p, size_t n) {
+        static const char zeros[CATALOG_IMAGE_ALIGN] = {};
+        put(zeros, (CATALOG_IMAGE_ALIGN - at % CATALOG_IMAGE_ALIGN) % CATALOG_IMAGE_ALIGN);
+        sections.push_back({at, n});
+        put(p, n);
+    };
+    auto column = [&](const auto& values) { section(values.data(), values.size() * sizeof(values[0])); };
+
+    CatalogImageHeader header = {};
+    std::memcpy(header.magic, "MSCAT001", 8);
+    put(&header, sizeof(header));
+    std::string strings;
+    auto imageSong = [&](const Song& s, uint32_t canonical) {
+        ImageSong record = {};
+        record.linkOffset = s.link.offset;
+        record.linkLength = s.link.length;
+        record.linkEscaped = s.link.escaped;
+        record.lyricsOffset = s.lyrics.offset;
+        record.lyricsLength = s.lyrics.length;
+        record.lyricsEscaped = s.lyrics.escaped;
+        record.artist = static_cast<uint32_t>(strings.size());
+        record.artistLength = static_cast<uint32_t>(s.artist.size());
+        strings += s.artist;
+        record.title = static_cast<uint32_t>(strings.size());
+        record.titleLength = static_cast<uint32_t>(s.title.size());
+        strings += s.title;
+        record.energy = s.energy;
+        record.danceability = s.danceability;
+        record.acousticness = s.acousticness;
+        record.canonical = canonical;
+        return record;
+    };
+    std::vector<ImageSong> records, duplicates;
+    records.reserve(catalog.songs.size());
+    for (const Song& s : catalog.songs) records.push_back(imageSong(s, s.id));
+    for (const auto& [canonical, group] : m.duplicates) {
+        for (const Song& s : group) duplicates.push_back(imageSong(s, canonical));
+    }
+    column(records);
+    column(duplicates);
+    column(strings);
+
+    column(m.lyricIndex.signatures);
+    column(m.lyricIndex.hasLyrics);
+    for (const auto& band : m.lyricIndex.bands) column(band);
+    const EmbeddingTable& embeddings = m.embeddings;
+    column(embeddings.data);
+    column(embeddings.hasEmbedding);
+    column(embeddings.lineOffset);
+    const PQIndex& pq = m.embeddingIndex;
+    for (const Column<float>* values : {&pq.coarse, &pq.codebooks}) column(*values);
+    for (const Column<uint32_t>* values : {&pq.listBlocks, &pq.ids}) column(*values);
+    column(pq.codes);
+    const HNSWIndex& hnsw = m.embeddingGraph;
+    column(hnsw.levels);
+    column(hnsw.links0);
+    std::vector<uint32_t> upperLinks;
+    for (const auto& links : hnsw.upperLinks) upperLinks.insert(upperLinks.end(), links.begin(), links.end());
+    column(upperLinks);
+    for (const NeighborGraph* graph : {&m.coPlayGraph, &m.neighborGraph}) {
+        column(graph->offsets);
+        column(graph->neighbors);
+        column(graph->weights);
+    }
+    for (int f = 0; f < 3; f++) {
+        column(catalog.featureColumns.offsets[f]);
+        column(catalog.featureColumns.ids[f]);
+        header.featureLo[f] = catalog.featureColumns.lo[f];
+        header.featureHi[f] = catalog.featureColumns.hi[f];
+    }
+
+    header.loadedBytes = catalog.loadedBytes;
+    header.tailHash = catalog.tailHash;
+    header.sourcesStamp = catalogSourcesStamp();
+    header.shardIndex = catalog.shard.index;
+    header.shardCount = catalog.shard.count;
+    header.songCount = records.size();
+    header.duplicateCount = duplicates.size();
+    header.lyricBands = m.lyricIndex.bands.size();
+    header.embeddingDim = embeddings.dim;
+    header.embeddingStride = embeddings.stride;
+    header.pqDim = pq.dim;
+    header.pqSubspaces = pq.subspaces;
+    header.pqSubDim = pq.subDim;
+    header.pqLists = pq.lists;
+    header.pqNprobe = pq.nprobe;
+    header.pqRerank = pq.rerank;
+    header.hnswCount = hnsw.count;
+    header.hnswDim = hnsw.dim;
+    header.hnswFingerprint = hnsw.fingerprint;
+    header.hnswEntry = hnsw.entry;
+    header.hnswMaxLevel = hnsw.maxLevel;
+    header.sections = sections.size();
+    header.directory = at;
+    put(sections.data(), sections.size() * sizeof(sections[0]));
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.close();
+    std::error_code error;
+    if (!out || (std::filesystem::rename(temporary, path, error), error)) {
+        std::filesystem::remove(temporary, error);
+        return false;
+    }
+    return true;
+}
+
+std::unique_ptr<Catalog> attachCatalogImage(const std::filesystem::path& path, const std::string& filename, const CatalogShard& shard) {
+    // maps an image written by saveCatalogImage(); null when there is none, or it was built from other files
+    auto segment = std::make_shared<CatalogSegment>();
+    CatalogSegment& m = *segment;
+    if (!m.image.open(path) || m.image.size < sizeof(CatalogImageHeader)) return nullptr;
+    std::string_view image = m.image.view();
+    CatalogImageHeader header;
+    std::memcpy(&header, image.data(), sizeof(header));
+    if (std::string_view(header.magic, 8) != "MSCAT001" || header.directory > image.size()
+        || header.sections > (image.size() - header.directory) / (2 * sizeof(uint64_t)) || header.sourcesStamp != catalogSourcesStamp()
+        || header.shardIndex != shard.index || header.shardCount != shard.count)
+        return nullptr;
+    auto catalog = std::make_unique<Catalog>();
+    Catalog& c = *catalog;
+    if (!c.cold.file.open(resourcePath(filename))) return nullptr;
+    std::string_view data = c.cold.file.view();
+    if (data.size() < header.loadedBytes || catalogTailHash(data, header.loadedBytes) != header.tailHash) return nullptr;
+
+    size_t next = 0;
+    bool valid = true;
+    auto column = [&](auto& values) {
+        // points values at the next section
+        using T = std::remove_reference_t<decltype(values[0])>;
+        uint64_t entry[2] = {0, 0};
+        if (next < header.sections) std::memcpy(entry, image.data() + header.directory + next * sizeof(entry), sizeof(entry));
+        next++;
+        if (next > header.sections || entry[0] > image.size() || entry[1] > image.size() - entry[0] || entry[1] % sizeof(T) != 0 || entry[0] % alignof(T) != 0) {
+            valid = false;
+            return;
+        }
+        values.view(reinterpret_cast<const std::remove_const_t<T>*>(image.data() + entry[0]), entry[1] / sizeof(T));
+    };
+    Column<ImageSong> records, duplicates;
+    Column<char> strings;
+    column(records);
+    column(duplicates);
+    column(strings);
+    column(m.lyricIndex.signatures);
+    column(m.lyricIndex.hasLyrics);
+    m.lyricIndex.bands.resize(header.lyricBands);
+    for (auto& band : m.lyricIndex.bands) column(band);
+    EmbeddingTable& embeddings = m.embeddings;
+    column(embeddings.data);
+    column(embeddings.hasEmbedding);
+    column(embeddings.lineOffset);
+    PQIndex& pq = m.embeddingIndex;
+    for (Column<float>* values : {&pq.coarse, &pq.codebooks}) column(*values);
+    for (Column<uint32_t>* values : {&pq.listBlocks, &pq.ids}) column(*values);
+    column(pq.codes);
+    HNSWIndex& hnsw = m.embeddingGraph;
+    Column<uint32_t> upperLinks;
+    column(hnsw.levels);
+    column(hnsw.links0);
+    column(upperLinks);
+    for (NeighborGraph* graph : {&m.coPlayGraph, &m.neighborGraph}) {
+        column(graph->offsets);
+        column(graph->neighbors);
+        column(graph->weights);
+    }
+    for (int f = 0; f < 3; f++) {
+        column(c.featureColumns.offsets[f]);
+        column(c.featureColumns.ids[f]);
+        c.featureColumns.lo[f] = static_cast<int>(header.featureLo[f]);
+        c.featureColumns.hi[f] = static_cast<int>(header.featureHi[f]);
+    }
+    if (!valid || records.size() != header.songCount || duplicates.size() != header.duplicateCount) return nullptr;
+
+    auto song = [&](const ImageSong& record, uint32_t id) {
+        Song s;
+        s.id = id;
+        if (static_cast<uint64_t>(record.artist) + record.artistLength <= strings.size()) s.artist.assign(strings.data() + record.artist, record.artistLength);
+        if (static_cast<uint64_t>(record.title) + record.titleLength <= strings.size()) s.title.assign(strings.data() + record.title, record.titleLength);
+        s.link = ColdRef{record.linkOffset, record.linkLength, record.linkEscaped != 0};
+        s.lyrics = ColdRef{record.lyricsOffset, record.lyricsLength, record.lyricsEscaped != 0};
+        s.energy = record.energy;
+        s.danceability = record.danceability;
+        s.acousticness = record.acousticness;
+        return s;
+    };
+    c.songs.reserve(records.size());
+    for (uint32_t id = 0; id < records.size(); id++) c.songs.push_back(song(records[id], id));
+    for (const ImageSong& record : duplicates) m.duplicates[record.canonical].push_back(song(record, record.canonical));
+    m.songCount = c.songs.size();
+    m.idByKey = songIdsByKey(c.songs, m.duplicates);
+
+    embeddings.dim = header.embeddingDim;
+    embeddings.stride = header.embeddingStride;
+    // compressed embeddings re-read exact vectors from the side file
+    if (embeddings.dim > 0 && embeddings.data.empty()) embeddings.file.open(resourcePath("embeddings.tsv"));
+    pq.dim = header.pqDim;
+    pq.subspaces = header.pqSubspaces;
+    pq.subDim = header.pqSubDim;
+    pq.lists = header.pqLists;
+    pq.nprobe = header.pqNprobe;
+    pq.rerank = header.pqRerank;
+    hnsw.count = header.hnswCount;
+    hnsw.dim = header.hnswDim;
+    hnsw.fingerprint = header.hnswFingerprint;
+    hnsw.entry = static_cast<uint32_t>(header.hnswEntry);
+    hnsw.maxLevel = static_cast<int>(header.hnswMaxLevel);
+    hnsw.upperLinks.resize(hnsw.levels.size());
+    size_t linkAt = 0;
+    for (size_t id = 0; id < hnsw.levels.size(); id++) {
+        size_t size = static_cast<size_t>(std::max<int>(0, hnsw.levels[id])) * HNSW_M;
+        if (linkAt + size > upperLinks.size()) return nullptr;
+        hnsw.upperLinks[id].view(upperLinks.data() + linkAt, size);
+        linkAt += size;
+    }
+    m.neighborGraphReady.store(true, std::memory_order_release);
+
+    c.main = std::move(segment);
+    c.shard = shard;
+    c.tombstones.assign(c.songs.size(), 0);
+    c.version = nextCatalogVersion();
+    c.loadedBytes = header.loadedBytes;
+    c.tailHash = header.tailHash;
+    return catalog;
+}
+
+std::unique_ptr<Catalog> loadCatalogShared(const std::string& filename, const CatalogShard& shard) {
+    // attaches to the image another process published for this catalog, or loads the catalog and publishes one
+    std::filesystem::path imagePath = catalogImagePath(filename, shard);
+    if (std::unique_ptr<Catalog> attached = attachCatalogImage(imagePath, filename, shard)) {
+        bool rewritten = false;
+        std::unique_ptr<Catalog> caughtUp = appendCatalogDelta(*attached, filename, rewritten);
+        if (!rewritten) {
+            std::cout << "Attached to catalog image " << imagePath.string() << ": " << attached->songs.size() << " songs\n";
+            return caughtUp ? std::move(caughtUp) : std::move(attached);
+        }
+    }
+    std::unique_ptr<Catalog> catalog = loadCatalog(filename, shard);
+    if (catalog->songs.empty()) return catalog;
+    catalog->waitForNeighborGraph(); // the image carries the finished graph
+    if (saveCatalogImage(*catalog, imagePath)) std::cout << "Published catalog image " << imagePath.string() << "\n";
+    else std::cerr << "Could not write " << imagePath.string() << "\n";
+    return catalog;
+}
+
+bool isLive(const CatalogView& catalog, uint32_t id) {
+    return id >= catalog.tombstones.size() || !catalog.tombstones[id];
+}
+
+void dropDeleted(const CatalogView& catalog, std::vector<uint32_t>& ids) {
+    // indexes built over the main segment still return songs that later rows replaced or deleted
+    std::erase_if(ids, [&](uint32_t id) { return !isLive(catalog, id); });
+}
+
+Song featureSeed(const QueryRequest& r) {
+    // the stand-in seed of a like= query; it is no catalog song
+    Song seed;
+    seed.id = std::numeric_limits<uint32_t>::max();
+    seed.energy = r.likeSeed[0];
+    seed.danceability = r.likeSeed[1];
+    seed.acousticness = r.likeSeed[2];
+    return seed;
+}
+
+bool findSeed(const CatalogView& catalog, const QueryRequest& r, Song& seed) {
+    // the first song whose title (or artist) contains the search text
+    auto match = std::find_if(catalog.songs.begin(), catalog.songs.end(), [&](const Song& s) {
+        return isLive(catalog, s.id) && (r.searchMode == 0 ? s.title : s.artist).find(r.search) != std::string::npos;
+    });
+    if (match == catalog.songs.end()) return false;
+    seed = *match;
+    return true;
+}
+
+int effectiveMode(const CatalogView& catalog, const QueryRequest& r) {
+    // playlists rank by features, and neighbor queries fall back to features until the graph is ready
+    if (r.kind == QueryRequest::Kind::Playlist) return 0;
+    if (r.recommendMode == 3 && !catalog.neighborGraphReady.load(std::memory_order_acquire)) return 0;
+    return r.recommendMode;
+}
+
+std::vector<uint32_t> keepMatching(const CatalogView& catalog, std::vector<uint32_t> ids, const QueryRequest& r) {
+    // drops ids whose song fails the search filter
+    if (r.prioritize && !r.search.empty()) {
+        std::erase_if(ids, [&](uint32_t id) {
+            const Song& s = catalog.songs[id];
+            return s.title.find(r.search) == std::string::npos && s.artist.find(r.search) == std::string::npos;
+        });
+    }
+    return ids;
+}
+
+std::vector<uint32_t> rankedCandidates(const CatalogView& catalog, const QueryRequest& r, const Song& seed, int mode) {
+    // lyric, embedding, neighbor and co-play modes return the closest songs first, so "Most Similar" keeps that order.
+    // Their indexes cover the main segment only, so a seed appended since has no model neighbors yet
+    StageTimer timer(Stage::Filter);
+    std::vector<uint32_t> ids;
+    if (mode == 3) {
+        if (seed.id < catalog.neighborGraph.size()) ids.assign(catalog.neighborGraph.begin(seed.id), catalog.neighborGraph.end(seed.id));
+    } else if (mode == 4) {
+        if (seed.id < catalog.coPlayGraph.size()) ids.assign(catalog.coPlayGraph.begin(seed.id), catalog.coPlayGraph.end(seed.id));
+    } else if (mode == 1) {
+        if (seed.id < catalog.lyricIndex.hasLyrics.size()) for (const auto& [id, similarity] : similarLyrics(catalog.lyricIndex, seed.id, 100)) ids.push_back(id);
+    } else {
+        const EmbeddingTable& embeddings = catalog.embeddings;
+        EmbeddingMetric metric = r.embeddingMetric == 0 ? EmbeddingMetric::Dot : EmbeddingMetric::L2;
+        std::vector<float> query(embeddings.stride);
+        std::vector<std::pair<uint32_t, float>> nearest;
+        if (embeddings.exactRow(seed.id, query.data())) {
+            if (embeddings.data.empty()) nearest = searchPQ(catalog.embeddingIndex, embeddings, query.data(), 100, metric, seed.id);
+            else if (metric == EmbeddingMetric::L2) nearest = searchHNSW(catalog.embeddingGraph, embeddings, query.data(), 100, r.hnswEf, seed.id);
+            else nearest = nearestEmbeddings(embeddings, query.data(), 100, metric, seed.id);
+        }
+        for (const auto& [id, score] : nearest) ids.push_back(id);
+    }
+    dropDeleted(catalog, ids);
+    return keepMatching(catalog, std::move(ids), r);
+}
+
+std::vector<uint32_t> playlistCandidates(const CatalogView& catalog, const QueryRequest& r) {
+    StageTimer timer(Stage::Filter);
+    PlaylistMode mode = r.playlistMode == 0 ? PlaylistMode::Union : r.playlistMode == 1 ? PlaylistMode::Intersection : PlaylistMode::Centroid;
+    std::vector<uint32_t> ids;
+    for (const Song& s : recommendForPlaylist(catalog.songs, r.playlist, mode, r.margin, r.useEnergy, r.useDance, r.useAcoustic, r.prioritize, r.search)) ids.push_back(s.id);
+    dropDeleted(catalog, ids);
+    return ids;
+}
+
+BatchQuery featureQuery(const QueryRequest& r, const Song& seed) {
+    return BatchQuery{seed, r.margin, r.useEnergy, r.useDance, r.useAcoustic, r.prioritize, r.search};
+}
+
+SortRow sortRow(const Song& s, const QueryRequest& r, const Song& seed, std::pmr::memory_resource* arena) {
+    // the key the requested sort orders s by
+    SortRow row;
+    row.id = s.id;
+    if (r.sortChoice == 2) row.score = similarityScore(s, seed, r.useEnergy, r.useDance, r.useAcoustic);
+    else row.key = sortKey(r.sortChoice == 1 ? s.title : s.artist, arena);
+    return row;
+}
+
+bool rowBefore(const SortRow& a, const SortRow& b, const QueryRequest& r) {
+    return r.sortChoice == 2 ? a.score < b.score : a.key < b.key;
+}
+
+void sortRows(std::pmr::vector<SortRow>& rows, bool modelRanked, const QueryRequest& r) {
+    // sorts rows by the chosen key and algorithm
+    TraceScope trace(r.sortChoice == 2 ? "similaritySort" : r.sortAlgorithm == 0 ? "quickSort" : "mergeSort");
+    if (r.sortChoice == 2) {
+        if (!modelRanked) std::sort(rows.begin(), rows.end(), [&](const SortRow& a, const SortRow& b) { return a.score < b.score; });
+    } else if (r.sortAlgorithm == 0) { // Quick Sort
+        quickSort(rows, 0, rows.size() - 1); // by title or artist
+    } else { // Merge Sort
+        mergeSort(rows, 0, rows.size() - 1);
+    }
+}
+
+bool orderedBefore(const Song& a, const Song& b, const QueryRequest& r, const Song& seed) {
+    // the comparison sortRows orders feature results by
+    QueryArenaScope scope;
+    std::pmr::memory_resource* arena = queryMemory();
+    return rowBefore(sortRow(a, r, seed, arena), sortRow(b, r, seed, arena), r);
+}
+
+std::vector<uint32_t> sortedIds(const CatalogView& catalog, const std::vector<uint32_t>& candidates, bool modelRanked, const QueryRequest& r, const Song& seed, double& sortMs) {
+    // orders candidates with the requested sort, timing the sort and the keys it compares (built once per row, where
+    // they used to be normalized on every comparison)
+    std::pmr::memory_resource* arena = queryMemory();
+    auto start = std::chrono::high_resolution_clock::now();
+    std::pmr::vector<SortRow> rows(arena);
+    {
+        StageTimer timer(Stage::Score);
+        rows.reserve(candidates.size());
+        for (uint32_t id : candidates) rows.push_back(sortRow(catalog.songs[id], r, seed, arena));
+    }
+    {
+        StageTimer timer(Stage::Sort);
+        sortRows(rows, modelRanked, r);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    sortMs = std::chrono::duration<double, std::milli>(end - start).count();
+    StageTimer timer(Stage::Materialize);
+    std::vector<uint32_t> ids;
+    ids.reserve(rows.size());
+    for (const SortRow& row : rows) ids.push_back(row.id);
+    return ids;
+}
+
+std::unique_ptr<QueryOutput> QueryEngine::run(const QueryRequest& r, const std::function<bool()>& cancelled) {
+    const std::vector<Song>& songs = catalog.songs;
+    if (songs.empty()) return nullptr;
+    TraceScope trace("query");
+    QueryArenaScope scope; // everything the query sorts with is dropped at once when it returns
+    auto stale = [&]() { return cancelled && cancelled(); };
+    cache.validate(catalog.version);
+    auto output = std::make_unique<QueryOutput>();
+
+    if (r.kind == QueryRequest::Kind::Playlist) {
+        // the centroid stands in as the seed so "Most Similar" ranks against the playlist as a whole
+        seed = playlistCentroid(songs, r.playlist);
+        seedFromSearch = false;
+    } else if (r.pinnedSeed < songs.size()) {
+        seed = songs[r.pinnedSeed];
+        seedFromSearch = false;
+    } else if (r.seedFromFeatures) {
+        seed = featureSeed(r);
+        seedFromSearch = false;
+    } else if (r.reseed || !seedFromSearch || r.search != seedSearch || r.searchMode != seedSearchMode) {
+        StageTimer timer(Stage::SeedLookup);
+        if (!findSeed(catalog, r, seed)) seed = songs[rand() % songs.size()];
+        for (int tries = 0; tries < 64 && !isLive(catalog, seed.id); tries++) seed = songs[rand() % songs.size()];
+        seedFromSearch = true;
+        seedSearch = r.search;
+        seedSearchMode = r.searchMode;
+    }
+    if (stale()) return nullptr;
+
+    int mode = effectiveMode(catalog, r);
+    bool filterTerm = r.prioritize && !r.search.empty();
+    bool sameFeatureQuery = marginQueryLive && current && r.kind == QueryRequest::Kind::Search && mode == 0
+        && seed.energy == marginQuery.seed.energy && seed.danceability == marginQuery.seed.danceability && seed.acousticness == marginQuery.seed.acousticness
+        && r.useEnergy == marginQuery.use[0] && r.useDance == marginQuery.use[1] && r.useAcoustic == marginQuery.use[2]
+        && filterTerm == marginQuery.filterTerm && (!filterTerm || r.search == marginQuery.term);
+    bool carried = false;
+    if (sameFeatureQuery) {
+        // only the margin or the sort moved: shift the kept result instead of querying again
+        if (r.margin != marginQuery.margin) carried = applyMargin(r);
+    } else {
+        auto start = std::chrono::high_resolution_clock::now();
+        if (!runQuery(r, mode, cancelled)) return nullptr;
+        auto end = std::chrono::high_resolution_clock::now();
+        if (r.pinnedSeed < songs.size() && mode == 3) output->pivotUs = std::chrono::duration<double, std::micro>(end - start).count();
+        marginQueryLive = r.kind == QueryRequest::Kind::Search && mode == 0;
+        if (marginQueryLive) marginQuery = MarginQuery{seed, r.margin, {r.useEnergy, r.useDance, r.useAcoustic}, filterTerm, r.search, current->candidates};
+    }
+    if (stale()) return nullptr;
+
+    int slot = sortCurrent(r);
+    StageTimer timer(Stage::Materialize);
+    output->seed = seed;
+    output->recommendMode = mode;
+    output->ids = current->orders[slot];
+    output->sortMs = current->sortMs[slot];
+    output->sortCached = sortCached && !carried;
+    return output;
+}
+
+QueryKey QueryEngine::makeQueryKey(const QueryRequest& r, int mode) const {
+    QueryKey key;
+    key.mode = r.kind == QueryRequest::Kind::Playlist ? -1 - r.playlistMode : mode;
+    key.seedId = seed.id;
+    key.energy = seed.energy;
+    key.danceability = seed.danceability;
+    key.acousticness = seed.acousticness;
+    key.margin = r.margin;
+    key.features = (r.useEnergy ? 1 : 0) | (r.useDance ? 2 : 0) | (r.useAcoustic ? 4 : 0);
+    if (r.prioritize) key.term = r.search;
+    key.metric = r.embeddingMetric;
+    key.ef = r.hnswEf;
+    if (r.kind == QueryRequest::Kind::Playlist) key.playlist = r.playlist;
+    return normalizeQueryKey(key);
+}
+
+bool QueryEngine::runQuery(const QueryRequest& r, int mode, const std::function<bool()>& cancelled) {
+    // makes the cached result for the request current, computing it on a miss; false if cancelled midway
+    QueryKey key = makeQueryKey(r, mode);
+    if (auto hit = cache.find(key)) {
+        current = hit;
+        return true;
+    }
+    auto result = std::make_shared<QueryResult>();
+    result->modelRanked = key.mode > 0;
+    if (r.kind == QueryRequest::Kind::Playlist) result->candidates = playlistCandidates(catalog, r);
+    else if (mode == 0) {
+        result->candidates = std::move(recommendBatch(catalog.songs, {featureQuery(r, seed)}, cancelled)[0]);
+        dropDeleted(catalog, result->candidates);
+    } else result->candidates = rankedCandidates(catalog, r, seed, mode);
+    // a scan abandoned midway is incomplete and must not be cached
+    if (cancelled && cancelled()) return false;
+    cache.insert(key, result);
+    current = result;
+    return true;
+}
+
+int QueryEngine::sortCurrent(const QueryRequest& r) {
+    // makes sure the current result holds the requested ordering, sorting only the first time it is asked for
+    int slot = r.sortChoice * 2 + r.sortAlgorithm;
+    QueryResult& result = *current;
+    sortCached = result.sorted[slot];
+    if (!result.sorted[slot]) {
+        result.orders[slot] = sortedIds(catalog, result.candidates, result.modelRanked, r, seed, result.sortMs[slot]);
+        result.sorted[slot] = true;
+    }
+    return slot;
+}
+
+bool QueryEngine::applyMargin(const QueryRequest& r) {
+    // moves the kept feature query to the requested margin, touching only the shell between the old and new boxes;
+    // the shown ordering is carried forward by dropping rows that left and merging in the sorted rows that entered.
+    // Returns whether it was, i.e. the ordering is fresh rather than cached
+    const std::vector<Song>& songs = catalog.songs;
+    std::shared_ptr<QueryResult> previous = current;
+    std::vector<uint32_t> added;
+    {
+        StageTimer timer(Stage::Filter);
+        added = updateMargin(songs, catalog.featureColumns, marginQuery, r.margin);
+    }
+    QueryKey key = makeQueryKey(r, 0);
+    if (auto hit = cache.find(key)) {
+        current = hit;
+        return false;
+    }
+    current = std::make_shared<QueryResult>();
+    current->candidates = marginQuery.ids;
+    int slot = r.sortChoice * 2 + r.sortAlgorithm;
+    bool carried = previous->sorted[slot];
+    if (carried) {
+        auto start = std::chrono::high_resolution_clock::now();
+        std::pmr::memory_resource* arena = queryMemory();
+        std::pmr::vector<uint32_t> kept(arena);
+        for (uint32_t id : previous->orders[slot]) if (marginMatches(marginQuery, songs[id])) kept.push_back(id);
+        std::pmr::vector<SortRow> rows(arena);
+        {
+            StageTimer timer(Stage::Score);
+            rows.reserve(added.size());
+            for (uint32_t id : added) rows.push_back(sortRow(songs[id], r, seed, arena));
+        }
+        StageTimer timer(Stage::Sort);
+        sortRows(rows, false, r);
+        std::vector<uint32_t>& order = current->orders[slot];
+        order.reserve(kept.size() + rows.size());
+        auto next = kept.begin();
+        for (const SortRow& row : rows) {
+            auto at = std::upper_bound(next, kept.end(), row, [&](const SortRow& a, uint32_t id) { return rowBefore(a, sortRow(songs[id], r, seed, arena), r); });
+            order.insert(order.end(), next, at);
+            order.push_back(row.id);
+            next = at;
+        }
+        order.insert(order.end(), next, kept.end());
+        auto end = std::chrono::high_resolution_clock::now();
+        current->sortMs[slot] = std::chrono::duration<double, std::milli>(end - start).count();
+        current->sorted[slot] = true;
+    }
+    cache.insert(key, current);
+    return carried;
+}
+
+constexpr uint64_t EPOCH_IDLE = std::numeric_limits<uint64_t>::max();
+
+struct alignas(64) EpochSlot {
+    // one reader thread's pinned epoch, EPOCH_IDLE outside a read; padded so readers do not share cache lines
+    std::atomic<uint64_t> epoch{EPOCH_IDLE};
+    std::atomic<bool> claimed{false};
+};
+
+std::array<EpochSlot, EPOCH_READER_SLOTS> epochSlots;
+std::atomic<uint64_t> globalEpoch{1};
+
+struct EpochThread {
+    // the slot a thread claimed on its first read, given back when the thread exits
+    int slot = -1;
+    int depth = 0;
+    ~EpochThread() {
+        if (slot < 0) return;
+        epochSlots[slot].epoch.store(EPOCH_IDLE);
+        epochSlots[slot].claimed.store(false, std::memory_order_release);
+    }
+};
+
+thread_local EpochThread epochThread;
+
+EpochGuard::EpochGuard() {
+    EpochThread& thread = epochThread;
+    if (thread.depth++ > 0) return;
+    while (thread.slot < 0) {
+        for (int i = 0; i < static_cast<int>(EPOCH_READER_SLOTS) && thread.slot < 0; i++) {
+            bool expected = false;
+            if (epochSlots[i].claimed.compare_exchange_strong(expected, true, std::memory_order_acquire)) thread.slot = i;
+        }
+        if (thread.slot < 0) std::this_thread::yield();
+    }
+    // seq_cst orders this store before the caller's pointer load, so a publisher that retires the pointer later
+    // also bumps the epoch later and sees this pin
+    epochSlots[thread.slot].epoch.store(globalEpoch.load());
+}
+
+EpochGuard::~EpochGuard() {
+    EpochThread& thread = epochThread;
+    if (--thread.depth == 0) epochSlots[thread.slot].epoch.store(EPOCH_IDLE, std::memory_order_release);
+}
+
+uint64_t oldestPinnedEpoch() {
+    uint64_t oldest = EPOCH_IDLE;
+    for (const EpochSlot& slot : epochSlots) oldest = std::min(oldest, slot.epoch.load());
+    return oldest;
+}
+
+CatalogStore::CatalogStore(std::shared_ptr<const Catalog> initial) : current(new Snapshot{std::move(initial)}) {}
+
+CatalogStore::~CatalogStore() {
+    // no reader may still be running against the store
+    delete current.load();
+}
+
+std::shared_ptr<const Catalog> CatalogStore::acquire() const {
+    // a reference that keeps the current catalog alive after the pin is dropped
+    EpochGuard guard;
+    return current.load(std::memory_order_seq_cst)->catalog;
+}
+
+void CatalogStore::publish(std::shared_ptr<const Catalog> next) {
+    // swaps next in, then waits out the readers that might still see the old wrapper; only the publisher waits
+    std::lock_guard<std::mutex> lock(writeMutex);
+    Snapshot* old = current.exchange(new Snapshot{std::move(next)});
+    uint64_t retiredAt = globalEpoch.fetch_add(1) + 1;
+    while (oldestPinnedEpoch() < retiredAt) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    delete old;
+}
+
+QueryWorker::QueryWorker(const CatalogStore& store) : store(store) {
+    thread = std::thread([this]() { run(); });
+}
+
+QueryWorker::~QueryWorker() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        latest.fetch_add(1); // cancels whatever is running
+    }
+    wake.notify_one();
+    thread.join();
+    delete published.exchange(nullptr);
+}
+
+uint64_t QueryWorker::post(QueryRequest request) {
+    // replaces any request still waiting; returns its generation
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending = std::move(request);
+        pendingPostedAt = std::chrono::steady_clock::now();
+        hasPending = true;
+        generation = latest.fetch_add(1) + 1;
+    }
+    wake.notify_one();
+    return generation;
+}
+
+std::unique_ptr<QueryOutput> QueryWorker::take() {
+    return std::unique_ptr<QueryOutput>(published.exchange(nullptr, std::memory_order_acq_rel));
+}
+
+void QueryWorker::run() {
+    nameTraceThread("query worker");
+    for (;;) {
+        QueryRequest request;
+        uint64_t generation;
+        std::chrono::steady_clock::time_point postedAt;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this]() { return hasPending || stopping; });
+            if (stopping) return;
+            request = std::move(pending);
+            hasPending = false;
+            generation = latest.load();
+            postedAt = pendingPostedAt;
+        }
+        // a newly published catalog gets a fresh engine; its cache and seed state belonged to the old one
+        std::shared_ptr<const Catalog> snapshot = store.acquire();
+        if (snapshot != engineCatalog) {
+            engine = std::make_unique<QueryEngine>(snapshot->view());
+            engineCatalog = std::move(snapshot);
+        }
+        auto cancelled = [this, generation]() { return latest.load(std::memory_order_relaxed) != generation; };
+        std::unique_ptr<QueryOutput> output = engine->run(request, cancelled);
+        if (!output || cancelled()) continue;
+        output->generation = generation;
+        output->catalog = engineCatalog;
+        output->latencyMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - postedAt).count();
+        output->request = std::move(request);
+        delete published.exchange(output.release(), std::memory_order_acq_rel);
+        if (onPublish) onPublish();
+    }
+}
+
+CatalogWatcher::CatalogWatcher(CatalogStore& store, std::string filename, std::function<void()> onPublish, bool publishImage)
+    : store(store), filename(std::move(filename)), onPublish(std::move(onPublish)), publishImage(publishImage) {
+    thread = std::thread([this]() { run(); });
+}
+
+CatalogWatcher::~CatalogWatcher() {
+    stopping.store(true);
+    thread.join();
+    if (merger.joinable()) merger.join();
+}
+
+void CatalogWatcher::run() {
+    std::filesystem::path path = resourcePath(filename);
+    std::error_code error;
+    auto stamp = [&]() { return std::make_pair(std::filesystem::file_size(path, error), std::filesystem::last_write_time(path, error)); };
+    auto seen = stamp();
+#ifdef __linux__
+    // watches the directory rather than the file, so editors that save by renaming a new file over it are seen too
+    int watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch >= 0 && inotify_add_watch(watch, path.parent_path().c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        ::close(watch);
+        watch = -1;
+    }
+#endif
+    auto changed = [&]() {
+        // waits up to CATALOG_POLL_MS for the file to change
+#ifdef __linux__
+        if (watch >= 0) {
+            pollfd ready{watch, POLLIN, 0};
+            if (poll(&ready, 1, CATALOG_POLL_MS) <= 0) return false;
+            bool ours = false;
+            alignas(inotify_event) char buffer[4096];
+            ssize_t n;
+            while ((n = ::read(watch, buffer, sizeof(buffer))) > 0) {
+                for (char* at = buffer; at < buffer + n; at += sizeof(inotify_event) + reinterpret_cast<inotify_event*>(at)->len) {
+                    const inotify_event* event = reinterpret_cast<inotify_event*>(at);
+                    if (event->len > 0 && path.filename() == event->name) ours = true;
+                }
+            }
+            return ours;
+        }
+#endif
+        std::this_thread::sleep_for(std::chrono::milliseconds(CATALOG_POLL_MS));
+        auto now = stamp();
+        if (now == seen) return false;
+        seen = now;
+        return true;
+    };
+    while (!stopping.load()) {
+        if (!changed()) continue;
+        // lets a burst of writes finish; a row still half written is picked up on the next change
+        std::this_thread::sleep_for(std::chrono::milliseconds(CATALOG_SETTLE_MS));
+        refresh();
+    }
+#ifdef __linux__
+    if (watch >= 0) ::close(watch);
+#endif
+}
+
+void CatalogWatcher::refresh() {
+    // publishes the rows appended since the current snapshot, and starts a merge once the delta is too large to keep
+    std::lock_guard<std::mutex> lock(refreshMutex);
+    std::shared_ptr<const Catalog> base = store.acquire();
+    bool rewritten = false;
+    std::unique_ptr<Catalog> next = appendCatalogDelta(*base, filename, rewritten);
+    size_t deltaSize = base->deltaSize();
+    if (next) {
+        deltaSize = next->deltaSize();
+        store.publish(std::move(next));
+        if (onPublish) onPublish();
+    }
+    if ((rewritten || deltaSize > CATALOG_MERGE_ROWS) && !merging.exchange(true)) {
+        if (merger.joinable()) merger.join();
+        merger = std::thread([this]() { merge(); });
+    }
+}
+
+void CatalogWatcher::merge() {
+    // rebuilds the main segment from the whole file while deltas keep being published, then catches up on the rows
+    // appended during the rebuild and replaces the delta snapshot in one publication. Queries keep priority over it
+    TaskPriorityScope background(TaskPriority::Background);
+    CatalogShard shard = store.acquire()->shard;
+    std::unique_ptr<Catalog> merged = loadCatalog(filename, shard);
+    merged->waitForNeighborGraph(); // otherwise neighbor queries would fall back to features for a while
+    if (publishImage && !stopping.load() && !merged->songs.empty() && !saveCatalogImage(*merged, catalogImagePath(filename, shard)))
+        std::cerr << "Could not write " << catalogImagePath(filename, shard).string() << "\n";
+    if (!stopping.load() && !merged->songs.empty()) {
+        std::lock_guard<std::mutex> lock(refreshMutex);
+        bool rewritten = false;
+        if (std::unique_ptr<Catalog> caughtUp = appendCatalogDelta(*merged, filename, rewritten)) merged = std::move(caughtUp);
+        store.publish(std::move(merged));
+        if (onPublish) onPublish();
+    }
+    merging.store(false);
+}
+
+bool resolveSeed(const CatalogView& catalog, const QueryRequest& r, Song& seed) {
+    // the pinned song, the features like= gives, or the first song the search matches
+    if (r.pinnedSeed < catalog.songs.size()) {
+        seed = catalog.songs[r.pinnedSeed];
+        return true;
+    }
+    if (r.seedFromFeatures) {
+        seed = featureSeed(r);
+        return true;
+    }
+    return findSeed(catalog, r, seed);
+}
+
+std::vector<QueryOutput> runQueries(const CatalogView& catalog, const std::vector<QueryRequest>& requests, bool parallel) {
+    // evaluates independent requests together: every feature query shares one recommendBatch() pass over the catalog,
+    // and seeds, the other modes and the sorts run in parallel across requests (unless the caller is already one of
+    // several workers). Unlike QueryEngine nothing is cached, and a search that matches no song yields an empty result
+    // (seed id UINT32_MAX) rather than a random seed
+    TraceScope trace("runQueries");
+    size_t grain = parallel ? 1 : std::max<size_t>(1, requests.size());
+    std::vector<QueryOutput> outputs(requests.size());
+    const std::vector<Song>& songs = catalog.songs;
+    std::vector<uint8_t> hasSeed(requests.size(), 0);
+    std::vector<std::vector<uint32_t>> candidates(requests.size());
+    parallelFor(requests.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            const QueryRequest& r = requests[i];
+            QueryOutput& out = outputs[i];
+            out.seed.id = std::numeric_limits<uint32_t>::max();
+            out.recommendMode = effectiveMode(catalog, r);
+            if (r.kind == QueryRequest::Kind::Playlist) {
+                out.seed = playlistCentroid(songs, r.playlist);
+                hasSeed[i] = !r.playlist.empty();
+            } else {
+                StageTimer timer(Stage::SeedLookup);
+                hasSeed[i] = resolveSeed(catalog, r, out.seed);
+            }
+            if (!hasSeed[i]) continue;
+            if (r.kind == QueryRequest::Kind::Playlist) candidates[i] = playlistCandidates(catalog, r);
+            else if (out.recommendMode != 0) candidates[i] = rankedCandidates(catalog, r, out.seed, out.recommendMode);
+        }
+    }, grain);
+    std::vector<BatchQuery> batch;
+    std::vector<size_t> batchOwner;
+    for (size_t i = 0; i < requests.size(); i++) {
+        if (!hasSeed[i] || requests[i].kind == QueryRequest::Kind::Playlist || outputs[i].recommendMode != 0) continue;
+        batch.push_back(featureQuery(requests[i], outputs[i].seed));
+        batchOwner.push_back(i);
+    }
+    std::vector<std::vector<uint32_t>> matched;
+    if (!batch.empty()) matched = recommendBatch(songs, batch);
+    for (size_t b = 0; b < batch.size(); b++) {
+        candidates[batchOwner[b]] = std::move(matched[b]);
+        dropDeleted(catalog, candidates[batchOwner[b]]);
+    }
+    parallelFor(requests.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            QueryArenaScope scope;
+            bool modelRanked = requests[i].kind == QueryRequest::Kind::Search && outputs[i].recommendMode > 0;
+            outputs[i].ids = sortedIds(catalog, candidates[i], modelRanked, requests[i], outputs[i].seed, outputs[i].sortMs);
+        }
+    }, grain);
+    return outputs;
+}
+
+bool parseCount(const std::string& text, int& out) {
+    auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), out);
+    return ec == std::errc() && end == text.data() + text.size() && out >= 0;
+}
+
+bool parseTextQuery(const std::string& line, size_t songCount, TextQuery& query, std::string& error) {
+    // fills query from a "key=value ..." line; false with error set when a key or value is not recognized
+    QueryRequest& r = query.request;
+    std::istringstream in(line);
+    std::string token;
+    while (in >> token) {
+        size_t eq = token.find('=');
+        if (eq == std::string::npos) {
+            error = "expected key=value, got \"" + token + "\"";
+            return false;
+        }
+        std::string key = token.substr(0, eq), value = token.substr(eq + 1);
+        int number = 0;
+        if (key == "search" && !value.empty() && value[0] == '"') {
+            // a quoted search may hold spaces and be followed by more options
+            r.search = value.substr(1);
+            if (r.search.empty() || r.search.back() != '"') {
+                std::string rest;
+                std::getline(in, rest, '"');
+                r.search += rest;
+            } else {
+                r.search.pop_back();
+            }
+        } else if (key == "search") {
+            // an unquoted search runs to the end of the line
+            std::string rest;
+            std::getline(in, rest);
+            r.search = value + rest;
+            break;
+        } else if (key == "mode") {
+            auto found = std::find(TEXT_QUERY_MODES.begin(), TEXT_QUERY_MODES.end(), value);
+            if (found == TEXT_QUERY_MODES.end()) {
+                error = "unknown mode \"" + value + "\"";
+                return false;
+            }
+            r.recommendMode = static_cast<int>(found - TEXT_QUERY_MODES.begin());
+        } else if (key == "seed" && parseCount(value, number)) {
+            r.pinnedSeed = static_cast<uint32_t>(number);
+        } else if (key == "by" && (value == "title" || value == "artist")) {
+            r.searchMode = value == "artist";
+        } else if (key == "features" && value.find_first_not_of("eda") == std::string::npos) {
+            r.useEnergy = value.find('e') != std::string::npos;
+            r.useDance = value.find('d') != std::string::npos;
+            r.useAcoustic = value.find('a') != std::string::npos;
+        } else if (key == "margin" && parseCount(value, number)) {
+            r.margin = number;
+        } else if (key == "filter" && (value == "0" || value == "1")) {
+            r.prioritize = value == "1";
+        } else if (key == "metric" && (value == "dot" || value == "l2")) {
+            r.embeddingMetric = value == "l2";
+        } else if (key == "ef" && parseCount(value, number) && number > 0) {
+            r.hnswEf = number;
+        } else if (key == "sort" && (value == "artist" || value == "title" || value == "similar")) {
+            r.sortChoice = value == "artist" ? 0 : value == "title" ? 1 : 2;
+        } else if (key == "algorithm" && (value == "quick" || value == "merge")) {
+            r.sortAlgorithm = value == "merge";
+        } else if (key == "limit" && parseCount(value, number)) {
+            query.limit = static_cast<size_t>(number);
+        } else if (key == "like" && std::count(value.begin(), value.end(), ',') == 2) {
+            std::istringstream parts(value);
+            std::string part;
+            for (int f = 0; f < 3; f++) {
+                std::getline(parts, part, ',');
+                if (!parseCount(part, r.likeSeed[f])) {
+                    error = "bad option \"" + token + "\"";
+                    return false;
+                }
+            }
+            r.seedFromFeatures = true;
+        } else {
+            error = "bad option \"" + token + "\"";
+            return false;
+        }
+    }
+    bool pinned = r.pinnedSeed != std::numeric_limits<uint32_t>::max();
+    if (!pinned && !r.seedFromFeatures && r.search.empty()) {
+        error = "needs seed=, search= or like=";
+        return false;
+    }
+    if (r.seedFromFeatures && r.recommendMode != 0) {
+        error = "like= only seeds feature queries";
+        return false;
+    }
+    if (pinned && r.pinnedSeed >= songCount) {
+        error = "no song has id " + std::to_string(r.pinnedSeed);
+        return false;
+    }
+    return true;
+}
+
+std::string formatTextQuery(const TextQuery& query) {
+    // a line parseTextQuery reads back as query; the search goes last and unquoted, so any text survives
+    const QueryRequest& r = query.request;
+    std::ostringstream out;
+    out << "mode=" << TEXT_QUERY_MODES[r.recommendMode];
+    if (r.pinnedSeed != std::numeric_limits<uint32_t>::max()) out << " seed=" << r.pinnedSeed;
+    if (r.seedFromFeatures) out << " like=" << r.likeSeed[0] << "," << r.likeSeed[1] << "," << r.likeSeed[2];
+    out << " by=" << (r.searchMode == 1 ? "artist" : "title")
+        << " features=" << (r.useEnergy ? "e" : "") << (r.useDance ? "d" : "") << (r.useAcoustic ? "a" : "")
+        << " margin=" << r.margin << " filter=" << (r.prioritize ? 1 : 0)
+        << " metric=" << (r.embeddingMetric == 1 ? "l2" : "dot") << " ef=" << r.hnswEf
+        << " sort=" << (r.sortChoice == 0 ? "artist" : r.sortChoice == 1 ? "title" : "similar")
+        << " algorithm=" << (r.sortAlgorithm == 1 ? "merge" : "quick") << " limit=" << query.limit;
+    if (!r.search.empty()) out << " search=" << r.search;
+    return out.str();
+}
+
+void writeTextResult(std::ostream& out, const std::vector<Song>& songs, size_t number, const TextQuery& query, const QueryOutput& output) {
+    StageTimer timer(Stage::Render);
+    const QueryRequest& r = query.request;
+    if (r.seedFromFeatures) {
+        out << "# query " << number << ": seed like " << r.likeSeed[0] << "," << r.likeSeed[1] << "," << r.likeSeed[2];
+    } else if (output.seed.id >= songs.size()) {
+        out << "# query " << number << ": no seed matches \"" << r.search << "\"\n";
+        return;
+    } else {
+        out << "# query " << number << ": seed " << output.seed.id << " " << escapeTextField(output.seed.artist) << " - " << escapeTextField(output.seed.title);
+    }
+    out << ", mode " << TEXT_QUERY_MODES[output.recommendMode] << ", " << output.ids.size() << " results, sort " << output.sortMs << " ms\n";
+    size_t shown = query.limit == 0 ? output.ids.size() : std::min(query.limit, output.ids.size());
+    for (size_t k = 0; k < shown; k++) writeTextRow(out, number, songs[output.ids[k]]);
+}
+
+std::string escapeTextField(std::string_view text) {
+    // backslash, tab, newline and carriage return as \\, \t, \n and \r, so a field stays within its column and line
+    std::string out;
+    out.reserve(text.size());
+    for (char c : text) {
+        switch (c) {
+        case '\\': out += "\\\\"; break;
+        case '\t': out += "\\t"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        default: out += c;
+        }
+    }
+    return out;
+}
+
+std::string unescapeTextField(std::string_view text) {
+    // reverses escapeTextField; a backslash before any other character is kept as it is
+    std::string out;
+    out.reserve(text.size());
+    for (size_t i = 0; i < text.size(); i++) {
+        char next = i + 1 < text.size() ? text[i + 1] : '\0';
+        if (text[i] != '\\' || (next != '\\' && next != 't' && next != 'n' && next != 'r')) {
+            out += text[i];
+            continue;
+        }
+        out += next == 't' ? '\t' : next == 'n' ? '\n' : next == 'r' ? '\r' : '\\';
+        i++;
+    }
+    return out;
+}
+
+void writeTextRow(std::ostream& out, size_t number, const Song& s) {
+    out << number << '\t' << s.id << '\t' << escapeTextField(s.artist) << '\t' << escapeTextField(s.title) << '\t'
+        << s.energy << '\t' << s.danceability << '\t' << s.acousticness << '\n';
+}
+
+bool parseTextRow(const std::string& line, Song& s) {
+    // splits a row written by writeTextRow; a quoted CSV field can hold a tab or a line break, which writeTextRow
+    // escaped, so every tab in the line separates columns
+    std::string_view rest = line;
+    std::string_view fields[7];
+    for (int f = 0; f < 7; f++) {
+        size_t tab = f < 6 ? rest.find('\t') : rest.size();
+        if (tab == std::string_view::npos) return false;
+        fields[f] = rest.substr(0, tab);
+        rest.remove_prefix(std::min(rest.size(), tab + 1));
+    }
+    auto number = [](std::string_view text, auto& out) {
+        auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), out);
+        return ec == std::errc() && end == text.data() + text.size();
+    };
+    s = Song();
+    s.artist = unescapeTextField(fields[2]);
+    s.title = unescapeTextField(fields[3]);
+    return number(fields[1], s.id) && number(fields[4], s.energy) && number(fields[5], s.danceability) && number(fields[6], s.acousticness);
+}
@@ -0,0 +1,966 @@
+// Recommendation engine: catalog loading, the indexes built over it and query evaluation. Shared by the GUI and the
+// headless CLI, so nothing here touches ImGui, GLFW or OpenGL.
+#pragma once
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <filesystem>
+#include <cmath>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <cstdint>
+#include <limits>
+#include <thread>
+#include <string_view>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <charconv>
+#include <queue>
+#include <deque>
+#include <array>
+#include <bit>
+#include <list>
+#include <memory>
+#include <functional>
+#include <condition_variable>
+#include <memory_resource>
+#include <optional>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+struct ColdRef {
+    // raw byte range of a CSV field inside the mapped catalog file; escaped when it still contains "" pairs
+    uint64_t offset = 0;
+    uint32_t length = 0;
+    bool escaped = false;
+};
+
+struct Song {
+    // song structure: artist, title of track, and three recommendation variables
+    uint32_t id = 0; // position in the catalog vector
+    std::string artist;
+    std::string title;
+    ColdRef link;   // cold columns stay in the mapped file, see ColdColumns
+    ColdRef lyrics;
+    int energy;
+    int danceability;
+    int acousticness;
+};
+
+// Engine-wide work-stealing scheduler: one worker per spare hardware thread, each owning a deque per priority. A worker
+// pops its own newest task and steals the oldest from the others; interactive tasks always run before background
+// ones, so a query overtakes an index build at the build's next task boundary (nothing is interrupted mid-task, which
+// is why background loops are cut finer). Threads waiting on a TaskGroup run queued tasks meanwhile, so nested
+// parallelism neither deadlocks nor adds threads.
+enum class TaskPriority { Interactive, Background };
+constexpr size_t TASK_PRIORITIES = 2;
+constexpr size_t INTERACTIVE_CHUNKS_PER_THREAD = 4;
+constexpr size_t BACKGROUND_CHUNKS_PER_THREAD = 16;
+
+struct TaskScheduler {
+    using Task = std::function<void()>;
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks[TASK_PRIORITIES];
+    };
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<size_t> queued{0};
+    std::atomic<size_t> nextWorker{0}; // where tasks submitted from outside the pool go, round robin
+    size_t hardwareThreads = 1;
+
+    static TaskScheduler& instance();
+    explicit TaskScheduler(size_t hardwareThreads);
+    TaskScheduler(const TaskScheduler&) = delete;
+    TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+    size_t concurrency() const { return hardwareThreads; } // how many ways splitting work pays off
+    void submit(Task task, TaskPriority priority);
+    bool runOne(TaskPriority lowest); // runs one queued task no less urgent than lowest; false if there was none
+    void work(size_t index);
+};
+
+TaskPriority currentTaskPriority(); // what work started on this thread runs at; tasks inherit it from their submitter
+
+struct TaskPriorityScope {
+    // marks the work this thread starts while the scope lives, e.g. a rebuild in the background
+    TaskPriority previous;
+    explicit TaskPriorityScope(TaskPriority priority);
+    ~TaskPriorityScope();
+    TaskPriorityScope(const TaskPriorityScope&) = delete;
+    TaskPriorityScope& operator=(const TaskPriorityScope&) = delete;
+};
+
+struct TaskGroup {
+    // fork-join: run() queues a task, wait() returns once every task run() queued has finished
+    TaskPriority priority;
+    std::atomic<size_t> pending{0};
+    std::mutex mutex;
+    std::condition_variable done;
+
+    explicit TaskGroup(TaskPriority priority = currentTaskPriority()) : priority(priority) {}
+    ~TaskGroup() { wait(); }
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    void run(std::function<void()> task);
+    void wait();
+};
+
+template <typename Fn>
+void parallelFor(size_t count, Fn fn, size_t grain = 256) {
+    // splits [0, count) into chunks of at least grain items and runs fn(begin, end) on each as scheduler tasks,
+    // the calling thread included
+    size_t threads = TaskScheduler::instance().concurrency();
+    size_t perThread = currentTaskPriority() == TaskPriority::Background ? BACKGROUND_CHUNKS_PER_THREAD : INTERACTIVE_CHUNKS_PER_THREAD;
+    size_t chunks = std::min(threads * perThread, count / std::max<size_t>(1, grain));
+    if (threads <= 1 || chunks <= 1) {
+        fn(size_t(0), count);
+        return;
+    }
+    size_t chunk = (count + chunks - 1) / chunks;
+    TaskGroup group;
+    for (size_t begin = chunk; begin < count; begin += chunk) {
+        size_t end = std::min(count, begin + chunk);
+        group.run([&fn, begin, end]() { fn(begin, end); });
+    }
+    fn(size_t(0), chunk);
+    group.wait();
+}
+
+// Pipeline-stage latency. A StageTimer records its lifetime into the stage's histogram: log-linear buckets of
+// nanoseconds in the HDR style, 2^(STAGE_SUB_BUCKET_BITS - 1) per power of two, so any recorded value is known to
+// within about 3%. Recording is a few relaxed atomic adds, safe from any thread without locks. Stages nest: a
+// catalog load includes its parse, and a query's filter, score and sort run inside whatever front end timed it.
+enum class Stage { Load, Parse, SeedLookup, Filter, Score, Sort, Materialize, Render };
+constexpr size_t STAGE_COUNT = 8;
+constexpr std::array<const char*, STAGE_COUNT> STAGE_NAMES = {"load", "parse", "seed", "filter", "score", "sort", "materialize", "render"};
+constexpr int STAGE_SUB_BUCKET_BITS = 6;
+constexpr int STAGE_MAX_BITS = 44; // longer durations (over 4.8 hours) land in the last bucket
+constexpr size_t STAGE_BUCKETS = size_t(STAGE_MAX_BITS - STAGE_SUB_BUCKET_BITS + 2) << (STAGE_SUB_BUCKET_BITS - 1);
+
+struct StageHistogram {
+    std::array<std::atomic<uint64_t>, STAGE_BUCKETS> counts{};
+    std::atomic<uint64_t> sumNs{0};
+    std::atomic<uint64_t> maxNs{0};
+
+    void record(uint64_t ns);
+    void reset();
+};
+
+struct StageSummary {
+    // microseconds
+    uint64_t count = 0;
+    double p50 = 0, p95 = 0, p99 = 0, max = 0, mean = 0;
+};
+
+StageHistogram& stageHistogram(Stage stage);
+StageSummary summarizeStage(Stage stage);
+std::string stageReport(); // one "stage=... count=... p50_us=..." line per stage
+void resetStageHistograms();
+
+struct StageTimer {
+    Stage stage;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    explicit StageTimer(Stage stage) : stage(stage) {}
+    ~StageTimer();
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+};
+
+// Optional timeline tracing in the Chrome trace event format, for chrome://tracing or ui.perfetto.dev. Between
+// startTrace() and stopTrace() every TraceScope, StageTimer and scheduler task records one complete event (name,
+// start, duration) into its thread's ring buffer of TRACE_RING_EVENTS, overwriting the oldest; stopTrace() writes
+// what the rings hold as trace JSON. Threads keep writing while it does, since a ring is read by checking its write
+// count again afterwards and dropping the slots that may have been overwritten meanwhile. With tracing off a scope
+// costs one relaxed load and a branch that is always predicted.
+constexpr size_t TRACE_RING_EVENTS = 1 << 16;
+
+extern std::atomic<bool> traceEnabled;
+
+void startTrace();
+bool stopTrace(const std::filesystem::path& path); // false if the file could not be written
+void nameTraceThread(std::string name);             // how the calling thread is labeled in the trace
+void traceComplete(const char* name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+
+struct TraceScope {
+    // name must outlive the trace, e.g. a string literal
+    const char* name = nullptr;
+    std::chrono::steady_clock::time_point start;
+    explicit TraceScope(const char* name) {
+        if (traceEnabled.load(std::memory_order_relaxed)) {
+            this->name = name;
+            start = std::chrono::steady_clock::now();
+        }
+    }
+    ~TraceScope() {
+        if (name) traceComplete(name, start, std::chrono::steady_clock::now());
+    }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+};
+
+std::string normalize(const std::string& s);
+
+// Contiguous array used by the indexes. Builders fill it like a std::vector; a catalog attached from a shared image
+// (see attachCatalogImage) points it at the mapped bytes instead, so processes on one host read a single copy.
+// A mapped column is read-only; the mapping is PROT_READ, so a stray write faults instead of diverging between processes.
+template <typename T>
+struct Column {
+    std::vector<T> owned;
+    const T* items = nullptr; // owned.data(), or the mapping when mapped
+    size_t count = 0;
+    bool mapped = false;
+
+    Column() = default;
+    Column(std::vector<T> values) : owned(std::move(values)) { sync(); }
+    Column(const Column& other) : owned(other.owned), mapped(other.mapped) { follow(other); }
+    Column(Column&& other) noexcept : owned(std::move(other.owned)), mapped(other.mapped) { follow(other); other.reset(); }
+    Column& operator=(const Column& other) {
+        if (this != &other) {
+            owned = other.owned;
+            mapped = other.mapped;
+            follow(other);
+        }
+        return *this;
+    }
+    Column& operator=(Column&& other) noexcept {
+        if (this != &other) {
+            owned = std::move(other.owned);
+            mapped = other.mapped;
+            follow(other);
+            other.reset();
+        }
+        return *this;
+    }
+
+    void view(const T* data, size_t size) {
+        // shares size elements at data, which must outlive the column
+        owned = std::vector<T>();
+        items = data;
+        count = size;
+        mapped = true;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T* data() const { return items; }
+    const T* begin() const { return items; }
+    const T* end() const { return items + count; }
+    const T& operator[](size_t i) const { return items[i]; }
+    const T& back() const { return items[count - 1]; }
+    T* data() { return const_cast<T*>(items); }
+    T* begin() { return data(); }
+    T* end() { return data() + count; }
+    T& operator[](size_t i) { return data()[i]; }
+    T& back() { return data()[count - 1]; }
+
+    void resize(size_t n) { owned.resize(n); sync(); }
+    void resize(size_t n, const T& value) { owned.resize(n, value); sync(); }
+    void assign(size_t n, const T& value) { owned.assign(n, value); sync(); }
+    template <typename It>
+    void assign(It first, It last) { owned.assign(first, last); sync(); }
+    void reserve(size_t n) { owned.reserve(n); sync(); }
+    void push_back(const T& value) { owned.push_back(value); sync(); }
+    template <typename... Args>
+    T& emplace_back(Args&&... args) { owned.emplace_back(std::forward<Args>(args)...); sync(); return owned.back(); }
+    void clear() { owned.clear(); sync(); }
+    void shrink_to_fit() { owned.shrink_to_fit(); sync(); }
+
+private:
+    void sync() {
+        items = owned.data();
+        count = owned.size();
+        mapped = false;
+    }
+    void follow(const Column& other) {
+        if (!mapped) {
+            items = owned.data();
+            count = owned.size();
+        } else {
+            items = other.items;
+            count = other.count;
+        }
+    }
+    void reset() {
+        owned.clear();
+        sync();
+    }
+};
+
+struct MappedFile {
+    // read-only memory mapping of a whole file; pages are faulted in by the OS only when touched
+    const char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE fileHandle = INVALID_HANDLE_VALUE;
+    HANDLE mappingHandle = nullptr;
+#endif
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile(MappedFile&& other) noexcept { *this = std::move(other); }
+    MappedFile& operator=(MappedFile&& other) noexcept {
+        if (this != &other) {
+            close();
+            std::swap(data, other.data);
+            std::swap(size, other.size);
+#ifdef _WIN32
+            std::swap(fileHandle, other.fileHandle);
+            std::swap(mappingHandle, other.mappingHandle);
+#endif
+        }
+        return *this;
+    }
+    ~MappedFile() { close(); }
+
+    bool open(const std::filesystem::path& path);
+    void close();
+    void adviseSequential() const;
+    void evict();
+
+    std::string_view view() const { return std::string_view(data ? data : "", size); }
+};
+
+struct ColdColumns {
+    // owns the mapping that every Song::link and Song::lyrics ColdRef points into
+    MappedFile file;
+
+    std::string_view raw(const ColdRef& ref) const {
+        // field bytes exactly as stored; "" escapes are left in place
+        if (ref.offset + ref.length > file.size) return {};
+        return file.view().substr(ref.offset, ref.length);
+    }
+
+    std::string read(const ColdRef& ref) const {
+        // pages the field in and returns it with "" escapes collapsed
+        std::string_view bytes = raw(ref);
+        if (!ref.escaped) return std::string(bytes);
+        std::string out;
+        out.reserve(bytes.size());
+        for (size_t i = 0; i < bytes.size(); i++) {
+            out += bytes[i];
+            if (bytes[i] == '"' && i + 1 < bytes.size() && bytes[i + 1] == '"') i++;
+        }
+        return out;
+    }
+};
+
+// The part of a catalog one process serves when it is split across several (see MusicSuggestionsServer --shard).
+// Songs are assigned by artist, so an artist's duplicates and later updates always land in the same shard.
+struct CatalogShard {
+    uint32_t index = 0, count = 1;
+    bool owns(const std::string& artist) const;
+};
+
+constexpr size_t CSV_SLICE_MIN_BYTES = 1 << 20; // loadSongs parses the file in slices of at least this size in parallel
+
+std::filesystem::path resourcePath(const std::string& filename);
+std::vector<Song> loadSongs(const std::string& filename, ColdColumns& cold, const CatalogShard& shard = {});
+
+// MinHash parameters: LYRIC_BANDS * LYRIC_ROWS must equal LYRIC_HASHES. Three rows per band puts the
+// LSH threshold near a Jaccard of 0.3 over content words, which is where thematically similar lyrics sit.
+constexpr int LYRIC_HASHES = 96;
+constexpr int LYRIC_BANDS = 32;
+constexpr int LYRIC_ROWS = LYRIC_HASHES / LYRIC_BANDS;
+constexpr size_t LYRIC_MAX_BUCKET = 2000; // buckets larger than this are boilerplate (e.g. "instrumental") and skipped
+
+struct LyricIndex {
+    // MinHash signatures (LYRIC_HASHES per song, row-major by song id) plus one sorted (bandKey, id) table per band
+    Column<uint32_t> signatures;
+    Column<uint8_t> hasLyrics;
+    std::vector<Column<std::pair<uint64_t, uint32_t>>> bands;
+};
+
+uint64_t mix64(uint64_t x);
+uint64_t hashBytes(const char* p, size_t n, uint64_t h = 1469598103934665603ULL);
+uint64_t songKeyHash(const std::string& artist, const std::string& title);
+LyricIndex computeLyricSignatures(const std::vector<Song>& songs, const ColdColumns& cold);
+void buildLyricBands(LyricIndex& index);
+LyricIndex buildLyricIndex(const std::vector<Song>& songs, const ColdColumns& cold);
+double signatureSimilarity(const LyricIndex& index, uint32_t a, uint32_t b);
+
+constexpr double NEAR_DUPLICATE_JACCARD = 0.9; // same artist and at least this lyric overlap counts as the same song
+
+// canonical song id (after compaction) -> the rows that were folded into it
+using DuplicateGroups = std::unordered_map<uint32_t, std::vector<Song>>;
+
+DuplicateGroups dedupeSongs(std::vector<Song>& songs, LyricIndex& index);
+std::vector<std::pair<uint32_t, double>> similarLyrics(const LyricIndex& index, uint32_t seedId, size_t k);
+
+enum class EmbeddingMetric { Dot, L2 };
+
+constexpr size_t EMBEDDING_BLOCK = 256; // rows scored per kernel call; keeps the score buffer and a row tile in L1/L2
+
+std::unordered_map<uint64_t, uint32_t> songIdsByKey(const std::vector<Song>& songs, const DuplicateGroups& duplicates);
+
+struct EmbeddingTable {
+    // one float vector per catalog song, row-major, each row zero-padded to a multiple of 8 floats for the SIMD kernels.
+    // The side file stays mapped so exact vectors can still be re-read after data is released for a compressed index.
+    size_t dim = 0;
+    size_t stride = 0;
+    Column<float> data;
+    Column<uint8_t> hasEmbedding;
+    Column<uint64_t> lineOffset; // start of each song's line in file
+    MappedFile file;
+
+    const float* row(uint32_t id) const { return &data[static_cast<size_t>(id) * stride]; }
+
+    bool exactRow(uint32_t id, float* out) const;
+
+    void releaseVectors() {
+        // drops the in-memory floats once a compressed index has been built from them
+        data.clear();
+        data.shrink_to_fit();
+    }
+};
+
+EmbeddingTable loadEmbeddings(const std::string& filename, const std::vector<Song>& songs, const DuplicateGroups& duplicates);
+std::vector<std::pair<uint32_t, float>> nearestEmbeddings(const EmbeddingTable& table, const float* query, size_t k, EmbeddingMetric metric, uint32_t exclude);
+
+// Product quantization: each (residual) vector is split into PQ subspaces and every subspace is stored as a 4-bit
+// centroid index, so a song costs subspaces / 2 bytes. 4-bit codes let a 16-entry lookup table sit in one SIMD
+// register, and 32 songs are scored per subspace with a single byte shuffle.
+constexpr size_t PQ_CENTROIDS = 16;
+constexpr size_t PQ_BLOCK = 32;              // songs per fast-scan block
+constexpr size_t PQ_TRAIN_SAMPLES = 20000;   // k-means training sample cap
+constexpr double PQ_TARGET_RECALL = 0.9;     // recall@10 the tuner aims for against the exact scan
+
+struct PQIndex {
+    // IVF coarse lists (a single list when flat) holding 4-bit PQ codes of each song's residual to its list centroid
+    size_t dim = 0;            // padded dimension, a multiple of subspaces
+    size_t subspaces = 0;
+    size_t subDim = 0;
+    size_t lists = 1;
+    Column<float> coarse;                 // lists * dim
+    Column<float> codebooks;              // subspaces * PQ_CENTROIDS * subDim
+    Column<uint32_t> listBlocks;          // CSR: first block of each list, lists + 1 entries
+    Column<uint8_t> codes;                // per block: subspaces * 16 bytes, song j and j + 16 share a byte
+    Column<uint32_t> ids;                 // per block: PQ_BLOCK song ids, UINT32_MAX for padding
+    size_t nprobe = 1;                    // lists visited per query
+    size_t rerank = 4;                    // shortlist size as a multiple of k, re-scored with exact vectors
+
+    size_t bytes() const {
+        return coarse.size() * sizeof(float) + codebooks.size() * sizeof(float) + listBlocks.size() * sizeof(uint32_t) + codes.size() + ids.size() * sizeof(uint32_t);
+    }
+};
+
+PQIndex buildPQIndex(const EmbeddingTable& table, size_t subspaces, size_t lists);
+std::vector<std::pair<uint32_t, float>> searchPQ(const PQIndex& index, const EmbeddingTable& table, const float* query, size_t k, EmbeddingMetric metric, uint32_t exclude);
+double tunePQ(PQIndex& index, const EmbeddingTable& table, EmbeddingMetric metric, double targetRecall);
+
+// HNSW (hierarchical navigable small world) graph over the in-memory embeddings, squared L2 distance.
+// Level 0 keeps up to 2 * HNSW_M links per song, upper levels HNSW_M; links are UINT32_MAX-terminated.
+constexpr size_t HNSW_M = 16;
+constexpr size_t HNSW_EF_CONSTRUCTION = 100;
+constexpr size_t HNSW_LOCK_STRIPES = 4096;
+constexpr uint32_t HNSW_NONE = std::numeric_limits<uint32_t>::max();
+constexpr uint64_t EMBEDDING_MEMORY_BUDGET = 256ULL << 20; // above this many bytes of floats, embeddings are compressed (PQIndex) instead
+
+struct HNSWIndex {
+    // graph over song ids; songs without an embedding have level -1 and no links
+    size_t count = 0;
+    size_t dim = 0;
+    int maxLevel = -1;
+    uint32_t entry = HNSW_NONE;
+    uint64_t fingerprint = 0;            // catalog identity the serialized graph was built for
+    Column<int8_t> levels;
+    Column<uint32_t> links0;             // count * 2 * HNSW_M
+    std::vector<Column<uint32_t>> upperLinks; // per song: levels[id] * HNSW_M
+
+    uint32_t* links(uint32_t id, int level) {
+        return level == 0 ? &links0[static_cast<size_t>(id) * 2 * HNSW_M] : &upperLinks[id][static_cast<size_t>(level - 1) * HNSW_M];
+    }
+    const uint32_t* links(uint32_t id, int level) const {
+        return level == 0 ? &links0[static_cast<size_t>(id) * 2 * HNSW_M] : &upperLinks[id][static_cast<size_t>(level - 1) * HNSW_M];
+    }
+    static size_t capacity(int level) { return level == 0 ? 2 * HNSW_M : HNSW_M; }
+};
+
+uint64_t embeddingFingerprint(const std::vector<Song>& songs, const EmbeddingTable& table);
+HNSWIndex buildHNSW(const EmbeddingTable& table, uint64_t fingerprint);
+std::vector<std::pair<uint32_t, float>> searchHNSW(const HNSWIndex& index, const EmbeddingTable& table, const float* query, size_t k, size_t ef, uint32_t exclude);
+double measureHNSWRecall(const HNSWIndex& index, const EmbeddingTable& table, size_t ef);
+bool saveHNSW(const HNSWIndex& index, const std::filesystem::path& path);
+bool loadHNSW(HNSWIndex& index, const std::filesystem::path& path, uint64_t fingerprint, size_t count, size_t dim);
+
+std::vector<Song> recommendSongs(const std::vector<Song>& songs, const Song& seed, int margin, bool useEnergy, bool useDance, bool useAcoustic, bool prioritizeSearch, const std::string& term);
+
+// Batch evaluation: each catalog block's features are copied into three int columns (energy, danceability,
+// acousticness; 48 KiB together) that stay in L1/L2, then every pending query is tested against them with a
+// vectorizable compare pass before moving on, so the catalog streams through cache once per batch.
+constexpr size_t BATCH_BLOCK = 4096;
+
+struct BatchQuery {
+    // one feature query, with the same parameters recommendSongs() takes
+    Song seed;
+    int margin = 10;
+    bool useEnergy = false, useDance = false, useAcoustic = false;
+    bool prioritizeSearch = false;
+    std::string term;
+};
+
+std::vector<std::vector<uint32_t>> recommendBatch(const std::vector<Song>& songs, const std::vector<BatchQuery>& queries, const std::function<bool()>& cancelled = nullptr);
+
+enum class PlaylistMode { Union, Intersection, Centroid };
+
+Song playlistCentroid(const std::vector<Song>& songs, const std::vector<uint32_t>& seedIds);
+std::vector<Song> recommendForPlaylist(const std::vector<Song>& songs, const std::vector<uint32_t>& seedIds, PlaylistMode mode, int margin, bool useEnergy, bool useDance, bool useAcoustic, bool prioritizeSearch, const std::string& term);
+double similarityScore(const Song& a, const Song& seed, bool useEnergy, bool useDance, bool useAcoustic);
+
+// Per-feature columns bucketed by value, so a margin change only has to visit the songs in the shell between the
+// old and new boxes instead of rescanning the catalog.
+struct FeatureColumns {
+    int lo[3] = {0, 0, 0}, hi[3] = {-1, -1, -1};
+    Column<uint32_t> offsets[3]; // bucket v - lo spans ids[offsets[v - lo], offsets[v - lo + 1])
+    Column<uint32_t> ids[3];     // song ids grouped by value, catalog order within a value
+};
+
+int featureValue(const Song& s, int feature);
+FeatureColumns buildFeatureColumns(const std::vector<Song>& songs, const std::vector<uint8_t>& tombstones = {});
+
+struct MarginQuery {
+    // a feature query whose result is kept so margin changes can be applied incrementally
+    Song seed;
+    int margin = 0;
+    bool use[3] = {false, false, false};
+    bool filterTerm = false;
+    std::string term;
+    std::vector<uint32_t> ids; // current matches in catalog order, as recommendSongs() returns them
+};
+
+bool marginMatches(const MarginQuery& query, const Song& s);
+std::vector<uint32_t> updateMargin(const std::vector<Song>& songs, const FeatureColumns& columns, MarginQuery& query, int margin);
+
+// Precomputed k-nearest-neighbor graph over the three features (L1, i.e. similarityScore with every feature on).
+// Songs are bucketed into a grid sized for about FEATURE_CELL_SONGS per cell so each search only visits nearby cells.
+constexpr size_t FEATURE_NEIGHBORS = 32;
+constexpr double FEATURE_CELL_SONGS = 8.0;
+
+struct NeighborGraph {
+    // CSR adjacency: neighbors of song i are neighbors[offsets[i] .. offsets[i + 1]), nearest first
+    Column<uint32_t> offsets;
+    Column<uint32_t> neighbors;
+    Column<float> weights; // optional, parallel to neighbors
+
+    size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    const uint32_t* begin(uint32_t id) const { return neighbors.data() + offsets[id]; }
+    const uint32_t* end(uint32_t id) const { return neighbors.data() + offsets[id + 1]; }
+};
+
+NeighborGraph buildFeatureNeighborGraph(const std::vector<Song>& songs, size_t k);
+
+// Item-item collaborative filtering over listening logs. Log files live in resources/logs/, one play per line as
+// "session<TAB>artist<TAB>title", with each session's plays contiguous and in order. Two songs co-occur when they
+// are played within CF_WINDOW plays of each other in one session.
+constexpr size_t CF_WINDOW = 5;
+constexpr size_t CF_TOP_N = 50;                 // neighbors kept per song
+constexpr size_t CF_MAX_LOCAL_PAIRS = 1 << 22;  // per-task pair table size that triggers dropping the rarest half
+constexpr size_t CF_MAX_PAIRS = 1 << 23;        // pairs kept across the merged tables, which bounds the graph build too
+constexpr size_t CF_CHUNK_BYTES = 4 << 20;
+constexpr size_t CF_SHARDS = 64;
+
+NeighborGraph buildCoPlayGraph(const std::vector<std::filesystem::path>& logs, const std::unordered_map<uint64_t, uint32_t>& idByKey, size_t songCount, size_t topN);
+std::vector<std::filesystem::path> listeningLogs();
+
+// Per-query scratch memory. Every thread has a QueryArena, a monotonic buffer the transient memory of a query (sort
+// rows, their keys, merge buffers, scan scratch) is carved from, released in one step when the thread's outermost
+// QueryArenaScope ends. The buffer grows to the largest query seen, up to QUERY_ARENA_MAX_BYTES, so repeated
+// queries stop reaching the heap. Nothing taken from it may outlive the scope.
+constexpr size_t QUERY_ARENA_BYTES = 1 << 20;
+constexpr size_t QUERY_ARENA_MAX_BYTES = 64 << 20;
+
+struct QueryArena {
+    struct Upstream : std::pmr::memory_resource {
+        // the heap, counting what the arena takes once its buffer is used up
+        size_t spilled = 0;
+        void* do_allocate(size_t bytes, size_t alignment) override;
+        void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+    };
+    std::unique_ptr<std::byte[]> buffer;
+    size_t capacity = 0;
+    Upstream upstream;
+    std::optional<std::pmr::monotonic_buffer_resource> resource;
+    int depth = 0;
+
+    std::pmr::memory_resource* memory();
+    void release();
+};
+
+std::pmr::memory_resource* queryMemory(); // the calling thread's arena
+
+struct QueryArenaScope {
+    QueryArenaScope();
+    ~QueryArenaScope();
+    QueryArenaScope(const QueryArenaScope&) = delete;
+    QueryArenaScope& operator=(const QueryArenaScope&) = delete;
+};
+
+// A row being sorted: its normalized artist or title (in the query arena) for the name sorts, or its
+// similarityScore for "Most Similar", so comparisons neither copy songs nor normalize strings.
+struct SortRow {
+    std::string_view key;
+    double score = 0;
+    uint32_t id = 0;
+};
+
+// Ranges at least SORT_FORK_MIN long sort their halves (partitions, for quickSort) as parallel tasks.
+constexpr int SORT_FORK_MIN = 4096;
+
+void quickSort(std::pmr::vector<SortRow>& rows, int low, int high);
+void mergeSort(std::pmr::vector<SortRow>& rows, int l, int r);
+
+// Query result cache: GUI queries are keyed by their normalized parameters so repeated clicks and sort-only
+// changes reuse the filtered candidate ids and whatever orderings were already computed for them.
+constexpr size_t QUERY_CACHE_CAPACITY = 64;
+constexpr int QUERY_ORDERINGS = 6; // sortChoice (Artist, Title, Most Similar) x sortAlgorithm (Quick, Merge)
+
+struct QueryKey {
+    int mode = 0; // recommendMode, or -1 - playlistMode for playlist queries
+    uint32_t seedId = std::numeric_limits<uint32_t>::max();
+    int energy = 0, danceability = 0, acousticness = 0;
+    int margin = 0;
+    uint8_t features = 0; // bit 0 energy, bit 1 danceability, bit 2 acousticness
+    std::string term;     // empty unless the search term filters results
+    int metric = 0, ef = 0;
+    std::vector<uint32_t> playlist;
+    bool operator==(const QueryKey&) const = default;
+};
+
+struct QueryKeyHash {
+    size_t operator()(const QueryKey& k) const {
+        uint64_t h = mix64(static_cast<uint64_t>(static_cast<uint32_t>(k.mode)) << 32 | k.seedId);
+        h = mix64(h ^ (static_cast<uint64_t>(k.energy) << 42 | static_cast<uint64_t>(k.danceability) << 28 | static_cast<uint64_t>(k.acousticness) << 14 | k.features));
+        h = mix64(h ^ (static_cast<uint64_t>(k.margin) << 40 | static_cast<uint64_t>(k.metric) << 32 | static_cast<uint32_t>(k.ef)));
+        h = hashBytes(k.term.data(), k.term.size(), h);
+        return hashBytes(reinterpret_cast<const char*>(k.playlist.data()), k.playlist.size() * sizeof(uint32_t), h);
+    }
+};
+
+QueryKey normalizeQueryKey(QueryKey key);
+
+struct QueryResult {
+    std::vector<uint32_t> candidates;             // ids in the order the engine produced them
+    bool modelRanked = false;                     // candidates already arrive "Most Similar" first
+    std::array<std::vector<uint32_t>, QUERY_ORDERINGS> orders;
+    std::array<bool, QUERY_ORDERINGS> sorted{};
+    std::array<double, QUERY_ORDERINGS> sortMs{};
+};
+
+struct QueryCache {
+    size_t capacity;
+    uint64_t catalogVersion = 0;
+    std::list<std::pair<QueryKey, std::shared_ptr<QueryResult>>> entries; // most recently used first
+    std::unordered_map<QueryKey, decltype(entries)::iterator, QueryKeyHash> index;
+
+    explicit QueryCache(size_t capacity) : capacity(capacity) {}
+
+    void validate(uint64_t version) {
+        // results computed against an older catalog are discarded wholesale
+        if (version == catalogVersion) return;
+        entries.clear();
+        index.clear();
+        catalogVersion = version;
+    }
+    std::shared_ptr<QueryResult> find(const QueryKey& key) {
+        auto it = index.find(key);
+        if (it == index.end()) return nullptr;
+        entries.splice(entries.begin(), entries, it->second);
+        return it->second->second;
+    }
+    void insert(const QueryKey& key, std::shared_ptr<QueryResult> result) {
+        auto it = index.find(key);
+        if (it != index.end()) {
+            entries.erase(it->second);
+            index.erase(it);
+        }
+        entries.emplace_front(key, std::move(result));
+        index.emplace(key, entries.begin());
+        if (entries.size() > capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+    }
+};
+
+// Everything a query reads, loaded once by loadCatalog()
+struct CatalogView {
+    const std::vector<Song>& songs;
+    const LyricIndex& lyricIndex;
+    const EmbeddingTable& embeddings;
+    const PQIndex& embeddingIndex;
+    const HNSWIndex& embeddingGraph;
+    const NeighborGraph& neighborGraph;
+    const std::atomic<bool>& neighborGraphReady; // neighborGraph is built in the background
+    const NeighborGraph& coPlayGraph;
+    const FeatureColumns& featureColumns;
+    const std::vector<uint8_t>& tombstones; // songs replaced or deleted by later catalog rows
+    uint64_t version = 1; // unique per loaded catalog, so cached results never outlive the catalog they came from
+};
+
+// One query as the GUI controls (or a CLI line) describe it, and what comes back for it
+struct QueryRequest {
+    enum class Kind { Search, Playlist };
+    Kind kind = Kind::Search;
+    std::string search;
+    int searchMode = 0; // 0 = Title, 1 = Artist
+    bool reseed = false; // pick the seed again even if the search text is unchanged
+    uint32_t pinnedSeed = std::numeric_limits<uint32_t>::max(); // "More like this" fixes the seed instead of searching
+    bool seedFromFeatures = false; // seeds with likeSeed's features instead of a catalog song (feature queries only)
+    int likeSeed[3] = {0, 0, 0};   // energy, danceability, acousticness
+    bool useEnergy = false, useDance = false, useAcoustic = false, prioritize = false;
+    int margin = 10;
+    int recommendMode = 0, embeddingMetric = 0, hnswEf = 64;
+    int sortChoice = 0, sortAlgorithm = 0;
+    std::vector<uint32_t> playlist;
+    int playlistMode = 0;
+    bool operator==(const QueryRequest&) const = default;
+};
+
+struct Catalog;
+
+struct QueryOutput {
+    uint64_t generation = 0;
+    Song seed;
+    std::shared_ptr<const Catalog> catalog; // the snapshot ids and seed refer to
+    int recommendMode = 0;        // the mode that actually ran
+    std::vector<uint32_t> ids;    // song ids in display order
+    double sortMs = 0.0;
+    bool sortCached = false;
+    double pivotUs = -1.0;        // neighbor lookup time for pinned-seed "More like this" queries
+    double latencyMs = 0.0;       // from post() to publication
+    QueryRequest request;         // what produced it (set by QueryWorker), for anything derived from the shown results
+};
+
+// Synchronous query evaluation with the state the GUI relies on between requests: a result cache, the current
+// seed (re-searched only when the search text changes) and the live feature query that margin changes update in place.
+// run() returns null when cancelled reports true at one of its checkpoints
+struct QueryEngine {
+    CatalogView catalog;
+    QueryCache cache{QUERY_CACHE_CAPACITY};
+    std::shared_ptr<QueryResult> current;
+    MarginQuery marginQuery; // the shown feature query, kept so margin changes can be applied in place
+    bool marginQueryLive = false;
+    Song seed;
+    bool seedFromSearch = false;
+    std::string seedSearch;
+    int seedSearchMode = 0;
+    bool sortCached = false; // the last sortCurrent() found its ordering already computed
+
+    explicit QueryEngine(CatalogView catalog) : catalog(catalog) {}
+
+    std::unique_ptr<QueryOutput> run(const QueryRequest& r, const std::function<bool()>& cancelled = nullptr);
+
+    QueryKey makeQueryKey(const QueryRequest& r, int mode) const;
+    bool runQuery(const QueryRequest& r, int mode, const std::function<bool()>& cancelled);
+    int sortCurrent(const QueryRequest& r);
+    bool applyMargin(const QueryRequest& r);
+};
+
+std::vector<QueryOutput> runQueries(const CatalogView& catalog, const std::vector<QueryRequest>& requests, bool parallel = true);
+bool resolveSeed(const CatalogView& catalog, const QueryRequest& r, Song& seed); // a search request's seed; false if none matches
+bool orderedBefore(const Song& a, const Song& b, const QueryRequest& r, const Song& seed); // the order feature results are sorted in
+
+// The catalog file is treated as an append log. A row whose lyrics start with CATALOG_UPDATE_MARKER replaces the
+// first earlier row with its (normalized) artist and title in place, keeping that song's id, and the rest of the
+// field is its lyrics; a row whose lyrics are CATALOG_DELETE_MARKER removes every earlier row with them. Any other
+// row is a song of its own, even when it repeats one, and is left for dedupeSongs to fold. A full load resolves the
+// log before indexing; rows appended after that are applied as deltas (see CatalogWatcher).
+constexpr std::string_view CATALOG_DELETE_MARKER = "[deleted]";
+constexpr std::string_view CATALOG_UPDATE_MARKER = "[updated]";
+
+enum class CatalogRow : uint8_t { Add, Update, Delete };
+constexpr size_t CATALOG_MERGE_ROWS = 2048; // appended or deleted rows that trigger a background rebuild of the main segment
+
+// The main segment: every index built by a full load. Snapshots derived from it by appended deltas share it unchanged.
+// The feature neighbor graph is built as a background task; neighborGraphReady flips once it is usable
+struct CatalogSegment {
+    size_t songCount = 0; // songs [0, songCount) of every snapshot sharing this segment are indexed
+    LyricIndex lyricIndex;
+    DuplicateGroups duplicates;
+    std::unordered_map<uint64_t, uint32_t> idByKey; // songKeyHash -> id, folded duplicates included
+    EmbeddingTable embeddings;
+    PQIndex embeddingIndex;
+    HNSWIndex embeddingGraph;
+    NeighborGraph coPlayGraph;
+    NeighborGraph neighborGraph;
+    std::atomic<bool> neighborGraphReady{false};
+    mutable TaskGroup neighborGraphBuild{TaskPriority::Background}; // waited on by waitForNeighborGraph(), which readers of a shared snapshot may call
+    std::mutex readyMutex;
+    std::function<void()> onNeighborGraphReady;
+    MappedFile image; // the shared catalog image the indexes view, when attached rather than built
+
+    CatalogSegment() = default;
+    CatalogSegment(const CatalogSegment&) = delete;
+    CatalogSegment& operator=(const CatalogSegment&) = delete;
+    ~CatalogSegment();
+
+    void whenNeighborGraphReady(std::function<void()> callback);
+    void waitForNeighborGraph() const;
+};
+
+// One catalog snapshot: the main segment's songs followed by the rows appended since (the delta segment), with
+// tombstones over whichever songs later rows replaced or deleted
+struct Catalog {
+    ColdColumns cold;                // the file as of this snapshot; appending leaves earlier ColdRefs valid
+    std::vector<Song> songs;
+    std::vector<uint8_t> tombstones; // per song id
+    size_t tombstoneCount = 0;
+    size_t updateCount = 0;          // rows applied in place since the main segment was built
+    std::unordered_map<uint64_t, std::vector<uint32_t>> deltaIds; // songKeyHash -> ids of live appended songs, oldest first
+    std::shared_ptr<CatalogSegment> main;
+    FeatureColumns featureColumns;   // live songs only
+    uint64_t version = 1;
+    uint64_t loadedBytes = 0;        // the file prefix this snapshot reflects, ending at a record boundary
+    uint64_t tailHash = 0;           // hash of the bytes just before loadedBytes, to tell an append from a rewrite
+    CatalogShard shard;              // rows of other shards are skipped, deltas included
+
+    void whenNeighborGraphReady(std::function<void()> callback) { main->whenNeighborGraphReady(std::move(callback)); }
+    void waitForNeighborGraph() const { main->waitForNeighborGraph(); }
+    size_t deltaSize() const { return songs.size() - main->songCount + tombstoneCount + updateCount; }
+    CatalogView view() const;
+};
+
+std::unique_ptr<Catalog> loadCatalog(const std::string& filename = "songdata.csv", const CatalogShard& shard = {});
+std::unique_ptr<Catalog> appendCatalogDelta(const Catalog& base, const std::string& filename, bool& rewritten);
+
+// Shared catalog image: one process writes the loaded catalog and its finished indexes to a file in shared memory
+// (/dev/shm on Linux) as 64-byte aligned sections addressed by offset, and others on the host map it read-only.
+// Attached indexes are Columns viewing the mapping, so they cost no private memory and need no build; only the
+// songs, duplicate groups and key map are unpacked per process. The image names the file prefix it was built
+// from, so rows appended since are applied as a delta, and a rewritten catalog or changed embeddings.tsv or
+// listening logs make it stale.
+std::filesystem::path catalogImagePath(const std::string& filename, const CatalogShard& shard = {});
+bool saveCatalogImage(const Catalog& catalog, const std::filesystem::path& path);
+std::unique_ptr<Catalog> attachCatalogImage(const std::filesystem::path& path, const std::string& filename, const CatalogShard& shard = {});
+std::unique_ptr<Catalog> loadCatalogShared(const std::string& filename = "songdata.csv", const CatalogShard& shard = {});
+
+// Hot-swappable catalog. Each loaded catalog is published as an immutable, reference-counted snapshot behind one
+// atomic pointer, so a reload never blocks a query: readers pin the current epoch, load the pointer and either use
+// the snapshot in place (read) or take a reference to keep (acquire), all without locking. publish() swaps the
+// pointer and frees the old wrapper only once every reader pinned before the swap has moved on; queries already
+// running keep the old catalog alive through their references and finish against it.
+constexpr size_t EPOCH_READER_SLOTS = 128; // threads that can be inside a read at once; more wait for a free slot
+
+struct EpochGuard {
+    // pins the calling thread's epoch for its lifetime; guards may nest
+    EpochGuard();
+    ~EpochGuard();
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+struct CatalogStore {
+    struct Snapshot {
+        std::shared_ptr<const Catalog> catalog;
+    };
+    std::atomic<Snapshot*> current;
+    std::mutex writeMutex; // serializes publishers; readers never take it
+
+    explicit CatalogStore(std::shared_ptr<const Catalog> initial);
+    ~CatalogStore();
+    CatalogStore(const CatalogStore&) = delete;
+    CatalogStore& operator=(const CatalogStore&) = delete;
+
+    std::shared_ptr<const Catalog> acquire() const;
+    template <typename Fn>
+    decltype(auto) read(Fn&& fn) const {
+        // runs fn on the current catalog without touching its reference count; keep fn short, it delays reclamation
+        EpochGuard guard;
+        return fn(*current.load(std::memory_order_seq_cst)->catalog);
+    }
+    void publish(std::shared_ptr<const Catalog> next);
+};
+
+// Query worker: the UI posts its latest control state and a worker thread runs it through a QueryEngine, so a big
+// query never stalls a frame. Only the newest request matters; a running one is abandoned at its next checkpoint once
+// a newer one is posted, and finished results are handed back through a single atomic pointer swap.
+struct QueryWorker {
+    std::mutex mutex;
+    std::condition_variable wake;
+    QueryRequest pending;
+    std::chrono::steady_clock::time_point pendingPostedAt;
+    bool hasPending = false, stopping = false;
+    std::atomic<uint64_t> latest{0};              // generation of the newest posted request
+    std::atomic<QueryOutput*> published{nullptr}; // newest finished result not yet taken by the UI
+    std::function<void()> onPublish;              // called from the worker thread after each publication
+    const CatalogStore& store;
+    std::shared_ptr<const Catalog> engineCatalog; // the snapshot engine reads; replaced when a new one is published
+    std::unique_ptr<QueryEngine> engine;          // only touched by the worker thread
+    std::thread thread;
+
+    explicit QueryWorker(const CatalogStore& store);
+    ~QueryWorker();
+    QueryWorker(const QueryWorker&) = delete;
+    QueryWorker& operator=(const QueryWorker&) = delete;
+
+    uint64_t post(QueryRequest request);
+    std::unique_ptr<QueryOutput> take();
+    void run();
+};
+
+// Follows the catalog file: rows appended to it are published as a delta snapshot shortly after they are written
+// (inotify on Linux, polling elsewhere), and once the delta grows past CATALOG_MERGE_ROWS, or the file is rewritten
+// rather than appended to, a full load rebuilds the main segment in the background and replaces the delta.
+constexpr int CATALOG_SETTLE_MS = 50; // waits for a burst of writes to finish before reading
+constexpr int CATALOG_POLL_MS = 250;  // how often the stop flag (and, without inotify, the file) is checked
+
+struct CatalogWatcher {
+    CatalogStore& store;
+    std::string filename;
+    std::function<void()> onPublish; // called from the watcher or merge thread after each publication
+    bool publishImage = false;       // merges also replace the shared catalog image
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> merging{false};
+    std::mutex refreshMutex; // orders delta publications against the merge's final catch-up
+    std::thread thread;
+    std::thread merger;
+
+    CatalogWatcher(CatalogStore& store, std::string filename, std::function<void()> onPublish = {}, bool publishImage = false);
+    ~CatalogWatcher();
+    CatalogWatcher(const CatalogWatcher&) = delete;
+    CatalogWatcher& operator=(const CatalogWatcher&) = delete;
+
+    void run();
+    void refresh();
+    void merge();
+};
+
+// Text query protocol, shared by the CLI and the server: one query per line of space-separated key=value pairs.
+// search="..." may contain spaces, and an unquoted search= takes the rest of the line. Keys:
+//   mode=features|lyrics|embeddings|neighbors|coplay   seed=<song id> or search=<text> with by=title|artist
+//   features=eda  margin=N  filter=1 (keep only songs matching the search)  metric=dot|l2  ef=N
+//   sort=artist|title|similar  algorithm=quick|merge  limit=N (rows written, 0 for all; default 10)
+//   like=E,D,A (seed a feature query with these values instead of a song; search= then only filters)
+// A result is a "# query N: ..." line followed by "N<TAB>id<TAB>artist<TAB>title<TAB>energy<TAB>dance<TAB>acoustic" rows.
+// Artist and title are written through escapeTextField, so a tab or line break inside one cannot split a row.
+constexpr size_t TEXT_QUERY_LIMIT = 10;
+constexpr std::array<const char*, 5> TEXT_QUERY_MODES = {"features", "lyrics", "embeddings", "neighbors", "coplay"}; // by recommendMode
+
+struct TextQuery {
+    QueryRequest request;
+    size_t limit = TEXT_QUERY_LIMIT;
+};
+
+bool parseCount(const std::string& text, int& out); // non-negative decimal, nothing else
+bool parseTextQuery(const std::string& line, size_t songCount, TextQuery& query, std::string& error);
+std::string formatTextQuery(const TextQuery& query);
+void writeTextResult(std::ostream& out, const std::vector<Song>& songs, size_t number, const TextQuery& query, const QueryOutput& output);
+std::string escapeTextField(std::string_view text); // \\, \t, \n and \r for the characters they name
+std::string unescapeTextField(std::string_view text);
+void writeTextRow(std::ostream& out, size_t number, const Song& s);
+bool parseTextRow(const std::string& line, Song& s); // the song of a result row; link and lyrics are not carried
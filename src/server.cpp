@@ -0,0 +1,709 @@
+// Recommendation server: answers text protocol queries (see recommender.h) over a Unix domain socket, so other
+// services can use the engine without the GUI.
+//
+//   MusicSuggestionsServer [--catalog songdata.csv] [--socket PATH] [--threads N] [--shared] [--shard I/N] [--stages FILE] [--trace FILE]
+//   MusicSuggestionsServer --shards a.sock,b.sock,... [--socket PATH] [--threads N] [--stages FILE] [--trace FILE]
+//
+// Clients may pipeline: any number of query lines can be written before reading, and responses come back in the
+// order the lines were sent. Each response is the query's result block followed by an empty line; a line that fails
+// to parse gets "# error: ..." instead. The line "stats" returns throughput and latency percentiles. Rows appended to
+// the catalog file are picked up within a second (see CatalogWatcher), and SIGHUP reloads the whole catalog in the
+// background; either way queries keep being answered from the old snapshot until the new one is published. With
+// --shared the catalog is attached from, or published to, the host's shared catalog image (see recommender.h).
+// --stages writes the per-stage latency percentiles (see StageTimer) to FILE on shutdown, and --trace the latest
+// events of every thread as Chrome trace JSON (see TraceScope).
+//
+// One thread multiplexes the sockets with poll() and queues complete lines; a fixed pool of workers takes up to
+// SERVER_BATCH queued lines at a time and answers them with one runQueries() call, so under load feature queries
+// share their pass over the catalog. Every worker reads the same catalog snapshot, which is never modified once
+// published.
+//
+// A catalog too large for one process can be split across several: each shard server runs with --shard I/N and loads
+// only the artists CatalogShard assigns it, and a coordinator started with --shards takes the queries. The
+// coordinator first asks the shards for the seed ("lookup <query>", answered with the seed's file offset and result
+// row), then sends the query to every shard at once, seeded with the song on the shard that holds it and with like=
+// its features on the others, and merges the shards' top rows. Shards number their songs on their own, so the
+// coordinator reports song I of shard S as I * N + S. Only feature queries can be split this way; the other modes
+// rank with indexes that are built per catalog and are answered by an unsharded server.
+#include "recommender.h"
+#ifndef _WIN32
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <queue>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#ifdef _WIN32
+int main() {
+    std::cerr << "The server needs Unix domain sockets; use MusicSuggestionsCli on this platform\n";
+    return 1;
+}
+#else
+
+constexpr size_t SERVER_BATCH = 64;           // most lines one worker answers with a single runQueries() call
+constexpr size_t SERVER_QUEUE_LIMIT = 4096;   // reading pauses while this many lines are waiting
+constexpr size_t SERVER_READ_CHUNK = 64 * 1024;
+constexpr size_t LATENCY_WINDOW = 1 << 16;    // latest samples kept for percentiles
+constexpr int SERVER_REPORT_SECONDS = 10;
+constexpr int SHARD_TIMEOUT_MS = 10000;       // a shard that answers nothing for this long fails the batch
+
+std::atomic<bool> serverStopping{false};
+std::atomic<bool> reloadRequested{false};
+
+struct Connection {
+    // one client socket. Lines get sequence numbers as they are read; finished responses wait in ready until every
+    // earlier one has been sent, which keeps pipelined responses in request order
+    int fd = -1;
+    std::string input;        // bytes read but not yet split into lines (I/O thread only)
+    uint64_t nextLine = 0;    // sequence number of the next line read (I/O thread only)
+    std::mutex writeMutex;
+    uint64_t nextToSend = 0;
+    std::map<uint64_t, std::string> ready;
+    bool broken = false;      // a send failed; later responses are dropped
+
+    explicit Connection(int fd) : fd(fd) {}
+    ~Connection() { ::close(fd); }
+
+    void deliver(uint64_t sequence, std::string response) {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        ready.emplace(sequence, std::move(response));
+        std::string out;
+        for (auto next = ready.begin(); next != ready.end() && next->first == nextToSend; next = ready.erase(next)) {
+            out += next->second;
+            nextToSend++;
+        }
+        for (size_t sent = 0; sent < out.size() && !broken;) {
+            ssize_t n = ::send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) broken = true;
+            else sent += static_cast<size_t>(n);
+        }
+    }
+};
+
+struct Job {
+    std::shared_ptr<Connection> connection;
+    uint64_t sequence;
+    std::string line;
+    std::chrono::steady_clock::time_point receivedAt;
+};
+
+struct LatencyLog {
+    // microseconds from a line being read to its response being sent, over the latest LATENCY_WINDOW queries
+    std::mutex mutex;
+    std::vector<uint32_t> samples = std::vector<uint32_t>(LATENCY_WINDOW);
+    uint64_t count = 0;
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+    void record(const std::vector<uint32_t>& batch) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (uint32_t us : batch) samples[count++ % LATENCY_WINDOW] = us;
+    }
+
+    uint64_t total() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return count;
+    }
+
+    std::string report() {
+        std::vector<uint32_t> window;
+        uint64_t total;
+        double seconds;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            total = count;
+            window.assign(samples.begin(), samples.begin() + std::min<uint64_t>(count, LATENCY_WINDOW));
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        }
+        auto percentile = [&](double p) -> uint32_t {
+            if (window.empty()) return 0;
+            auto at = window.begin() + static_cast<size_t>(p * (window.size() - 1));
+            std::nth_element(window.begin(), at, window.end());
+            return *at;
+        };
+        std::ostringstream out;
+        out << "queries=" << total << " qps=" << static_cast<uint64_t>(total / std::max(seconds, 1e-9))
+            << " p50_us=" << percentile(0.50) << " p99_us=" << percentile(0.99) << " max_us=" << percentile(1.0);
+        return out.str();
+    }
+};
+
+struct JobQueue {
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<Job> jobs;
+    bool stopping = false;
+
+    void push(std::vector<Job>& batch) {
+        if (batch.empty()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (Job& job : batch) jobs.push_back(std::move(job));
+        }
+        batch.clear();
+        wake.notify_all();
+    }
+
+    bool pop(std::vector<Job>& batch) {
+        // waits for work and takes up to SERVER_BATCH lines; false once stopping and drained
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this]() { return !jobs.empty() || stopping; });
+        if (jobs.empty()) return false;
+        size_t take = std::min(jobs.size(), SERVER_BATCH);
+        for (size_t i = 0; i < take; i++) {
+            batch.push_back(std::move(jobs.front()));
+            jobs.pop_front();
+        }
+        return true;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return jobs.size();
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+    }
+};
+
+void answerBatch(const Catalog& catalog, std::vector<Job>& batch, std::vector<std::string>& responses, LatencyLog& latency) {
+    // parses a batch of lines and answers the valid ones together, all against one catalog snapshot
+    TraceScope trace("answerBatch");
+    std::vector<TextQuery> queries;
+    std::vector<QueryRequest> requests;
+    std::vector<size_t> owner;
+    responses.assign(batch.size(), std::string());
+    for (size_t i = 0; i < batch.size(); i++) {
+        TextQuery query;
+        std::string error;
+        if (batch[i].line == "stats") {
+            responses[i] = "# stats " + latency.report() + " catalog_version=" + std::to_string(catalog.version)
+                + " catalog_delta=" + std::to_string(catalog.deltaSize());
+            if (catalog.shard.count > 1) responses[i] += " shard=" + std::to_string(catalog.shard.index) + "/" + std::to_string(catalog.shard.count);
+            responses[i] += "\n\n";
+        } else if (batch[i].line.rfind("lookup ", 0) == 0) {
+            // the seed a query would use, for a coordinator
+            Song seed;
+            if (!parseTextQuery(batch[i].line.substr(7), catalog.songs.size(), query, error)) {
+                responses[i] = "# error: " + error + "\n\n";
+            } else if (!resolveSeed(catalog.view(), query.request, seed)) {
+                responses[i] = "# seed: none\n\n";
+            } else {
+                // where its row sits in the file lets a coordinator pick the same search match one catalog would
+                std::ostringstream out;
+                out << "# seed at " << seed.link.offset << "\n";
+                writeTextRow(out, 0, seed);
+                out << '\n';
+                responses[i] = out.str();
+            }
+        } else if (!parseTextQuery(batch[i].line, catalog.songs.size(), query, error)) {
+            responses[i] = "# error: " + error + "\n\n";
+        } else {
+            requests.push_back(query.request);
+            queries.push_back(std::move(query));
+            owner.push_back(i);
+        }
+    }
+    std::vector<QueryOutput> outputs = runQueries(catalog.view(), requests, false);
+    for (size_t q = 0; q < outputs.size(); q++) {
+        std::ostringstream out;
+        writeTextResult(out, catalog.songs, batch[owner[q]].sequence + 1, queries[q], outputs[q]);
+        out << '\n';
+        responses[owner[q]] = out.str();
+    }
+}
+
+void deliverBatch(std::vector<Job>& batch, std::vector<std::string>& responses, LatencyLog& latency) {
+    // hands every response back in place and records how long each line took
+    std::vector<uint32_t> samples;
+    for (size_t i = 0; i < batch.size(); i++) {
+        batch[i].connection->deliver(batch[i].sequence, std::move(responses[i]));
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - batch[i].receivedAt).count();
+        samples.push_back(static_cast<uint32_t>(std::min<int64_t>(us, std::numeric_limits<uint32_t>::max())));
+    }
+    latency.record(samples);
+    batch.clear();
+}
+
+void serveJobs(const CatalogStore& store, JobQueue& queue, LatencyLog& latency) {
+    // worker loop: answers a batch against one snapshot, held by reference so no epoch stays pinned while it runs
+    std::vector<Job> batch;
+    std::vector<std::string> responses;
+    while (queue.pop(batch)) {
+        std::shared_ptr<const Catalog> catalog = store.acquire();
+        answerBatch(*catalog, batch, responses, latency);
+        catalog.reset();
+        deliverBatch(batch, responses, latency);
+    }
+}
+
+int connectSocket(const std::string& path) {
+    sockaddr_un address{};
+    if (path.size() >= sizeof(address.sun_path)) return -1;
+    address.sun_family = AF_UNIX;
+    std::copy(path.begin(), path.end(), address.sun_path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+struct ShardLinks {
+    // one coordinator worker's connections to the shard servers; a link that fails is reopened on the next batch
+    std::vector<std::string> paths;
+    std::vector<int> fds;
+
+    explicit ShardLinks(std::vector<std::string> paths) : paths(std::move(paths)), fds(this->paths.size(), -1) {}
+    ~ShardLinks() { drop(); }
+    ShardLinks(const ShardLinks&) = delete;
+    ShardLinks& operator=(const ShardLinks&) = delete;
+
+    void drop() {
+        for (int& fd : fds) {
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+        }
+    }
+
+    bool exchange(const std::vector<std::string>& requests, std::vector<std::vector<std::string>>& responses) {
+        // sends each shard its lines and reads back one response block per line. Sending and reading interleave
+        // under poll(), so a shard stalled on a full socket buffer is drained instead of deadlocking
+        size_t count = fds.size();
+        for (size_t s = 0; s < count; s++) {
+            if (fds[s] < 0 && !requests[s].empty()) fds[s] = connectSocket(paths[s]);
+            if (fds[s] < 0 && !requests[s].empty()) {
+                std::cerr << "Could not reach shard " << paths[s] << "\n";
+                return false;
+            }
+        }
+        std::vector<size_t> sent(count, 0), expected(count);
+        std::vector<std::string> input(count);
+        std::vector<pollfd> polled(count);
+        std::vector<char> chunk(SERVER_READ_CHUNK);
+        responses.assign(count, {});
+        for (size_t s = 0; s < count; s++) expected[s] = static_cast<size_t>(std::count(requests[s].begin(), requests[s].end(), '\n'));
+        while (true) {
+            bool pending = false;
+            for (size_t s = 0; s < count; s++) {
+                short events = (sent[s] < requests[s].size() ? POLLOUT : 0) | (responses[s].size() < expected[s] ? POLLIN : 0);
+                polled[s] = pollfd{events ? fds[s] : -1, events, 0};
+                pending = pending || events;
+            }
+            if (!pending) return true;
+            int ready = ::poll(polled.data(), polled.size(), SHARD_TIMEOUT_MS);
+            if (ready < 0 && errno == EINTR) continue;
+            bool failed = ready <= 0;
+            for (size_t s = 0; s < count && !failed; s++) {
+                if (polled[s].revents & POLLOUT) {
+                    ssize_t n = ::send(fds[s], requests[s].data() + sent[s], requests[s].size() - sent[s], MSG_NOSIGNAL | MSG_DONTWAIT);
+                    if (n > 0) sent[s] += static_cast<size_t>(n);
+                    else if (errno != EAGAIN && errno != EINTR) failed = true;
+                }
+                if (polled[s].revents & (POLLIN | POLLHUP | POLLERR)) {
+                    ssize_t n = ::recv(fds[s], chunk.data(), chunk.size(), MSG_DONTWAIT);
+                    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) failed = true;
+                    if (n <= 0) continue;
+                    input[s].append(chunk.data(), static_cast<size_t>(n));
+                    // a block ends with an empty line, and its own lines never are
+                    size_t begin = 0;
+                    for (size_t end; (end = input[s].find("\n\n", begin)) != std::string::npos; begin = end + 2)
+                        responses[s].push_back(input[s].substr(begin, end + 1 - begin));
+                    input[s].erase(0, begin);
+                }
+            }
+            if (failed) {
+                std::cerr << "Lost a shard mid-batch; reconnecting on the next one\n";
+                drop();
+                return false;
+            }
+        }
+    }
+};
+
+struct ShardedQuery {
+    size_t job = 0; // index in the batch
+    TextQuery query;
+    bool seeded = false;
+    Song seed;                                                   // the seed's features; id is its shard-local id
+    uint32_t seedShard = std::numeric_limits<uint32_t>::max();   // none for like= queries
+    uint64_t seedOffset = 0;                                     // the seed row's position in the catalog file
+    size_t total = 0;
+    double sortMs = 0.0;
+    std::vector<std::vector<Song>> rows; // each shard's top rows, in its order
+};
+
+std::vector<std::string> blockLines(const std::string& block) {
+    std::vector<std::string> lines;
+    std::istringstream in(block);
+    for (std::string line; std::getline(in, line);) lines.push_back(line);
+    return lines;
+}
+
+void answerSharded(ShardLinks& links, std::vector<Job>& batch, std::vector<std::string>& responses, LatencyLog& latency) {
+    // answers a batch through the shards in two pipelined round trips: one for the seeds, one for the results
+    TraceScope trace("answerSharded");
+    uint32_t count = static_cast<uint32_t>(links.fds.size());
+    std::vector<ShardedQuery> queries;
+    responses.assign(batch.size(), std::string());
+    for (size_t i = 0; i < batch.size(); i++) {
+        ShardedQuery q;
+        std::string error;
+        q.job = i;
+        if (batch[i].line == "stats") {
+            responses[i] = "# stats " + latency.report() + " shards=" + std::to_string(count) + "\n\n";
+        } else if (!parseTextQuery(batch[i].line, std::numeric_limits<uint32_t>::max(), q.query, error)) {
+            responses[i] = "# error: " + error + "\n\n";
+        } else if (q.query.request.recommendMode != 0) {
+            responses[i] = "# error: a sharded catalog answers feature queries only\n\n";
+        } else {
+            queries.push_back(std::move(q));
+        }
+    }
+    auto failAll = [&]() {
+        for (const ShardedQuery& q : queries) responses[q.job] = "# error: a shard is unavailable\n\n";
+    };
+    auto exchange = [&](const std::vector<std::string>& requests, std::vector<std::vector<std::string>>& answers) {
+        // a link to a shard that has since restarted fails once; the queries only read, so they are simply resent
+        return links.exchange(requests, answers) || links.exchange(requests, answers);
+    };
+
+    // seeds: a song id names its shard, a search asks them all and takes the match nearest the start of the file,
+    // as findSeed would in one catalog
+    std::vector<std::string> requests(count);
+    std::vector<std::vector<size_t>> askedBy(count);
+    for (size_t k = 0; k < queries.size(); k++) {
+        const QueryRequest& r = queries[k].query.request;
+        if (r.seedFromFeatures) {
+            queries[k].seed.energy = r.likeSeed[0];
+            queries[k].seed.danceability = r.likeSeed[1];
+            queries[k].seed.acousticness = r.likeSeed[2];
+            queries[k].seeded = true;
+        } else if (r.pinnedSeed != std::numeric_limits<uint32_t>::max()) {
+            requests[r.pinnedSeed % count] += "lookup seed=" + std::to_string(r.pinnedSeed / count) + "\n";
+            askedBy[r.pinnedSeed % count].push_back(k);
+        } else {
+            for (uint32_t s = 0; s < count; s++) {
+                requests[s] += "lookup " + formatTextQuery(queries[k].query) + "\n";
+                askedBy[s].push_back(k);
+            }
+        }
+    }
+    std::vector<std::vector<std::string>> answers;
+    if (!exchange(requests, answers)) return failAll();
+    for (uint32_t s = 0; s < count; s++) {
+        for (size_t a = 0; a < answers[s].size(); a++) {
+            ShardedQuery& q = queries[askedBy[s][a]];
+            std::vector<std::string> lines = blockLines(answers[s][a]);
+            Song seed;
+            if (lines.size() < 2 || lines[0].rfind("# seed at ", 0) != 0 || !parseTextRow(lines[1], seed)) continue;
+            uint64_t offset = std::strtoull(lines[0].c_str() + 10, nullptr, 10);
+            if (q.seeded && offset >= q.seedOffset) continue;
+            q.seed = std::move(seed);
+            q.seeded = true;
+            q.seedShard = s;
+            q.seedOffset = offset;
+        }
+    }
+
+    // results: the seed's shard runs the query as asked, the others rank against its features
+    requests.assign(count, std::string());
+    std::vector<size_t> running;
+    for (size_t k = 0; k < queries.size(); k++) {
+        ShardedQuery& q = queries[k];
+        const QueryRequest& r = q.query.request;
+        if (!q.seeded) {
+            std::ostringstream out;
+            if (r.pinnedSeed != std::numeric_limits<uint32_t>::max()) out << "# error: no song has id " << r.pinnedSeed << "\n\n";
+            else out << "# query " << batch[q.job].sequence + 1 << ": no seed matches \"" << r.search << "\"\n\n";
+            responses[q.job] = out.str();
+            continue;
+        }
+        for (uint32_t s = 0; s < count; s++) {
+            TextQuery local = q.query;
+            local.request.pinnedSeed = s == q.seedShard ? q.seed.id : std::numeric_limits<uint32_t>::max();
+            local.request.seedFromFeatures = s != q.seedShard;
+            local.request.likeSeed[0] = q.seed.energy;
+            local.request.likeSeed[1] = q.seed.danceability;
+            local.request.likeSeed[2] = q.seed.acousticness;
+            requests[s] += formatTextQuery(local) + "\n";
+        }
+        q.rows.resize(count);
+        running.push_back(k);
+    }
+    if (!exchange(requests, answers)) return failAll();
+    for (uint32_t s = 0; s < count; s++) {
+        for (size_t a = 0; a < answers[s].size(); a++) {
+            ShardedQuery& q = queries[running[a]];
+            std::vector<std::string> lines = blockLines(answers[s][a]);
+            if (lines.empty() || lines[0].rfind("# query ", 0) != 0) {
+                responses[q.job] = answers[s][a] + "\n"; // a shard's error stands for the whole query
+                continue;
+            }
+            // "# query N: seed ..., mode features, C results, sort T ms"
+            size_t results = lines[0].rfind(" results, sort ");
+            size_t number = lines[0].rfind(", ", results);
+            if (results != std::string::npos && number != std::string::npos) {
+                q.total += std::strtoull(lines[0].c_str() + number + 2, nullptr, 10);
+                q.sortMs = std::max(q.sortMs, std::strtod(lines[0].c_str() + results + 15, nullptr));
+            }
+            for (size_t l = 1; l < lines.size(); l++) {
+                Song row;
+                if (!parseTextRow(lines[l], row)) continue;
+                row.id = row.id * count + s;
+                q.rows[s].push_back(std::move(row));
+            }
+        }
+    }
+
+    // k-way merge of the shards' sorted rows, ties going to the lower shard
+    for (size_t k : running) {
+        ShardedQuery& q = queries[k];
+        if (!responses[q.job].empty()) continue;
+        const QueryRequest& r = q.query.request;
+        size_t number = batch[q.job].sequence + 1;
+        QueryArenaScope scope; // the sort keys orderedBefore() builds last until the query is merged
+        std::vector<size_t> next(count, 0);
+        auto after = [&](uint32_t a, uint32_t b) {
+            const Song& x = q.rows[a][next[a]];
+            const Song& y = q.rows[b][next[b]];
+            if (orderedBefore(y, x, r, q.seed)) return true;
+            return !orderedBefore(x, y, r, q.seed) && a > b;
+        };
+        std::priority_queue<uint32_t, std::vector<uint32_t>, decltype(after)> heads(after);
+        for (uint32_t s = 0; s < count; s++) if (!q.rows[s].empty()) heads.push(s);
+        std::ostringstream out;
+        if (r.seedFromFeatures) out << "# query " << number << ": seed like " << r.likeSeed[0] << "," << r.likeSeed[1] << "," << r.likeSeed[2];
+        else out << "# query " << number << ": seed " << q.seed.id * count + q.seedShard << " " << escapeTextField(q.seed.artist) << " - " << escapeTextField(q.seed.title);
+        out << ", mode " << TEXT_QUERY_MODES[0] << ", " << q.total << " results, sort " << q.sortMs << " ms\n";
+        for (size_t shown = 0; !heads.empty() && (q.query.limit == 0 || shown < q.query.limit); shown++) {
+            uint32_t s = heads.top();
+            heads.pop();
+            writeTextRow(out, number, q.rows[s][next[s]]);
+            if (++next[s] < q.rows[s].size()) heads.push(s);
+        }
+        out << '\n';
+        responses[q.job] = out.str();
+    }
+}
+
+void serveShards(const std::vector<std::string>& shardSockets, JobQueue& queue, LatencyLog& latency) {
+    // coordinator worker loop, with its own links so batches on different workers never share a socket
+    ShardLinks links(shardSockets);
+    std::vector<Job> batch;
+    std::vector<std::string> responses;
+    while (queue.pop(batch)) {
+        answerSharded(links, batch, responses, latency);
+        deliverBatch(batch, responses, latency);
+    }
+}
+
+int openListener(const std::string& path) {
+    // binds a fresh stream socket at path, replacing a stale one left by an earlier run
+    sockaddr_un address{};
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path too long: " << path << "\n";
+        return -1;
+    }
+    address.sun_family = AF_UNIX;
+    std::copy(path.begin(), path.end(), address.sun_path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    ::unlink(path.c_str());
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(fd, SOMAXCONN) != 0) {
+        std::cerr << "Could not listen on " << path << ": " << std::strerror(errno) << "\n";
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool parseShard(const std::string& text, CatalogShard& shard) {
+    // "I/N", the I-th of N shards counting from 0
+    size_t slash = text.find('/');
+    int index = 0, count = 0;
+    if (slash == std::string::npos || !parseCount(text.substr(0, slash), index) || !parseCount(text.substr(slash + 1), count) || index >= count) return false;
+    shard.index = static_cast<uint32_t>(index);
+    shard.count = static_cast<uint32_t>(count);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    std::string catalogFile = "songdata.csv", socketPath = "/tmp/music-suggestions.sock", stagesFile, traceFile;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    bool shared = false;
+    CatalogShard shard;
+    std::vector<std::string> shardSockets;
+    bool usage = false;
+    for (int i = 1; i < argc && !usage; i++) {
+        std::string arg = argv[i];
+        int number = 0;
+        if (arg == "--catalog" && i + 1 < argc) {
+            catalogFile = argv[++i];
+        } else if (arg == "--socket" && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc && parseCount(argv[i + 1], number) && number > 0) {
+            threads = static_cast<size_t>(number);
+            i++;
+        } else if (arg == "--shared") {
+            shared = true;
+        } else if (arg == "--shard" && i + 1 < argc && parseShard(argv[i + 1], shard)) {
+            i++;
+        } else if (arg == "--stages" && i + 1 < argc) {
+            stagesFile = argv[++i];
+        } else if (arg == "--trace" && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if (arg == "--shards" && i + 1 < argc && shardSockets.empty()) {
+            std::istringstream paths(argv[++i]);
+            for (std::string path; std::getline(paths, path, ',');) if (!path.empty()) shardSockets.push_back(path);
+        } else {
+            usage = true;
+        }
+    }
+    if (usage || (!shardSockets.empty() && (shared || shard.count > 1))) {
+        std::cerr << "usage: " << argv[0] << " [--catalog songdata.csv] [--socket PATH] [--threads N] [--shared] [--shard I/N] [--stages FILE] [--trace FILE]\n"
+                  << "       " << argv[0] << " --shards a.sock,b.sock,... [--socket PATH] [--threads N] [--stages FILE] [--trace FILE]\n";
+        return 2;
+    }
+
+    if (!traceFile.empty()) {
+        nameTraceThread("server io");
+        startTrace();
+    }
+    // a coordinator holds no catalog, only links to the shards
+    std::unique_ptr<CatalogStore> store;
+    std::string serving = std::to_string(shardSockets.size()) + " shards";
+    if (shardSockets.empty()) {
+        std::unique_ptr<Catalog> initialCatalog = shared ? loadCatalogShared(catalogFile, shard) : loadCatalog(catalogFile, shard);
+        if (initialCatalog->songs.empty()) {
+            std::cerr << "No songs loaded from " << catalogFile << "\n";
+            return 1;
+        }
+        initialCatalog->waitForNeighborGraph(); // neighbor queries should not fall back to features while serving
+        serving = std::to_string(initialCatalog->songs.size()) + " songs";
+        if (shard.count > 1) serving += " (shard " + std::to_string(shard.index) + "/" + std::to_string(shard.count) + ")";
+        store = std::make_unique<CatalogStore>(std::move(initialCatalog));
+    }
+
+    int listener = openListener(socketPath);
+    if (listener < 0) return 1;
+    std::signal(SIGINT, [](int) { serverStopping.store(true); });
+    std::signal(SIGTERM, [](int) { serverStopping.store(true); });
+    std::signal(SIGHUP, [](int) { reloadRequested.store(true); });
+
+    JobQueue queue;
+    LatencyLog latency;
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) workers.emplace_back([&, t]() {
+        nameTraceThread("server worker " + std::to_string(t));
+        if (store) serveJobs(*store, queue, latency);
+        else serveShards(shardSockets, queue, latency);
+    });
+    std::cout << "Serving " << serving << " on " << socketPath << " with " << threads << " workers\n";
+
+    std::vector<std::shared_ptr<Connection>> connections;
+    std::vector<pollfd> polled;
+    std::vector<Job> incoming;
+    std::vector<char> chunk(SERVER_READ_CHUNK);
+    auto lastReport = std::chrono::steady_clock::now();
+    uint64_t reportedCount = 0;
+    std::unique_ptr<CatalogWatcher> watcher;
+    if (store) watcher = std::make_unique<CatalogWatcher>(*store, catalogFile, std::function<void()>(), shared);
+    std::thread reloader;
+    std::atomic<bool> reloading{false};
+    while (!serverStopping.load()) {
+        if (reloadRequested.exchange(false) && store && !reloading.load()) {
+            // the new catalog is loaded and fully indexed off to the side, then swapped in between two batches
+            if (reloader.joinable()) reloader.join();
+            reloading.store(true);
+            reloader = std::thread([&]() {
+                TaskPriorityScope background(TaskPriority::Background); // queries keep being answered first
+                std::unique_ptr<Catalog> next = loadCatalog(catalogFile, shard);
+                if (next->songs.empty()) {
+                    std::cerr << "Reload found no songs in " << catalogFile << "; keeping the current catalog\n";
+                } else {
+                    next->waitForNeighborGraph();
+                    if (shared && !saveCatalogImage(*next, catalogImagePath(catalogFile, shard))) std::cerr << "Could not write the shared catalog image\n";
+                    size_t count = next->songs.size();
+                    std::lock_guard<std::mutex> lock(watcher->refreshMutex); // a delta must not land on the old catalog after this
+                    store->publish(std::move(next));
+                    std::cerr << "Reloaded " << count << " songs\n";
+                }
+                reloading.store(false);
+            });
+        }
+        // stops reading while the workers are behind, leaving the backlog in the clients' socket buffers
+        bool throttled = queue.size() >= SERVER_QUEUE_LIMIT;
+        polled.assign(1, pollfd{listener, POLLIN, 0});
+        for (const auto& connection : connections) polled.push_back(pollfd{connection->fd, static_cast<short>(throttled ? 0 : POLLIN), 0});
+        int ready = ::poll(polled.data(), polled.size(), throttled ? 1 : 200);
+        if (ready < 0 && errno != EINTR) break;
+
+        if (polled[0].revents & POLLIN) {
+            int fd = ::accept(listener, nullptr, nullptr);
+            if (fd >= 0) connections.push_back(std::make_shared<Connection>(fd));
+        }
+        auto now = std::chrono::steady_clock::now();
+        for (size_t c = 0; c + 1 < polled.size(); c++) { // a connection accepted just now was not polled yet
+            short events = polled[c + 1].revents;
+            if (!events) continue;
+            Connection& connection = *connections[c];
+            ssize_t n = (events & POLLIN) ? ::recv(connection.fd, chunk.data(), chunk.size(), 0) : 0;
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                // the client closed; queued jobs keep the connection alive until their responses are written
+                connections[c].reset();
+                continue;
+            }
+            connection.input.append(chunk.data(), static_cast<size_t>(n));
+            size_t begin = 0;
+            for (size_t eol; (eol = connection.input.find('\n', begin)) != std::string::npos; begin = eol + 1) {
+                std::string line = connection.input.substr(begin, eol - begin);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                if (line.find_first_not_of(" \t") == std::string::npos) continue;
+                incoming.push_back(Job{connections[c], connection.nextLine++, std::move(line), now});
+            }
+            connection.input.erase(0, begin);
+        }
+        std::erase(connections, nullptr);
+        queue.push(incoming);
+
+        if (now - lastReport >= std::chrono::seconds(SERVER_REPORT_SECONDS)) {
+            uint64_t count = latency.total();
+            if (count != reportedCount) std::cerr << latency.report() << "\n";
+            reportedCount = count;
+            lastReport = now;
+        }
+    }
+
+    std::cerr << "Shutting down: " << latency.report() << "\n";
+    if (reloader.joinable()) reloader.join();
+    queue.stop();
+    for (auto& worker : workers) worker.join();
+    connections.clear();
+    ::close(listener);
+    ::unlink(socketPath.c_str());
+    if (!traceFile.empty() && !stopTrace(traceFile)) {
+        std::cerr << "Could not write " << traceFile << "\n";
+        return 1;
+    }
+    if (!stagesFile.empty() && !(std::ofstream(stagesFile) << stageReport())) {
+        std::cerr << "Could not write " << stagesFile << "\n";
+        return 1;
+    }
+    return 0;
+}
+#endif
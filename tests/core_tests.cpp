@@ -0,0 +1,234 @@
+// Engine tests: each one is named on the command line and registered with CTest (see CMakeLists.txt)
+#include "recommender.h"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string& what) {
+    if (ok) return;
+    std::cerr << "FAILED: " << what << "\n";
+    failures++;
+}
+
+std::string lyricsFor(size_t song) {
+    // 24 words no other song shares, so only repeats and spelling variants fold together
+    std::string text;
+    for (size_t w = 0; w < 24; w++) {
+        std::string word;
+        for (size_t n = song * 24 + w + 1; n > 0; n /= 26) word += static_cast<char>('a' + n % 26);
+        text += (w ? " " : "") + word;
+    }
+    return text;
+}
+
+std::string csvRow(const std::string& artist, const std::string& title, const std::string& lyrics) {
+    return artist + "," + title + ",/" + artist + ".html,\"" + lyrics + "\"\n";
+}
+
+const Song* findSong(const Catalog& c, const std::string& artist, const std::string& title) {
+    for (const Song& s : c.songs) {
+        if (s.artist == artist && s.title == title && (s.id >= c.tombstones.size() || !c.tombstones[s.id])) return &s;
+    }
+    return nullptr;
+}
+
+void catalogLog() {
+    // a full load resolves updates, deletes and duplicates; the same rows appended later apply as a delta, and a
+    // reload of the whole file ends up with the songs the delta snapshot serves
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / ("music-suggestions-test-" + std::to_string(std::random_device{}()));
+    std::filesystem::create_directories(dir / "resources");
+    std::filesystem::current_path(dir);
+    const size_t songs = 40;
+    {
+        std::ofstream out("resources/songdata.csv");
+        out << "artist,song,link,text\n";
+        for (size_t i = 0; i < songs; i++) out << csvRow("Artist" + std::to_string(i), "Song " + std::to_string(i), lyricsFor(i));
+        out << csvRow("Artist3", "Song 3", lyricsFor(3));  // exact repeat
+        out << csvRow("Artist3", "Song 3!", lyricsFor(3)); // spelling variant
+        out << csvRow("Artist5", "Song 5", std::string(CATALOG_UPDATE_MARKER) + " " + lyricsFor(100));
+        out << "Artist7,Song 7,/Artist7.html," << CATALOG_DELETE_MARKER << "\n";
+    }
+    std::unique_ptr<Catalog> c = loadCatalog("songdata.csv");
+    c->waitForNeighborGraph();
+    check(c->songs.size() == songs - 1, "the delete drops one song and duplicates fold");
+    for (size_t i = 0; i < c->songs.size(); i++) check(c->songs[i].id == i, "ids are positions");
+    check(c->songs[5].artist == "Artist5" && c->cold.read(c->songs[5].lyrics) == lyricsFor(100), "an update replaces the song in place");
+    check(findSong(*c, "Artist7", "Song 7") == nullptr, "a delete removes the song");
+    check(c->songs[8].artist == "Artist9", "later songs move up past a delete");
+    auto group = c->main->duplicates.find(3);
+    check(group != c->main->duplicates.end() && group->second.size() == 2, "the repeat and the variant fold into the first row");
+
+    {
+        std::ofstream out("resources/songdata.csv", std::ios::app);
+        out << csvRow("Artist40", "Song 40", lyricsFor(40));
+        out << csvRow("Artist1", "Song 1", std::string(CATALOG_UPDATE_MARKER) + " " + lyricsFor(101));
+        out << "Artist2,Song 2,/Artist2.html," << CATALOG_DELETE_MARKER << "\n";
+    }
+    bool rewritten = true;
+    std::unique_ptr<Catalog> delta = appendCatalogDelta(*c, resourcePath("songdata.csv").string(), rewritten);
+    check(delta != nullptr && !rewritten, "appended rows apply as a delta");
+    if (delta) {
+        check(delta->deltaSize() == 3, "the delta counts the added, updated and deleted rows");
+        check(delta->songs[1].artist == "Artist1" && delta->cold.read(delta->songs[1].lyrics) == lyricsFor(101), "a delta update keeps the song's id");
+        check(delta->tombstones[2] == 1, "a delta delete buries the song");
+        check(delta->songs.back().artist == "Artist40" && delta->songs.back().id == c->songs.size(), "an added song takes the next id");
+
+        std::unique_ptr<Catalog> reloaded = loadCatalog("songdata.csv");
+        std::vector<std::string> live, full;
+        for (const Song& s : delta->songs) {
+            if (!delta->tombstones[s.id]) live.push_back(s.artist + "/" + s.title + "/" + delta->cold.read(s.lyrics));
+        }
+        for (const Song& s : reloaded->songs) full.push_back(s.artist + "/" + s.title + "/" + reloaded->cold.read(s.lyrics));
+        check(live == full, "a reload serves the songs the delta snapshot does, in the same order");
+        reloaded->waitForNeighborGraph();
+    }
+    std::filesystem::current_path(dir.parent_path());
+    std::filesystem::remove_all(dir);
+}
+
+void coPlaySessions() {
+    // two sessions over disjoint songs: every co-play link stays inside its own session
+    std::filesystem::path log = std::filesystem::temp_directory_path() / ("music-suggestions-plays-" + std::to_string(std::random_device{}()) + ".tsv");
+    const size_t songs = 12;
+    std::unordered_map<uint64_t, uint32_t> idByKey;
+    for (uint32_t i = 0; i < songs; i++) idByKey[songKeyHash("Artist" + std::to_string(i), "Song " + std::to_string(i))] = i;
+    {
+        std::ofstream out(log);
+        for (size_t round = 0; round < 3; round++) {
+            for (uint32_t i = 0; i < songs; i++) out << (i < songs / 2 ? "first" : "second") << "\tArtist" << i << "\tSong " << i << "\n";
+        }
+    }
+    NeighborGraph graph = buildCoPlayGraph({log}, idByKey, songs, CF_TOP_N);
+    std::filesystem::remove(log);
+    check(graph.neighbors.size() > 0, "plays within a session are linked");
+    for (uint32_t id = 0; id < songs; id++) {
+        for (const uint32_t* n = graph.begin(id); n != graph.end(id); n++) {
+            check((id < songs / 2) == (*n < songs / 2), "song " + std::to_string(id) + " is linked to " + std::to_string(*n) + " across sessions");
+        }
+    }
+}
+
+EmbeddingTable clusteredEmbeddings(size_t count, size_t dim, uint32_t seed) {
+    // points scattered around 20 random centers, so neighborhoods are well defined
+    EmbeddingTable table;
+    table.dim = dim;
+    table.stride = (dim + 7) / 8 * 8;
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> spread(0.0f, 1.0f);
+    std::vector<float> centers(20 * dim);
+    for (float& x : centers) x = spread(rng) * 10.0f;
+    std::vector<float> data(count * table.stride, 0.0f);
+    for (size_t i = 0; i < count; i++) {
+        const float* center = &centers[(i % 20) * dim];
+        for (size_t d = 0; d < dim; d++) data[i * table.stride + d] = center[d] + spread(rng);
+    }
+    table.data = Column<float>(std::move(data));
+    table.hasEmbedding = Column<uint8_t>(std::vector<uint8_t>(count, 1));
+    return table;
+}
+
+template <typename Search>
+double recallAt10(const EmbeddingTable& table, EmbeddingMetric metric, Search search) {
+    // against the exact scan, over 100 evenly spaced songs
+    size_t hits = 0, total = 0;
+    for (uint32_t id = 0; id < table.hasEmbedding.size(); id += static_cast<uint32_t>(table.hasEmbedding.size() / 100)) {
+        std::vector<uint32_t> truth;
+        for (const auto& [n, score] : nearestEmbeddings(table, table.row(id), 10, metric, id)) truth.push_back(n);
+        std::sort(truth.begin(), truth.end());
+        for (const auto& [n, score] : search(id)) hits += std::binary_search(truth.begin(), truth.end(), n);
+        total += truth.size();
+    }
+    return total ? static_cast<double>(hits) / total : 0.0;
+}
+
+void embeddingRecall() {
+    EmbeddingTable table = clusteredEmbeddings(4000, 24, 7);
+    HNSWIndex graph = buildHNSW(table, 1);
+    double hnsw = recallAt10(table, EmbeddingMetric::L2, [&](uint32_t id) { return searchHNSW(graph, table, table.row(id), 10, 64, id); });
+    std::cout << "HNSW recall@10 " << hnsw << "\n";
+    check(hnsw >= 0.95, "HNSW at ef 64 finds the exact neighbors");
+
+    PQIndex index = buildPQIndex(table, 12, 32);
+    for (EmbeddingMetric metric : {EmbeddingMetric::L2, EmbeddingMetric::Dot}) {
+        tunePQ(index, table, metric, PQ_TARGET_RECALL);
+        double pq = recallAt10(table, metric, [&](uint32_t id) { return searchPQ(index, table, table.row(id), 10, metric, id); });
+        std::cout << "PQ recall@10 " << pq << " (" << (metric == EmbeddingMetric::L2 ? "l2" : "dot") << ")\n";
+        check(pq >= PQ_TARGET_RECALL - 0.05, "tuned PQ search reaches its recall target");
+    }
+}
+
+void textProtocol() {
+    const std::vector<std::string> lines = {
+        "seed=3 mode=neighbors limit=0",
+        "mode=features search=\"Song 12\" by=title features=ed margin=20 sort=similar algorithm=merge limit=5",
+        "mode=embeddings metric=l2 ef=128 seed=7",
+        "like=10,20,30 features=eda filter=1 sort=title",
+        "mode=lyrics by=artist search=rest of the line, kept \"as is\"",
+    };
+    for (const std::string& line : lines) {
+        TextQuery query, again;
+        std::string error;
+        check(parseTextQuery(line, 100, query, error), "parses \"" + line + "\": " + error);
+        std::string formatted = formatTextQuery(query);
+        check(parseTextQuery(formatted, 100, again, error), "parses its own format \"" + formatted + "\": " + error);
+        check(again.request == query.request && again.limit == query.limit, "format round-trips \"" + line + "\"");
+        check(formatTextQuery(again) == formatted, "formatting is stable for \"" + line + "\"");
+    }
+    for (const char* bad : {"seed=100", "mode=nothing seed=1", "seed=1 sort=size", "like=1,2,3 mode=lyrics", "limit=4", "seed=-1"}) {
+        TextQuery query;
+        std::string error;
+        check(!parseTextQuery(bad, 100, query, error) && !error.empty(), "rejects \"" + std::string(bad) + "\"");
+    }
+
+    // quoted CSV fields can hold tabs and line breaks, which must not shift the columns
+    for (const std::string& title : {std::string("A Title, with \"quotes\""), std::string("Tab\there"), std::string("Two\nlines\r"),
+                                     std::string("Back\\slash \\t not a tab\\")}) {
+        Song s;
+        s.id = 42;
+        s.artist = "Some\tArtist";
+        s.title = title;
+        s.energy = 1;
+        s.danceability = 50;
+        s.acousticness = 100;
+        std::ostringstream out;
+        writeTextRow(out, 3, s);
+        std::string row = out.str();
+        check(std::count(row.begin(), row.end(), '\n') == 1 && row.back() == '\n', "a row is one line");
+        check(std::count(row.begin(), row.end(), '\t') == 6, "a row has seven columns");
+        Song back;
+        check(parseTextRow(row.substr(0, row.size() - 1), back), "parses a written row");
+        check(back.id == s.id && back.artist == s.artist && back.title == s.title && back.energy == s.energy &&
+              back.danceability == s.danceability && back.acousticness == s.acousticness, "a row round-trips for \"" + title + "\"");
+    }
+    Song back;
+    check(!parseTextRow("3\t42\tonly three", back), "rejects a short row");
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    const std::pair<const char*, void (*)()> tests[] = {
+        {"catalog_log", catalogLog},
+        {"co_play_sessions", coPlaySessions},
+        {"embedding_recall", embeddingRecall},
+        {"text_protocol", textProtocol},
+    };
+    size_t ran = 0;
+    for (const auto& [name, test] : tests) {
+        if (argc > 1 && std::strcmp(argv[1], name) != 0) continue;
+        test();
+        ran++;
+    }
+    if (ran == 0) {
+        std::cerr << "unknown test " << argv[1] << "\n";
+        return 2;
+    }
+    return failures == 0 ? 0 : 1;
+}